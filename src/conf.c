@@ -18,6 +18,7 @@
 
 #include "log.h"
 #include "onvif_simple_server.h"
+#include "relay_backend.h"
 #include "utils.h"
 
 #include <errno.h>
@@ -34,6 +35,7 @@
 extern service_context_t service_ctx;
 
 static void get_string_from_json(char **var, JsonValue *j, const char *name);
+void get_int_from_json(int *var, JsonValue *j, char *name);
 
 static char *dup_cstring(const char *src)
 {
@@ -229,6 +231,7 @@ static void parse_focus_continuous(JsonValue *node, imaging_focus_continuous_mov
 
     get_string_from_json(&target->command, node, "command");
     parse_float_value(get_object_item(node, "speed"), &target->speed);
+    get_int_from_json(&target->timeout_ms, node, "timeout_ms");
     if (target->command)
         target->supported = 1;
 }
@@ -244,6 +247,25 @@ static void parse_focus_move(JsonValue *node, imaging_focus_move_config_t *targe
     get_string_from_json(&target->cmd_stop, node, "stop_command");
 }
 
+static void parse_ircut_gpio(JsonValue *node, imaging_ircut_gpio_t *target)
+{
+    target->pins[0] = -1;
+    target->pins[1] = -1;
+    if (!node || node->type != JSON_OBJECT)
+        return;
+
+    JsonValue *pins = get_object_item(node, "pins");
+    if (pins && pins->type == JSON_ARRAY) {
+        int pins_len = get_array_size(pins);
+        for (int j = 0; j < pins_len && j < 2; j++) {
+            JsonValue *pin = get_array_item(pins, j);
+            if (pin && pin->type == JSON_NUMBER)
+                target->pins[j] = (int) pin->value.number.integer;
+        }
+    }
+    get_int_from_json(&target->pulse_ms, node, "pulse_ms");
+}
+
 static void parse_white_balance(JsonValue *node, imaging_white_balance_config_t *target)
 {
     if (!node || !target || node->type != JSON_OBJECT)
@@ -772,6 +794,84 @@ static void event_set_source(event_t *ev, int idx, const char *name, const char
         ev->sources_num = idx + 1;
 }
 
+/*
+ * Fill axis i of t with the conversion of the ONVIF range [onvif_min,
+ * onvif_max] to the motor range [steps_min, steps_max]. A relative transform
+ * converts deltas: no offset, clamped to +/- the motor span.
+ */
+static void ptz_transform_to_machine(
+    ptz_transform_t *t, int i, double steps_min, double steps_max, double onvif_min, double onvif_max, int invert, int relative)
+{
+    double span_steps = steps_max - steps_min;
+    double k;
+
+    if (onvif_max <= onvif_min) {
+        t->scale[i] = 0.0;
+        t->offset[i] = steps_min;
+        t->min[i] = steps_min;
+        t->max[i] = steps_min;
+        return;
+    }
+    k = span_steps / (onvif_max - onvif_min);
+    if (relative) {
+        t->scale[i] = invert ? -k : k;
+        t->offset[i] = 0.0;
+        t->min[i] = -span_steps;
+        t->max[i] = span_steps;
+    } else {
+        // Inverted: value -> onvif_max - (value - onvif_min)
+        t->scale[i] = invert ? -k : k;
+        t->offset[i] = invert ? onvif_max * k + steps_min : steps_min - onvif_min * k;
+        t->min[i] = steps_min;
+        t->max[i] = steps_max;
+    }
+}
+
+// Axis i of t: motor position -> ONVIF position in [onvif_min, onvif_max]
+static void ptz_transform_to_onvif(ptz_transform_t *t, int i, double steps_min, double steps_max, double onvif_min, double onvif_max, int invert)
+{
+    double k;
+
+    if (steps_max <= steps_min) {
+        t->scale[i] = 0.0;
+        t->offset[i] = onvif_min;
+        t->min[i] = onvif_min;
+        t->max[i] = onvif_min;
+        return;
+    }
+    k = (onvif_max - onvif_min) / (steps_max - steps_min);
+    t->scale[i] = invert ? -k : k;
+    t->offset[i] = invert ? onvif_max + steps_min * k : onvif_min - steps_min * k;
+    t->min[i] = onvif_min;
+    t->max[i] = onvif_max;
+}
+
+static void ptz_build_transforms(ptz_node_t *n)
+{
+    ptz_transform_to_machine(&n->to_machine_generic, 0, n->min_step_x, n->max_step_x, -1.0, 1.0, n->pan_inverted, 0);
+    ptz_transform_to_machine(&n->to_machine_generic, 1, n->min_step_y, n->max_step_y, -1.0, 1.0, n->tilt_inverted, 0);
+    ptz_transform_to_machine(&n->to_machine_generic, 2, n->min_step_z, n->max_step_z, 0.0, 1.0, 0, 0);
+
+    ptz_transform_to_machine(&n->to_machine_spherical, 0, n->min_step_x, n->max_step_x, n->pan_min, n->pan_max, n->pan_inverted, 0);
+    ptz_transform_to_machine(&n->to_machine_spherical, 1, n->min_step_y, n->max_step_y, n->tilt_min, n->tilt_max, n->tilt_inverted, 0);
+    ptz_transform_to_machine(&n->to_machine_spherical, 2, n->min_step_z, n->max_step_z, 0.0, 1.0, 0, 0);
+
+    ptz_transform_to_machine(&n->to_machine_translation, 0, n->min_step_x, n->max_step_x, n->pan_min, n->pan_max, n->pan_inverted, 1);
+    ptz_transform_to_machine(&n->to_machine_translation, 1, n->min_step_y, n->max_step_y, n->tilt_min, n->tilt_max, n->tilt_inverted, 1);
+    ptz_transform_to_machine(&n->to_machine_translation, 2, n->min_step_z, n->max_step_z, 0.0, 1.0, 0, 1);
+
+    ptz_transform_to_machine(&n->to_machine_fov, 0, n->min_step_x, n->max_step_x, n->pan_min, n->pan_max, n->pan_inverted, 1);
+    ptz_transform_to_machine(&n->to_machine_fov, 1, n->min_step_y, n->max_step_y, n->tilt_min, n->tilt_max, n->tilt_inverted, 1);
+    ptz_transform_to_machine(&n->to_machine_fov, 2, n->min_step_z, n->max_step_z, 0.0, 1.0, 0, 1);
+    // TranslationSpaceFov values are fractions of half the field of view
+    n->to_machine_fov.scale[0] *= n->fov_pan / 2.0;
+    n->to_machine_fov.scale[1] *= n->fov_tilt / 2.0;
+
+    ptz_transform_to_onvif(&n->to_onvif, 0, n->min_step_x, n->max_step_x, n->pan_min, n->pan_max, n->pan_inverted);
+    ptz_transform_to_onvif(&n->to_onvif, 1, n->min_step_y, n->max_step_y, n->tilt_min, n->tilt_max, n->tilt_inverted);
+    ptz_transform_to_onvif(&n->to_onvif, 2, n->min_step_z, n->max_step_z, 0.0, 1.0, 0);
+}
+
 int process_json_conf_file(char *file)
 {
     JsonValue *value, *item;
@@ -781,6 +881,9 @@ int process_json_conf_file(char *file)
     int i;
     char stmp[MAX_LEN];
 
+    // Anything cached from this configuration is keyed on the file identity
+    service_ctx.conf_generation = file_generation(file);
+
     json_file = load_config(file);
     if (json_file == NULL) {
         log_error("Failed to parse JSON configuration file");
@@ -823,6 +926,7 @@ int process_json_conf_file(char *file)
     service_ctx.events_enable = EVENTS_NONE;
     service_ctx.events_num = 0;
     service_ctx.events_min_interval_ms = 0;
+    service_ctx.events_notify_batch_ms = 20;
     service_ctx.loglevel = 0;
     service_ctx.raw_log_directory = NULL;
     service_ctx.raw_log_on_error_only = 0;
@@ -863,6 +967,17 @@ int process_json_conf_file(char *file)
     service_ctx.ptz_node.jump_to_abs = NULL;
     service_ctx.ptz_node.jump_to_rel = NULL;
     service_ctx.ptz_node.get_presets = NULL;
+    service_ctx.ptz_node.backend_socket = NULL;
+    service_ctx.ptz_node.status_cache_ms = 500;
+    service_ctx.ptz_node.status_poll_ms = 200;
+    service_ctx.ptz_node.status_idle_poll_ms = 2000;
+    service_ctx.ptz_node.move_min_interval_ms = 100;
+    service_ctx.ptz_node.set_preset_timeout_ms = 1000;
+    service_ctx.ptz_node.planner_step_ms = 0;
+    service_ctx.ptz_node.planner_accel_ms = 500;
+    service_ctx.ptz_node.planner_max_speed_x = 0.0;
+    service_ctx.ptz_node.planner_max_speed_y = 0.0;
+    service_ctx.ptz_node.planner_max_speed_z = 0.0;
     service_ctx.ptz_node.max_preset_tours = 0;
     service_ctx.ptz_node.start_tracking = NULL;
     service_ctx.ptz_node.preset_tour_start = NULL;
@@ -1023,7 +1138,7 @@ int process_json_conf_file(char *file)
         log_debug("password: %s", service_ctx.password ? service_ctx.password : "(null)");
     }
     // Load media profiles from main configuration file.
-    // Keep only ONVIF stream profiles (with valid dimensions) and cap at 2.
+    // Keep only ONVIF stream profiles (with valid dimensions) and cap at MAX_PROFILES.
     value = get_object_item(json_file, "profiles");
     if (value && value->type == JSON_OBJECT) {
         JsonKeyValue *kv = value->value.object_head;
@@ -1105,8 +1220,8 @@ int process_json_conf_file(char *file)
                 continue;
             }
 
-            if (service_ctx.profiles_num > 2) {
-                log_warn("Skipping extra RTSP profile %s; only two media profiles are currently supported", key);
+            if (service_ctx.profiles_num > MAX_PROFILES) {
+                log_warn("Skipping extra RTSP profile %s; only %d media profiles are supported", key, MAX_PROFILES);
                 free_stream_profile_strings(profile_ptr);
                 service_ctx.profiles_num--;
                 kv = kv->next;
@@ -1209,6 +1324,36 @@ int process_json_conf_file(char *file)
         get_string_from_json(&(service_ctx.ptz_node.jump_to_abs), value, "jump_to_abs");
         get_string_from_json(&(service_ctx.ptz_node.jump_to_rel), value, "jump_to_rel");
         get_string_from_json(&(service_ctx.ptz_node.get_presets), value, "get_presets");
+        get_string_from_json(&(service_ctx.ptz_node.backend_socket), value, "backend_socket");
+        get_int_from_json(&(service_ctx.ptz_node.status_cache_ms), value, "status_cache_ms");
+        get_int_from_json(&(service_ctx.ptz_node.status_poll_ms), value, "status_poll_ms");
+        get_int_from_json(&(service_ctx.ptz_node.status_idle_poll_ms), value, "status_idle_poll_ms");
+        get_int_from_json(&(service_ctx.ptz_node.move_min_interval_ms), value, "move_min_interval_ms");
+        if (service_ctx.ptz_node.move_min_interval_ms < 0)
+            service_ctx.ptz_node.move_min_interval_ms = 0;
+        get_int_from_json(&(service_ctx.ptz_node.set_preset_timeout_ms), value, "set_preset_timeout_ms");
+        if (service_ctx.ptz_node.set_preset_timeout_ms < 0)
+            service_ctx.ptz_node.set_preset_timeout_ms = 0;
+        get_int_from_json(&(service_ctx.ptz_node.planner_step_ms), value, "planner_step_ms");
+        get_int_from_json(&(service_ctx.ptz_node.planner_accel_ms), value, "planner_accel_ms");
+        get_double_from_json(&(service_ctx.ptz_node.planner_max_speed_x), value, "planner_max_speed_x");
+        get_double_from_json(&(service_ctx.ptz_node.planner_max_speed_y), value, "planner_max_speed_y");
+        get_double_from_json(&(service_ctx.ptz_node.planner_max_speed_z), value, "planner_max_speed_z");
+        if (service_ctx.ptz_node.planner_step_ms < 0)
+            service_ctx.ptz_node.planner_step_ms = 0;
+        else if ((service_ctx.ptz_node.planner_step_ms > 0) && (service_ctx.ptz_node.planner_step_ms < 20))
+            service_ctx.ptz_node.planner_step_ms = 20;
+        if ((service_ctx.ptz_node.planner_step_ms > 0) && (service_ctx.ptz_node.backend_socket == NULL)) {
+            // Each step would fork a shell for jump_to_abs, up to 50 times per second
+            log_warn("ptz.planner_step_ms needs ptz.backend_socket, trajectory planner disabled");
+            service_ctx.ptz_node.planner_step_ms = 0;
+        }
+        if (service_ctx.ptz_node.planner_accel_ms < 0)
+            service_ctx.ptz_node.planner_accel_ms = 0;
+        if (service_ctx.ptz_node.status_poll_ms < 20)
+            service_ctx.ptz_node.status_poll_ms = 20;
+        if (service_ctx.ptz_node.status_idle_poll_ms < service_ctx.ptz_node.status_poll_ms)
+            service_ctx.ptz_node.status_idle_poll_ms = service_ctx.ptz_node.status_poll_ms;
         // Extensions
         get_int_from_json(&(service_ctx.ptz_node.max_preset_tours), value, "max_preset_tours");
         get_string_from_json(&(service_ctx.ptz_node.start_tracking), value, "start_tracking");
@@ -1245,6 +1390,7 @@ int process_json_conf_file(char *file)
 
         log_debug("zoom enable: %d", service_ctx.ptz_node.zoom_enable);
     }
+    ptz_build_transforms(&service_ctx.ptz_node);
 
     // Load relays configuration from main configuration file
     value = get_object_item(json_file, "relays");
@@ -1279,6 +1425,21 @@ int process_json_conf_file(char *file)
             }
             get_string_from_json(&(service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].close), item, "close");
             get_string_from_json(&(service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].open), item, "open");
+            service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].gpio_line = -1;
+            service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].gpio_active_low = 0;
+            service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].event_id = -1;
+            service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].mode = RELAY_MODE_BISTABLE;
+            service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].delay_ms = 0;
+            JsonValue *gpio = get_object_item(item, "gpio");
+            if (gpio && gpio->type == JSON_OBJECT) {
+                get_int_from_json(&(service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].gpio_line), gpio, "line");
+                get_bool_from_json(&(service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].gpio_active_low), gpio, "active_low");
+                // A line offset of a GPIO chip is not a sysfs GPIO number: don't drive the wrong pin
+                if (get_object_item(gpio, "chip") != NULL) {
+                    log_warn("Relay %d: gpio.chip is not supported, set line to the sysfs GPIO number", service_ctx.relay_outputs_num - 1);
+                    service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].gpio_line = -1;
+                }
+            }
             log_debug("Relay %d configured - close: %s, open: %s",
                       service_ctx.relay_outputs_num - 1,
                       service_ctx.relay_outputs[service_ctx.relay_outputs_num - 1].close
@@ -1289,12 +1450,18 @@ int process_json_conf_file(char *file)
                           : "(null)");
         }
         log_debug("Finished loading relays. Total relay_outputs_num: %d", service_ctx.relay_outputs_num);
+        // Settings changed through SetRelayOutputSettings
+        relay_settings_load();
     }
 
     // Load events configuration from main configuration file
     get_int_from_json(&(service_ctx.events_enable), json_file, "events_enable");
     // Optional global debounce for events (milliseconds); 0 disables
     get_int_from_json(&(service_ctx.events_min_interval_ms), json_file, "events_min_interval_ms");
+    // Window (milliseconds) to coalesce push notifications into one Notify
+    get_int_from_json(&(service_ctx.events_notify_batch_ms), json_file, "events_notify_batch_ms");
+    if (service_ctx.events_notify_batch_ms < 0)
+        service_ctx.events_notify_batch_ms = 0;
     value = get_object_item(json_file, "events");
     if (value && value->type == JSON_ARRAY) {
         int array_len = get_array_size(value);
@@ -1313,6 +1480,7 @@ int process_json_conf_file(char *file)
             event_t *ev = &service_ctx.events[service_ctx.events_num - 1];
             ev->topic = NULL;
             ev->input_file = NULL;
+            ev->min_interval_ms = -1;
             ev->sources_num = 0;
             for (int s = 0; s < MAX_EVENT_SOURCES; s++) {
                 ev->sources[s].name = NULL;
@@ -1321,6 +1489,9 @@ int process_json_conf_file(char *file)
             }
             get_string_from_json(&(ev->topic), item, "topic");
             get_string_from_json(&(ev->input_file), item, "input_file");
+            get_int_from_json(&(ev->min_interval_ms), item, "min_interval_ms");
+            if (ev->min_interval_ms < -1)
+                ev->min_interval_ms = -1;
 
             // Event sources: the "sources" array (name/type/value each) is the
             // spec-shaped form (CellMotionDetector carries three);
@@ -1430,6 +1601,7 @@ int process_json_conf_file(char *file)
             get_string_from_json(&(entry->cmd_ircut_on), item, "cmd_ircut_on");
             get_string_from_json(&(entry->cmd_ircut_off), item, "cmd_ircut_off");
             get_string_from_json(&(entry->cmd_ircut_auto), item, "cmd_ircut_auto");
+            parse_ircut_gpio(get_object_item(item, "ircut_gpio"), &entry->ircut_gpio);
 
             if (entry->ircut_mode == IRCUT_MODE_UNSPECIFIED) {
                 if (entry->supports_ircut_auto)
@@ -1521,10 +1693,12 @@ int process_json_conf_file(char *file)
 
             log_debug("Adding event for relay output %d", i);
             service_ctx.events = (event_t *) realloc(service_ctx.events, service_ctx.events_num * sizeof(event_t));
+            service_ctx.relay_outputs[i].event_id = service_ctx.events_num - 1;
             event_t *ev = &service_ctx.events[service_ctx.events_num - 1];
             ev->topic = (char *) malloc(strlen("tns1:Device/Trigger/Relay") + 1);
             strcpy(ev->topic, "tns1:Device/Trigger/Relay");
             log_debug("topic: tns1:Device/Trigger/Relay");
+            ev->min_interval_ms = -1;
             ev->sources_num = 0;
             for (int s = 0; s < MAX_EVENT_SOURCES; s++) {
                 ev->sources[s].name = NULL;
@@ -1632,6 +1806,8 @@ void free_conf_file()
             free(service_ctx.ptz_node.get_position);
         if (service_ctx.ptz_node.get_presets != NULL)
             free(service_ctx.ptz_node.get_presets);
+        if (service_ctx.ptz_node.backend_socket != NULL)
+            free(service_ctx.ptz_node.backend_socket);
         if (service_ctx.ptz_node.start_tracking != NULL)
             free(service_ctx.ptz_node.start_tracking);
         if (service_ctx.ptz_node.preset_tour_start != NULL)
@@ -18,6 +18,7 @@
 
 #include "fault.h"
 #include "log.h"
+#include "media_profiles.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
 #include "utils.h"
@@ -96,8 +97,7 @@ int device_get_services()
         strcpy(ebasesubscription, "false");
     }
 
-    if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    if (media_audio_encoder_count() > 0) {
         sprintf(audio_sources, "%d", 1);
     } else {
         sprintf(audio_sources, "%d", 0);
@@ -897,8 +897,7 @@ int device_get_capabilities()
         strcpy(ebasesubscription, "false");
     }
 
-    if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    if (media_audio_encoder_count() > 0) {
         sprintf(audio_sources, "%d", 1);
     } else {
         sprintf(audio_sources, "%d", 0);
@@ -18,8 +18,10 @@
 
 #include "fault.h"
 #include "log.h"
+#include "media_profiles.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
+#include "relay_backend.h"
 #include "utils.h"
 
 #include <pthread.h>
@@ -45,8 +47,7 @@ int deviceio_get_service_capabilities()
     char relay_outputs[2], audio_sources[2], audio_outputs[2];
 
     sprintf(relay_outputs, "%d", service_ctx.relay_outputs_num);
-    if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    if (media_audio_encoder_count() > 0) {
         sprintf(audio_sources, "%d", 1);
     } else {
         sprintf(audio_sources, "%d", 0);
@@ -113,8 +114,7 @@ int deviceio_get_audio_sources()
 {
     char audio_source_token[MAX_LEN];
 
-    if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    if (media_audio_encoder_count() > 0) {
         sprintf(audio_source_token, "%s", "<tmd:Token>AudioSourceToken</tmd:Token>");
     } else {
         audio_source_token[0] = '\0';
@@ -133,8 +133,9 @@ int deviceio_get_relay_outputs()
     int c, i;
     char dest_a[] = "stdout";
     char *dest;
-    char token[32];
+    char token[64];
     char idle_state[8];
+    char delay_time[32];
 
     // We need 1st step to evaluate content length
     for (c = 0; c < 2; c++) {
@@ -147,18 +148,23 @@ int deviceio_get_relay_outputs()
         size = cat(dest, "deviceio_service_files/GetRelayOutputs_header.xml", 0);
 
         for (i = 0; i < service_ctx.relay_outputs_num; i++) {
-            // Use custom token if provided, otherwise generate default
-            if (service_ctx.relay_outputs[i].token && service_ctx.relay_outputs[i].token[0] != '\0') {
-                strncpy(token, service_ctx.relay_outputs[i].token, sizeof(token) - 1);
-                token[sizeof(token) - 1] = '\0';
-            } else {
-                sprintf(token, "RelayOutputToken_%d", i);
-            }
+            relay_backend_token(i, token, sizeof(token));
             if (service_ctx.relay_outputs[i].idle_state == IDLE_STATE_OPEN)
                 strcpy(idle_state, "open");
             else
-                strcpy(idle_state, "close");
-            size += cat(dest, "deviceio_service_files/GetRelayOutputs_item.xml", 4, "%RELAY_OUTPUT_TOKEN%", token, "%RELAY_IDLE_STATE%", idle_state);
+                strcpy(idle_state, "closed");
+            sprintf(delay_time, "PT%gS", service_ctx.relay_outputs[i].delay_ms / 1000.0);
+            size += cat(dest,
+                        "deviceio_service_files/GetRelayOutputs_item.xml",
+                        8,
+                        "%RELAY_OUTPUT_TOKEN%",
+                        token,
+                        "%RELAY_MODE%",
+                        (service_ctx.relay_outputs[i].mode == RELAY_MODE_MONOSTABLE) ? "Monostable" : "Bistable",
+                        "%RELAY_DELAY_TIME%",
+                        delay_time,
+                        "%RELAY_IDLE_STATE%",
+                        idle_state);
         }
         size += cat(dest, "deviceio_service_files/GetRelayOutputs_footer.xml", 0);
     }
@@ -218,90 +224,99 @@ int deviceio_get_relay_output_options()
 
 int deviceio_set_relay_output_settings()
 {
-    int itoken;
-    mxml_node_t *node;
+    int itoken, mode, delay_ms, idle;
+    mxml_node_t *node, *properties;
     const char *token = NULL;
+    const char *value;
 
-    node = get_element_ptr(node, "RelayOutput", "Body");
+    node = get_element_ptr(NULL, "RelayOutput", "Body");
     if (node != NULL) {
         token = get_attribute(node, "token");
     }
 
-    if ((token != NULL) && (strlen(token) == 18) && (strncasecmp("RelayOutputToken_", token, 17) == 0)) {
-        itoken = token[17] - 48;
+    itoken = relay_backend_find(token);
+    if (itoken < 0) {
+        send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:RelayToken", "Relay token", "Unknown relay token reference");
+        return -1;
+    }
 
-        if ((itoken >= 0) && (itoken < service_ctx.relay_outputs_num)) {
-            long size = cat(NULL, "deviceio_service_files/SetRelayOutputSettings.xml", 0);
+    relay_output_t *relay = &service_ctx.relay_outputs[itoken];
+    mode = relay->mode;
+    delay_ms = relay->delay_ms;
+    idle = relay->idle_state;
+
+    properties = get_element_in_element_ptr("Properties", node);
+    value = get_element_in_element("Mode", properties);
+    if (value != NULL) {
+        if (strcasecmp(value, "Monostable") == 0) {
+            mode = RELAY_MODE_MONOSTABLE;
+        } else if (strcasecmp(value, "Bistable") == 0) {
+            mode = RELAY_MODE_BISTABLE;
+        } else {
+            send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:ModeError", "Relay mode", "Unsupported relay mode");
+            return -2;
+        }
+    }
+    value = get_element_in_element("DelayTime", properties);
+    if (value != NULL) {
+        delay_ms = duration2ms(value);
+        if ((delay_ms < 0) || (delay_ms > RELAY_MAX_DELAY_MS)) {
+            send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:DelayTimeNotSupported", "Relay delay time", "Unsupported delay time");
+            return -3;
+        }
+    }
+    value = get_element_in_element("IdleState", properties);
+    if (value != NULL) {
+        idle = (strcasecmp(value, "open") == 0) ? IDLE_STATE_OPEN : IDLE_STATE_CLOSE;
+    }
 
-            output_http_headers(size);
+    if ((mode != relay->mode) || (delay_ms != relay->delay_ms) || (idle != relay->idle_state)) {
+        shm_t *shm = shared_memory_attach();
 
-            return cat("stdout", "deviceio_service_files/SetRelayOutputSettings.xml", 0);
-        } else {
-            send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:RelayToken", "Relay token", "Unknown relay token reference");
-            return -1;
+        relay->mode = mode;
+        relay->delay_ms = delay_ms;
+        relay->idle_state = idle;
+        if (relay_settings_save() != 0) {
+            send_action_failed_fault("deviceio_service", -4);
+            return -4;
+        }
+        if (shm != NULL) {
+            // The logical state no longer matches the contacts: the next SetRelayOutputState switches them
+            sem_memory_wait();
+            shm->relays.state[itoken] = RELAY_STATE_UNKNOWN;
+            if (mode != RELAY_MODE_MONOSTABLE)
+                shm->relays.release_ms[itoken] = 0;
+            sem_memory_post();
         }
-    } else {
-        send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:RelayToken", "Relay token", "Unknown relay token reference");
-        return -2;
     }
+
+    long size = cat(NULL, "deviceio_service_files/SetRelayOutputSettings.xml", 0);
+
+    output_http_headers(size);
+
+    return cat("stdout", "deviceio_service_files/SetRelayOutputSettings.xml", 0);
 }
 
 int deviceio_set_relay_output_state()
 {
-    int i, itoken = -1;
+    int itoken;
     const char *token = get_element("RelayOutputToken", "Body");
     const char *state = get_element("LogicalState", "Body");
-    char sys_command[MAX_LEN];
-
-    sys_command[0] = '\0';
 
     if (token == NULL) {
         send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:RelayToken", "Relay token", "Missing relay token");
         return -1;
     }
 
-    // Try to find matching relay by token
-    for (i = 0; i < service_ctx.relay_outputs_num; i++) {
-        // Check if custom token matches
-        if (service_ctx.relay_outputs[i].token && service_ctx.relay_outputs[i].token[0] != '\0') {
-            if (strcmp(token, service_ctx.relay_outputs[i].token) == 0) {
-                itoken = i;
-                break;
-            }
-        }
-        // Check if default token matches (RelayOutputToken_N)
-        else {
-            char default_token[32];
-            sprintf(default_token, "RelayOutputToken_%d", i);
-            if (strcmp(token, default_token) == 0) {
-                itoken = i;
-                break;
-            }
-        }
-    }
-
-    if (itoken < 0 || itoken >= service_ctx.relay_outputs_num) {
+    itoken = relay_backend_find(token);
+    if (itoken < 0) {
         send_fault("deviceio_service", "Sender", "ter:InvalidArgVal", "ter:RelayToken", "Relay token", "Unknown relay token reference");
         return -2;
     }
 
-    // Determine which command to execute
-    if (strcasecmp("active", state) == 0) {
-        if (service_ctx.relay_outputs[itoken].idle_state == IDLE_STATE_OPEN) {
-            sprintf(sys_command, service_ctx.relay_outputs[itoken].close);
-        } else {
-            sprintf(sys_command, service_ctx.relay_outputs[itoken].open);
-        }
-    } else {
-        if (service_ctx.relay_outputs[itoken].idle_state == IDLE_STATE_OPEN) {
-            sprintf(sys_command, service_ctx.relay_outputs[itoken].open);
-        } else {
-            sprintf(sys_command, service_ctx.relay_outputs[itoken].close);
-        }
-    }
-
-    if (sys_command[0] != '\0') {
-        run_command_silent(sys_command);
+    if (relay_backend_set(shared_memory_attach(), itoken, (state != NULL) && (strcasecmp("active", state) == 0)) != 0) {
+        send_action_failed_fault("deviceio_service", -3);
+        return -3;
     }
 
     long size = cat(NULL, "deviceio_service_files/SetRelayOutputState.xml", 0);
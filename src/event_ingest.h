@@ -0,0 +1,36 @@
+#pragma once
+
+/*
+ * Wire format of the onvif_notify_server event socket.
+ *
+ * Producers (prudynt, relay scripts, GPIO handlers) send one record per
+ * datagram to EVENT_INGEST_SOCKET instead of creating/deleting files in
+ * /run/motion. Records use host byte order: sender and receiver always run
+ * on the same machine. The datagram may stop right after the last source
+ * value that is used (EVENT_INGEST_RECORD_SIZE(sources_num) bytes).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EVENT_INGEST_SOCKET "/run/onvif_notify_server.sock"
+
+#define EVENT_INGEST_MAGIC 0x5645 // "EV"
+#define EVENT_INGEST_VERSION 1
+
+#define EVENT_INGEST_SOURCES 4
+#define EVENT_INGEST_VALUE_LEN 32
+
+typedef struct {
+    uint16_t magic;       // EVENT_INGEST_MAGIC
+    uint8_t version;      // EVENT_INGEST_VERSION
+    uint8_t event_id;     // Index in the "events" array of the configuration
+    uint8_t value;        // 0 = false, 1 = true
+    uint8_t sources_num;  // Number of source_values that follow
+    uint8_t reserved[2];  // Must be 0
+    int64_t timestamp_ms; // UTC milliseconds since the epoch, 0 = time of receipt
+    // Replace the configured Source values, in order; "" keeps the configured one
+    char source_values[EVENT_INGEST_SOURCES][EVENT_INGEST_VALUE_LEN];
+} event_ingest_record_t;
+
+#define EVENT_INGEST_RECORD_SIZE(n) (offsetof(event_ingest_record_t, source_values) + (size_t) (n) * EVENT_INGEST_VALUE_LEN)
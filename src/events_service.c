@@ -148,6 +148,9 @@ int events_create_pull_point_subscription()
                     strcpy(subs_evts->subscriptions[i].topic_expression, te);
                 }
             }
+            subs_evts->subscriptions[i].topic_mask = topic_expression_mask(subs_evts->subscriptions[i].topic_expression,
+                                                                           service_ctx.events,
+                                                                           service_ctx.events_num);
             break;
         }
     }
@@ -189,8 +192,7 @@ int events_create_pull_point_subscription()
     // Force notification with Property "Initialized"
     sem_memory_wait();
     for (i = 0; i < service_ctx.events_num && i < MAX_EVENTS; i++) {
-        if (service_ctx.events[i].topic != NULL
-            && is_topic_in_expression(subs_evts->subscriptions[sub_index].topic_expression, service_ctx.events[i].topic)) {
+        if (subs_evts->subscriptions[sub_index].topic_mask & (1U << i)) {
             subs_evts->events[i].pull_send_initialized |= (1 << sub_index);
             subs_evts->events[i].pull_notify |= (1 << sub_index);
             log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[sub_index].topic_expression);
@@ -524,7 +526,7 @@ int events_pull_messages()
                 // Ensure we have valid strings to prevent null pointer dereference
                 const char *safe_topic = service_ctx.events[i].topic ? service_ctx.events[i].topic : "Unknown";
                 char sources_xml[512];
-                build_event_sources(sources_xml, sizeof(sources_xml), &service_ctx.events[i]);
+                build_event_sources(sources_xml, sizeof(sources_xml), &service_ctx.events[i], subs_evts->events[i].source_values);
 
                 size = cat(dest,
                            "events_service_files/PullMessages_2.xml",
@@ -647,6 +649,9 @@ int events_subscribe()
                     strcpy(subs_evts->subscriptions[i].topic_expression, te);
                 }
             }
+            subs_evts->subscriptions[i].topic_mask = topic_expression_mask(subs_evts->subscriptions[i].topic_expression,
+                                                                           service_ctx.events,
+                                                                           service_ctx.events_num);
             break;
         }
     }
@@ -1394,8 +1399,7 @@ int events_set_synchronization_point()
     subs_evts->subscriptions[sub_index].push_need_sync = 1;
 
     for (i = 0; i < service_ctx.events_num && i < MAX_EVENTS; i++) {
-        if (service_ctx.events[i].topic != NULL
-            && is_topic_in_expression(subs_evts->subscriptions[sub_index].topic_expression, service_ctx.events[i].topic)) {
+        if (subs_evts->subscriptions[sub_index].topic_mask & (1U << i)) {
             subs_evts->events[i].pull_send_initialized |= (1 << sub_index);
             subs_evts->events[i].pull_notify |= (1 << sub_index);
             log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[sub_index].topic_expression);
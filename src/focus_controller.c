@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "focus_controller.h"
+
+#include "log.h"
+#include "onvif_simple_server.h"
+#include "ptz_backend.h"
+
+#include <stdio.h>
+#include <string.h>
+
+extern service_context_t service_ctx;
+
+/*
+ * Focus controller.
+ * Move and Stop of the imaging service leave their lens command in
+ * shm->focus.sources[i] and the focus thread of onvif_notify_server runs it:
+ * the lens commands go through the motor backend connection of the daemon,
+ * the position and the MOVING/IDLE state survive the CGI, and a continuous
+ * move is stopped when focus_move.continuous.timeout_ms elapses. Relative
+ * moves that arrive while the lens is busy are summed and sent as one command.
+ */
+
+// @return 1 if some imaging source has focus moves, so the thread is worth running
+int focus_controller_needed()
+{
+    int i;
+
+    for (i = 0; i < service_ctx.imaging_num; i++) {
+        const imaging_focus_move_config_t *move = &service_ctx.imaging[i].focus_move;
+        if (move->absolute.supported || move->relative.supported || move->continuous.supported)
+            return 1;
+    }
+    return 0;
+}
+
+static void focus_run(const char *command)
+{
+    log_debug("Focus: Executing %s", command);
+    ptz_backend_run(command);
+}
+
+void focus_tick(shm_t *shm, long long now)
+{
+    char pending[FOCUS_COMMAND_LEN], relative[FOCUS_COMMAND_LEN];
+    const imaging_entry_t *entry;
+    focus_source_shm_t *src;
+    float distance, speed;
+    int i, n;
+
+    sem_memory_wait();
+    shm->focus.worker_ms = now;
+    sem_memory_post();
+
+    for (i = 0; (i < service_ctx.imaging_num) && (i < MAX_IMAGING_ENTRIES); i++) {
+        entry = &service_ctx.imaging[i];
+        src = &shm->focus.sources[i];
+        pending[0] = '\0';
+        relative[0] = '\0';
+
+        sem_memory_wait();
+        if (src->pending[0] != '\0') {
+            strcpy(pending, src->pending);
+            src->pending[0] = '\0';
+        } else if (src->continuous && (src->stop_ms != 0) && (now >= src->stop_ms)) {
+            log_info("Focus continuous move timeout elapsed");
+            src->continuous = 0;
+            src->stop_ms = 0;
+            if (entry->focus_move.cmd_stop != NULL)
+                snprintf(pending, sizeof(pending), "%s", entry->focus_move.cmd_stop);
+            else
+                src->state = IMAGING_FOCUS_STATE_IDLE;
+        }
+        if (src->relative_num > 0) {
+            distance = src->relative_distance;
+            speed = src->relative_speed;
+            if (src->relative_num > 1)
+                log_debug("Focus: %d relative moves merged", src->relative_num);
+            src->relative_num = 0;
+            src->relative_distance = 0.0f;
+            if (entry->focus_move.relative.command != NULL) {
+                n = snprintf(relative, sizeof(relative), entry->focus_move.relative.command, distance, speed);
+                if ((n < 0) || (n >= (int) sizeof(relative)))
+                    relative[0] = '\0';
+            }
+        }
+        sem_memory_post();
+
+        if ((pending[0] == '\0') && (relative[0] == '\0'))
+            continue;
+        if (pending[0] != '\0')
+            focus_run(pending);
+        if (relative[0] != '\0')
+            focus_run(relative);
+
+        // The lens commands return once the move is done, except continuous ones
+        sem_memory_wait();
+        if (!src->continuous && (src->pending[0] == '\0') && (src->relative_num == 0))
+            src->state = IMAGING_FOCUS_STATE_IDLE;
+        sem_memory_post();
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FOCUS_CONTROLLER_H
+#define FOCUS_CONTROLLER_H
+
+#include "utils.h"
+
+int focus_controller_needed();
+void focus_tick(shm_t *shm, long long now);
+
+#endif // FOCUS_CONTROLLER_H
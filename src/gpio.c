@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2025 Thingino
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpio.h"
+
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Output GPIOs through sysfs, numbered the way the SoC numbers them (e.g.
+ * PB20 = 52 on Ingenic). Writing "high" or "low" to direction configures the
+ * line as an output and sets its level in one write, and the level stays
+ * after the process exits.
+ */
+#define GPIO_SYSFS_DIR "/sys/class/gpio"
+
+static int write_file(const char *path, const char *value)
+{
+    int fd, ret;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ret = (write(fd, value, strlen(value)) == (ssize_t) strlen(value)) ? 0 : -1;
+    close(fd);
+
+    return ret;
+}
+
+// @return 0 on success, -1 if the line can't be driven
+int gpio_set(int gpio, int value)
+{
+    char path[64], number[16];
+
+    if (gpio < 0)
+        return -1;
+
+    snprintf(path, sizeof(path), GPIO_SYSFS_DIR "/gpio%d/direction", gpio);
+    if (write_file(path, value ? "high" : "low") == 0)
+        return 0;
+
+    // Not exported yet
+    snprintf(number, sizeof(number), "%d", gpio);
+    if ((write_file(GPIO_SYSFS_DIR "/export", number) != 0) && (errno != EBUSY)) {
+        log_error("Unable to export GPIO %d: %s", gpio, strerror(errno));
+        return -1;
+    }
+    if (write_file(path, value ? "high" : "low") != 0) {
+        log_error("Unable to drive GPIO %d: %s", gpio, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
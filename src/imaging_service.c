@@ -17,6 +17,7 @@
 #include "imaging_service.h"
 
 #include "fault.h"
+#include "gpio.h"
 #include "log.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
@@ -29,9 +30,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define IMAGING_XML_BUFFER 16384
 #define IMAGING_COMMAND_BUFFER 1024
+#define IMAGING_RUN_DIR "/run/onvif_imaging"
+#define FOCUS_WORKER_ALIVE_MS 1000 // The focus thread of onvif_notify_server ticks every few ms
+
+enum { FOCUS_POST_ABSOLUTE, FOCUS_POST_RELATIVE, FOCUS_POST_CONTINUOUS, FOCUS_POST_STOP };
 
 static imaging_entry_t *find_imaging_entry(const char *token);
 static void execute_backend_command(const char *command);
@@ -108,22 +115,91 @@ static int focus_move_capable(const imaging_focus_move_config_t *focus_move)
     return focus_move->absolute.supported || focus_move->relative.supported || focus_move->continuous.supported;
 }
 
-static int execute_formatted_command(const char *template, float arg1, float arg2)
+static int format_command(const char *template, float arg1, float arg2, char *command, size_t command_len)
 {
     if (!template || template[0] == '\0')
         return -1;
 
-    char command[IMAGING_COMMAND_BUFFER];
-    int written = snprintf(command, sizeof(command), template, arg1, arg2);
-    if (written < 0 || (size_t) written >= sizeof(command)) {
+    int written = snprintf(command, command_len, template, arg1, arg2);
+    if (written < 0 || (size_t) written >= command_len) {
         log_error("Imaging command template '%s' overflow", template);
         return -1;
     }
-
-    execute_backend_command(command);
     return 0;
 }
 
+/*
+ * Focus moves run by onvif_notify_server (see focus_controller.c), which
+ * keeps the focus position and state across requests.
+ * Hand a focus command to the focus thread. Relative moves are posted as
+ * value (distance) and speed so that the thread can merge them; the other
+ * kinds carry the expanded command, and value is the absolute position.
+ * @return 0 if posted, -1 if the command must run here
+ */
+static int focus_post(const imaging_entry_t *entry, int kind, const char *command, float value, float speed)
+{
+    shm_t *shm = shared_memory_attach();
+    focus_source_shm_t *src;
+    long long now = monotonic_ms();
+    int posted = 0;
+
+    if (shm == NULL)
+        return -1;
+    if (command != NULL && strlen(command) >= FOCUS_COMMAND_LEN)
+        return -1;
+    src = &shm->focus.sources[entry - service_ctx.imaging];
+
+    sem_memory_wait();
+    if (now - shm->focus.worker_ms <= FOCUS_WORKER_ALIVE_MS) {
+        posted = 1;
+        if (kind == FOCUS_POST_RELATIVE) {
+            src->relative_distance += value;
+            src->relative_speed = speed;
+            src->relative_num++;
+            src->position = src->has_position ? src->position + value : value;
+            src->has_position = 1;
+        } else {
+            // Supersedes the relative moves not sent yet
+            strcpy(src->pending, command);
+            src->relative_num = 0;
+            src->relative_distance = 0.0f;
+        }
+        if (kind == FOCUS_POST_ABSOLUTE) {
+            src->position = value;
+            src->has_position = 1;
+        }
+        src->continuous = (kind == FOCUS_POST_CONTINUOUS);
+        src->stop_ms = 0;
+        if (kind == FOCUS_POST_CONTINUOUS && entry->focus_move.continuous.timeout_ms > 0)
+            src->stop_ms = now + entry->focus_move.continuous.timeout_ms;
+        if (kind != FOCUS_POST_STOP)
+            src->state = IMAGING_FOCUS_STATE_MOVING;
+    }
+    sem_memory_post();
+
+    return posted ? 0 : -1;
+}
+
+// Copy the focus state kept by onvif_notify_server into entry, if it runs
+static void focus_read(imaging_entry_t *entry)
+{
+    shm_t *shm = shared_memory_attach();
+    focus_source_shm_t *src;
+
+    if (shm == NULL)
+        return;
+    src = &shm->focus.sources[entry - service_ctx.imaging];
+
+    sem_memory_wait();
+    if (monotonic_ms() - shm->focus.worker_ms <= FOCUS_WORKER_ALIVE_MS) {
+        if (src->state != IMAGING_FOCUS_STATE_UNKNOWN)
+            entry->focus_state = src->state;
+        entry->focus_has_last_position = src->has_position;
+        entry->focus_last_position = src->position;
+    }
+    sem_memory_post();
+}
+
 extern service_context_t service_ctx;
 
 static imaging_entry_t *find_imaging_entry(const char *token)
@@ -871,13 +947,15 @@ static int perform_absolute_focus_move(imaging_entry_t *entry, mxml_node_t *abso
         return -1;
     }
 
-    entry->focus_state = IMAGING_FOCUS_STATE_MOVING;
-    if (execute_formatted_command(entry->focus_move.absolute.command, position, speed) != 0) {
-        entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
+    char command[IMAGING_COMMAND_BUFFER];
+    if (format_command(entry->focus_move.absolute.command, position, speed, command, sizeof(command)) != 0) {
         send_focus_invalid_value_fault("Focus command failed", "Failed to build absolute focus command");
         return -1;
     }
 
+    if (focus_post(entry, FOCUS_POST_ABSOLUTE, command, position, speed) != 0)
+        execute_backend_command(command);
+
     entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
     set_focus_position(entry, position);
     return 0;
@@ -914,13 +992,15 @@ static int perform_relative_focus_move(imaging_entry_t *entry, mxml_node_t *rela
         return -1;
     }
 
-    entry->focus_state = IMAGING_FOCUS_STATE_MOVING;
-    if (execute_formatted_command(entry->focus_move.relative.command, distance, speed) != 0) {
-        entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
+    char command[IMAGING_COMMAND_BUFFER];
+    if (format_command(entry->focus_move.relative.command, distance, speed, command, sizeof(command)) != 0) {
         send_focus_invalid_value_fault("Focus command failed", "Failed to build relative focus command");
         return -1;
     }
 
+    if (focus_post(entry, FOCUS_POST_RELATIVE, NULL, distance, speed) != 0)
+        execute_backend_command(command);
+
     entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
     apply_focus_delta(entry, distance);
     return 0;
@@ -944,13 +1024,15 @@ static int perform_continuous_focus_move(imaging_entry_t *entry, mxml_node_t *co
         return -1;
     }
 
-    entry->focus_state = IMAGING_FOCUS_STATE_MOVING;
-    if (execute_formatted_command(entry->focus_move.continuous.command, speed, 0.0f) != 0) {
-        entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
+    char command[IMAGING_COMMAND_BUFFER];
+    if (format_command(entry->focus_move.continuous.command, speed, 0.0f, command, sizeof(command)) != 0) {
         send_focus_invalid_value_fault("Focus command failed", "Failed to build continuous focus command");
         return -1;
     }
 
+    if (focus_post(entry, FOCUS_POST_CONTINUOUS, command, 0.0f, speed) != 0)
+        execute_backend_command(command);
+
     entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
     return 0;
 }
@@ -1017,6 +1099,85 @@ static void build_imaging_options_xml(const imaging_entry_t *entry, char *buffer
     append_float_range(&builder, "NoiseReduction", &entry->noise_reduction);
 }
 
+/*
+ * XML cache.
+ * GetImagingSettings and GetOptions output only depends on the configuration,
+ * on the prudynt state and on the IR-cut mode, so the built fragments are kept
+ * in IMAGING_RUN_DIR, one file per kind and imaging entry. The first line
+ * holds the configuration and prudynt generations and the IR-cut mode it was
+ * built at.
+ */
+static void imaging_xml_cache_path(char *path, size_t path_len, const char *kind, const imaging_entry_t *entry)
+{
+    snprintf(path, path_len, "%s/%s_%d.xml", IMAGING_RUN_DIR, kind, (int) (entry - service_ctx.imaging));
+}
+
+// @return 0 if buffer holds a fragment built at generation
+static int imaging_xml_cache_load(const char *kind, const imaging_entry_t *entry, unsigned long long generation, char *buffer, size_t buffer_len)
+{
+    char path[128];
+    FILE *fp;
+    unsigned long long file_conf, file_generation;
+    int file_ircut;
+    size_t n;
+
+    if (generation == 0 || service_ctx.conf_generation == 0)
+        return -1;
+
+    imaging_xml_cache_path(path, sizeof(path), kind, entry);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    if ((fscanf(fp, "#generation %llx %llx %d\n", &file_conf, &file_generation, &file_ircut) != 3) || (file_conf != service_ctx.conf_generation)
+        || (file_generation != generation) || (file_ircut != (int) entry->ircut_mode)) {
+        fclose(fp);
+        return -1;
+    }
+    n = fread(buffer, 1, buffer_len - 1, fp);
+    buffer[n] = '\0';
+    fclose(fp);
+
+    return 0;
+}
+
+static void imaging_xml_cache_save(const char *kind, const imaging_entry_t *entry, unsigned long long generation, const char *buffer)
+{
+    char path[128];
+    char tmp_file[sizeof(path) + 8];
+    FILE *fp;
+
+    if (generation == 0 || service_ctx.conf_generation == 0)
+        return;
+
+    imaging_xml_cache_path(path, sizeof(path), kind, entry);
+    fp = run_file_create(IMAGING_RUN_DIR, path, 0644, tmp_file, sizeof(tmp_file));
+    if (fp == NULL)
+        return;
+    fprintf(fp, "#generation %llx %llx %d\n%s", service_ctx.conf_generation, generation, (int) entry->ircut_mode, buffer);
+    run_file_commit(fp, tmp_file, path);
+}
+
+/*
+ * Build the settings or options fragment of entry merged with the prudynt
+ * state, or take it from the cache.
+ */
+static void imaging_xml_get(const char *kind, const imaging_entry_t *entry, void (*build)(const imaging_entry_t *, char *, size_t), char *buffer, size_t buffer_len)
+{
+    // Read before the state: a fragment is never stored under a newer generation than its state
+    unsigned long long generation = prudynt_imaging_generation();
+
+    if (imaging_xml_cache_load(kind, entry, generation, buffer, buffer_len) == 0)
+        return;
+
+    imaging_entry_t runtime_entry = *entry;
+    prudynt_imaging_state_t runtime_state;
+    if (prudynt_load_imaging_state(&runtime_state) == 0)
+        merge_prudynt_state(&runtime_entry, &runtime_state);
+    build(&runtime_entry, buffer, buffer_len);
+
+    imaging_xml_cache_save(kind, entry, generation, buffer);
+}
+
 static void execute_backend_command(const char *command)
 {
     if (command == NULL || command[0] == '\0')
@@ -1025,6 +1186,99 @@ static void execute_backend_command(const char *command)
     run_command_silent(command);
 }
 
+/*
+ * IR-cut mode.
+ * Each request runs in a new process, so the mode set by SetImagingSettings is
+ * kept in IMAGING_RUN_DIR. The configured ircut_state applies until the first
+ * change after boot.
+ */
+static void ircut_mode_path(char *path, size_t path_len, const imaging_entry_t *entry)
+{
+    snprintf(path, path_len, "%s/ircut_%d", IMAGING_RUN_DIR, (int) (entry - service_ctx.imaging));
+}
+
+static void ircut_mode_load(imaging_entry_t *entry)
+{
+    char path[128];
+    char value[8];
+    FILE *fp;
+
+    ircut_mode_path(path, sizeof(path), entry);
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return;
+    if (fscanf(fp, "%7s", value) == 1) {
+        ircut_mode_t mode = ircut_mode_from_string(value);
+        if (mode != IRCUT_MODE_UNSPECIFIED)
+            entry->ircut_mode = mode;
+    }
+    fclose(fp);
+}
+
+static void ircut_mode_save(const imaging_entry_t *entry)
+{
+    char path[128];
+    char tmp_file[sizeof(path) + 8];
+    FILE *fp;
+
+    ircut_mode_path(path, sizeof(path), entry);
+    fp = run_file_create(IMAGING_RUN_DIR, path, 0644, tmp_file, sizeof(tmp_file));
+    if (fp == NULL)
+        return;
+    fprintf(fp, "%s\n", ircut_mode_to_string(entry->ircut_mode));
+    run_file_commit(fp, tmp_file, path);
+}
+
+// @return 0 if the filter was moved through ircut_gpio
+static int ircut_gpio_set(const imaging_entry_t *entry, ircut_mode_t mode)
+{
+    const imaging_ircut_gpio_t *gpio = &entry->ircut_gpio;
+    int on = (mode == IRCUT_MODE_ON);
+
+    if (gpio->pins[0] < 0)
+        return -1;
+    if (gpio_set(gpio->pins[0], on) != 0)
+        return -1;
+    if ((gpio->pins[1] >= 0) && (gpio_set(gpio->pins[1], !on) != 0))
+        return -1;
+
+    if (gpio->pulse_ms > 0) {
+        // Latching filters only need a pulse, don't keep the coil powered
+        usleep(gpio->pulse_ms * 1000);
+        gpio_set(gpio->pins[0], 0);
+        if (gpio->pins[1] >= 0)
+            gpio_set(gpio->pins[1], 0);
+    }
+
+    return 0;
+}
+
+static void ircut_apply(const imaging_entry_t *entry, ircut_mode_t mode)
+{
+    const char *command;
+
+    switch (mode) {
+    case IRCUT_MODE_ON:
+        command = entry->cmd_ircut_on;
+        break;
+    case IRCUT_MODE_OFF:
+        command = entry->cmd_ircut_off;
+        break;
+    case IRCUT_MODE_AUTO:
+        command = entry->cmd_ircut_auto;
+        break;
+    default:
+        return;
+    }
+
+    // Entering or leaving Auto starts or stops the day/night switching of the command
+    if ((mode != IRCUT_MODE_AUTO) && ((entry->ircut_mode != IRCUT_MODE_AUTO) || (command == NULL) || (command[0] == '\0'))
+        && (ircut_gpio_set(entry, mode) == 0))
+        return;
+
+    execute_backend_command(command);
+}
+
 static const char *find_ircut_value(mxml_node_t *node)
 {
     return find_child_value(node, "IrCutFilter");
@@ -1126,16 +1380,10 @@ int imaging_get_imaging_settings()
                    "The requested VideoSourceToken does not exist");
         return -1;
     }
-
-    imaging_entry_t runtime_entry = *entry;
-    prudynt_imaging_state_t runtime_state;
-    if (prudynt_load_imaging_state(&runtime_state) == 0) {
-        merge_prudynt_state(&runtime_entry, &runtime_state);
-        entry = &runtime_entry;
-    }
+    ircut_mode_load(entry);
 
     char settings_xml[IMAGING_XML_BUFFER];
-    build_imaging_settings_xml(entry, settings_xml, sizeof(settings_xml));
+    imaging_xml_get("settings", entry, build_imaging_settings_xml, settings_xml, sizeof(settings_xml));
 
     long size = cat(NULL, "imaging_service_files/GetImagingSettings.xml", 2, "%IMAGING_SETTINGS%", settings_xml);
 
@@ -1160,15 +1408,8 @@ int imaging_get_options()
         return -1;
     }
 
-    imaging_entry_t runtime_entry = *entry;
-    prudynt_imaging_state_t runtime_state;
-    if (prudynt_load_imaging_state(&runtime_state) == 0) {
-        merge_prudynt_state(&runtime_entry, &runtime_state);
-        entry = &runtime_entry;
-    }
-
     char options_xml[IMAGING_XML_BUFFER];
-    build_imaging_options_xml(entry, options_xml, sizeof(options_xml));
+    imaging_xml_get("options", entry, build_imaging_options_xml, options_xml, sizeof(options_xml));
 
     long size = cat(NULL, "imaging_service_files/GetOptions.xml", 2, "%IMAGING_OPTIONS%", options_xml);
 
@@ -1192,6 +1433,7 @@ int imaging_set_imaging_settings()
                    "The requested VideoSourceToken does not exist");
         return -1;
     }
+    ircut_mode_load(entry);
 
     prudynt_imaging_state_t runtime_state;
     prudynt_imaging_state_t *state_ptr = NULL;
@@ -1229,20 +1471,9 @@ int imaging_set_imaging_settings()
         }
 
         if (requested != entry->ircut_mode) {
-            switch (requested) {
-            case IRCUT_MODE_ON:
-                execute_backend_command(entry->cmd_ircut_on);
-                break;
-            case IRCUT_MODE_OFF:
-                execute_backend_command(entry->cmd_ircut_off);
-                break;
-            case IRCUT_MODE_AUTO:
-                execute_backend_command(entry->cmd_ircut_auto);
-                break;
-            default:
-                break;
-            }
+            ircut_apply(entry, requested);
             entry->ircut_mode = requested;
+            ircut_mode_save(entry);
         }
     }
 
@@ -1401,7 +1632,8 @@ int imaging_stop()
         return -1;
     }
 
-    execute_backend_command(entry->focus_move.cmd_stop);
+    if (focus_post(entry, FOCUS_POST_STOP, entry->focus_move.cmd_stop, 0.0f, 0.0f) != 0)
+        execute_backend_command(entry->focus_move.cmd_stop);
     entry->focus_state = IMAGING_FOCUS_STATE_IDLE;
 
     long size = cat(NULL, "imaging_service_files/Stop.xml", 0);
@@ -1419,6 +1651,8 @@ int imaging_get_status()
     if (!entry)
         return -1;
 
+    focus_read(entry);
+
     char status_xml[IMAGING_XML_BUFFER];
     build_focus_status_xml(entry, status_xml, sizeof(status_xml));
 
@@ -19,29 +19,31 @@
 #include "conf.h"
 #include "fault.h"
 #include "log.h"
+#include "media_profiles.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
 #include "ptz_service.h"
 #include "utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-extern service_context_t service_ctx;
+// Configurations selected by the Type elements of GetProfiles
+#define MEDIA2_CONF_VSC 0x01
+#define MEDIA2_CONF_ASC 0x02
+#define MEDIA2_CONF_VEC 0x04
+#define MEDIA2_CONF_AEC 0x08
+#define MEDIA2_CONF_PTZ 0x10
+#define MEDIA2_CONF_AOC 0x20
+#define MEDIA2_CONF_ADC 0x40
+#define MEDIA2_CONF_ALL 0x7f
 
-static int media2_audio_decoder_profile_count()
-{
-    int count = 0;
-    for (int i = 0; i < service_ctx.profiles_num; i++) {
-        if (service_ctx.profiles[i].audio_decoder != AUDIO_NONE)
-            count++;
-    }
-    return count;
-}
+extern service_context_t service_ctx;
 
 static int media2_audio_output_supported()
 {
-    if (!service_ctx.audio.output_enabled || media2_audio_decoder_profile_count() == 0) {
+    if (!service_ctx.audio.output_enabled || media_audio_decoder_count() == 0) {
         send_fault("media2_service",
                    "Receiver",
                    "ter:ActionNotSupported",
@@ -59,15 +61,13 @@ int media2_get_service_capabilities()
 
     cap[0] = '\0';
     strcat(cap, "VideoSource VideoEncoder");
-    if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    if (media_audio_encoder_count() > 0) {
         strcat(cap, " AudioSource AudioEncoder");
     }
     if (service_ctx.audio.output_enabled) {
         strcat(cap, " AudioOutput");
     }
-    if ((service_ctx.profiles[0].audio_decoder != AUDIO_NONE)
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_decoder != AUDIO_NONE))) {
+    if (media_audio_decoder_count() > 0) {
         strcat(cap, " AudioDecoder");
     }
     if (service_ctx.ptz_node.enable == 1) {
@@ -81,48 +81,133 @@ int media2_get_service_capabilities()
     return cat("stdout", "media2_service_files/GetServiceCapabilities.xml", 2, "%CAPABILITIES%", cap);
 }
 
-int media2_get_profiles()
+/**
+ * Render the Configurations element of a profile
+ * @param index The index of the profile in service_ctx.profiles
+ * @param types The configurations to include (MEDIA2_CONF_*)
+ * @return a malloc'ed string, NULL on error
+ */
+static char *media2_profile_fragment(int index, int types)
 {
+    stream_profile_t *profile = &service_ctx.profiles[index];
     char profiles_num[8];
     char audio_profiles_num[8];
-    char stmp_w_h[16], stmp_h_h[16];
-    char stmp_w_l[16], stmp_h_l[16];
-    char stmp_fps_h[16], stmp_br_h[16];
-    char stmp_fps_l[16], stmp_br_l[16];
-    char audio_enc_h[16], audio_enc_l[16];
-    char video_enc_h[16], video_enc_l[16];
+    const char *vsc = media_source_fragment();
+    const media_profile_fragments_t *fragments = media_profile_fragments(index);
+    char audio_enc[16];
+    char audio_output_level[8];
+    const char *audio_output_name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
+    const char *audio_output_token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
+    const char *audio_output_config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token
+                                                                                              : "";
+    const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
+    const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
+    const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
+    int audio_source = 0;
+    char *fragment = NULL;
+    char *dest = NULL;
+    long size = 0;
+    int c, i;
+
+    if ((vsc == NULL) || (fragments == NULL))
+        return NULL;
+
+    snprintf(profiles_num, sizeof(profiles_num), "%d", service_ctx.profiles_num);
+    snprintf(audio_profiles_num, sizeof(audio_profiles_num), "%d", media_audio_decoder_count());
+    snprintf(audio_output_level, sizeof(audio_output_level), "%d", service_ctx.audio.backchannel.output_level);
+    audio_enc[0] = '\0';
+    if (profile->audio_encoder != AUDIO_NONE)
+        set_audio_codec(audio_enc, 16, profile->audio_encoder, 2);
+    for (i = 0; i < service_ctx.profiles_num; i++) {
+        if (service_ctx.profiles[i].audio_encoder != AUDIO_NONE)
+            audio_source = 1;
+    }
+
+    // We need 1st step to evaluate the size of the buffer
+    for (c = 0; c < 2; c++) {
+        if (c == 1) {
+            fragment = (char *) malloc(size + 1);
+            if (fragment == NULL)
+                return NULL;
+            fragment[0] = '\0';
+        }
+
+        dest = fragment;
+        size = cat(dest, "media2_service_files/GetProfiles_confstart.xml", 0);
+
+        if ((types & MEDIA2_CONF_VSC) != 0) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media2_service_files/GetProfiles_VSC.xml", 2, "%VSC%", vsc);
+        }
+        if (((types & MEDIA2_CONF_ASC) != 0) && audio_source) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media2_service_files/GetProfiles_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
+        }
+        if ((types & MEDIA2_CONF_VEC) != 0) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest,
+                        "media2_service_files/GetProfiles_VEC.xml",
+                        6,
+                        "%H264PROFILE%",
+                        media_profile_h264(index),
+                        "%PROFILE%",
+                        profile->name,
+                        "%VEC%",
+                        fragments->vec2);
+        }
+        if (((types & MEDIA2_CONF_AEC) != 0) && (profile->audio_encoder != AUDIO_NONE)) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media2_service_files/GetProfiles_AEC.xml", 4, "%PROFILE%", profile->name, "%AUDIO_ENCODING%", audio_enc);
+        }
+        if (((types & MEDIA2_CONF_PTZ) != 0) && (service_ctx.ptz_node.enable == 1)) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media2_service_files/GetProfiles_PTZ.xml", 6,
+                    "%ZOOM_DEFAULT_SPACES%", zoom_def,
+                    "%ZOOM_SPEED%", zoom_spd,
+                    "%ZOOM_LIMITS%", zoom_lim);
+        }
+        if (profile->audio_decoder != AUDIO_NONE) {
+            if (((types & MEDIA2_CONF_AOC) != 0) && service_ctx.audio.output_enabled) {
+                dest = (fragment == NULL) ? NULL : fragment + size;
+                size += cat(dest,
+                            "media2_service_files/GetProfiles_AOC.xml",
+                            10,
+                            "%PROFILES_NUM%",
+                            audio_profiles_num,
+                            "%AUDIO_OUTPUT_CONFIG_TOKEN%",
+                            audio_output_config_token,
+                            "%AUDIO_OUTPUT_NAME%",
+                            audio_output_name,
+                            "%AUDIO_OUTPUT_TOKEN%",
+                            audio_output_token,
+                            "%AUDIO_OUTPUT_LEVEL%",
+                            audio_output_level);
+            }
+            if ((types & MEDIA2_CONF_ADC) != 0) {
+                dest = (fragment == NULL) ? NULL : fragment + size;
+                size += cat(dest, "media2_service_files/GetProfiles_ADC.xml", 2, "%PROFILE%", profile->name);
+            }
+        }
+
+        dest = (fragment == NULL) ? NULL : fragment + size;
+        size += cat(dest, "media2_service_files/GetProfiles_confend.xml", 0);
+    }
+
+    return fragment;
+}
+
+int media2_get_profiles()
+{
     const char *profile_token = get_element("Token", "Body");
     mxml_node_t *x_type;
     int n_type;
-    char xml_name[MAX_LEN];
+    char *fragments[MAX_PROFILES];
     long size;
-    int q, h;
-    char *h264profile[] = {"High", "Main"};
-    char *profile[] = {"Profile_0", "Profile_1"};
-    int c;
+    int first, last;
+    int c, i;
     char dest_a[] = "stdout";
     char *dest;
-    int typeVSC = 0, typeASC = 0, typeVEC = 0, typeAEC = 0, typePTZ = 0, typeAOC = 0, typeADC = 0;
-    char min_x[256], max_x[256], min_y[256], max_y[256], min_z[256], max_z[256];
-
-    audio_enc_h[0] = '\0';
-    audio_enc_l[0] = '\0';
-    video_enc_h[0] = '\0';
-    video_enc_l[0] = '\0';
-    snprintf(profiles_num, sizeof(profiles_num), "%d", service_ctx.profiles_num);
-    snprintf(audio_profiles_num, sizeof(audio_profiles_num), "%d", media2_audio_decoder_profile_count());
-    const char *audio_output_name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
-    const char *audio_output_token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
-    const char *audio_output_config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token
-                                                                                              : "";
-    char audio_output_level[8];
-    snprintf(audio_output_level, sizeof(audio_output_level), "%d", service_ctx.audio.backchannel.output_level);
-    sprintf(min_x, "%.1f", service_ctx.ptz_node.min_step_x);
-    sprintf(max_x, "%.1f", service_ctx.ptz_node.max_step_x);
-    sprintf(min_y, "%.1f", service_ctx.ptz_node.min_step_y);
-    sprintf(max_y, "%.1f", service_ctx.ptz_node.max_step_y);
-    sprintf(min_z, "%.1f", service_ctx.ptz_node.min_step_z);
-    sprintf(max_z, "%.1f", service_ctx.ptz_node.max_step_z);
+    int types = 0;
 
     x_type = get_element_ptr(NULL, "Type", "Body");
     n_type = 0;
@@ -131,28 +216,21 @@ int media2_get_profiles()
             const char *type_text = mxmlGetText(x_type, NULL);
             if (type_text != NULL) {
                 if (strstr(type_text, "VideoSource") != NULL)
-                    typeVSC = 1;
+                    types |= MEDIA2_CONF_VSC;
                 if (strstr(type_text, "AudioSource") != NULL)
-                    typeASC = 1;
+                    types |= MEDIA2_CONF_ASC;
                 if (strstr(type_text, "VideoEncoder") != NULL)
-                    typeVEC = 1;
+                    types |= MEDIA2_CONF_VEC;
                 if (strstr(type_text, "AudioEncoder") != NULL)
-                    typeAEC = 1;
+                    types |= MEDIA2_CONF_AEC;
                 if (strstr(type_text, "PTZ") != NULL)
-                    typePTZ = 1;
+                    types |= MEDIA2_CONF_PTZ;
                 if (strstr(type_text, "AudioOutput") != NULL)
-                    typeAOC = 1;
+                    types |= MEDIA2_CONF_AOC;
                 if (strstr(type_text, "AudioDecoder") != NULL)
-                    typeADC = 1;
-                if (strstr(type_text, "All") != NULL) {
-                    typeVSC = 1;
-                    typeASC = 1;
-                    typeVEC = 1;
-                    typeAEC = 1;
-                    typePTZ = 1;
-                    typeAOC = 1;
-                    typeADC = 1;
-                }
+                    types |= MEDIA2_CONF_ADC;
+                if (strstr(type_text, "All") != NULL)
+                    types |= MEDIA2_CONF_ALL;
             }
             n_type++;
             x_type = mxmlGetNextSibling(x_type);
@@ -160,7 +238,6 @@ int media2_get_profiles()
     } while (x_type != NULL);
 
     if (service_ctx.profiles_num == 0) {
-        q = 0;
         size = cat(NULL, "media2_service_files/GetProfiles_none.xml", 0);
 
         output_http_headers(size);
@@ -168,331 +245,57 @@ int media2_get_profiles()
         return cat("stdout", "media2_service_files/GetProfiles_none.xml", 0);
 
     } else if (profile_token == NULL) {
-        if (service_ctx.profiles_num == 1) {
-            q = 1;
-            h = 0;
-        } else if (service_ctx.profiles_num == 2) {
-            q = 2;
-        }
-    } else if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0)) {
-        q = 1;
-        h = 0;
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        q = 1;
-        h = 1;
+        first = 0;
+        last = service_ctx.profiles_num - 1;
     } else {
-        send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -1;
+        first = media_profile_find(profile_token);
+        if (first < 0) {
+            send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
+            return -1;
+        }
+        last = first;
     }
 
-    if (q == 0) {
-        size = cat(NULL, "media2_service_files/GetProfiles_none.xml", 0);
-
-        output_http_headers(size);
+    // Render each profile once, for both steps
+    for (i = first; i <= last; i++) {
+        fragments[i] = NULL;
+        if (n_type == 0)
+            continue;
+        fragments[i] = media2_profile_fragment(i, types);
+        if (fragments[i] == NULL) {
+            log_error("Unable to render profile %s", service_ctx.profiles[i].name);
+            while (i > first)
+                free(fragments[--i]);
+            send_action_failed_fault("media2_service", -2);
+            return -2;
+        }
+    }
 
-        return cat("stdout", "media2_service_files/GetProfiles_none.xml", 0);
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
+            output_http_headers(size);
+        }
 
-    } else if (q == 1) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
+        for (i = first; i <= last; i++) {
+            if (i == first) {
+                size = cat(dest, "media2_service_files/GetProfiles_header.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
             } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
-
-            size = cat(dest, "media2_service_files/GetProfiles_header.xml", 2, "%PROFILE%", profile[h]);
-
-            if (n_type > 0) {
-                size += cat(dest, "media2_service_files/GetProfiles_confstart.xml", 0);
-
-                if (typeVSC) {
-                    // Get VideoSource from Profile_0
-                    sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-                    sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-                    sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-                    sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VSC.xml",
-                                6,
-                                "%PROFILES_NUM%",
-                                profiles_num,
-                                "%VSC_WIDTH%",
-                                stmp_w_h,
-                                "%VSC_HEIGHT%",
-                                stmp_h_h);
-                }
-                if (typeASC) {
-                    if (((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE))
-                        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-                    }
-                }
-                if (typeVEC) {
-                    sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-                    sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-                    sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-                    sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-                    set_video_codec(video_enc_h, 16, service_ctx.profiles[h].type, 2);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VEC.xml",
-                                14,
-                                "%H264PROFILE%",
-                                h264profile[h],
-                                "%PROFILE%",
-                                profile[h],
-                                "%VIDEO_ENCODING%",
-                                video_enc_h,
-                                "%VEC_WIDTH%",
-                                stmp_w_h,
-                                "%VEC_HEIGHT%",
-                                stmp_h_h,
-                                "%FRAMERATE%",
-                                stmp_fps_h,
-                                "%BITRATE%",
-                                stmp_br_h);
-                }
-                if (typeAEC) {
-                    if (service_ctx.profiles[h].audio_encoder != AUDIO_NONE) {
-                        set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-                        size += cat(dest, "media2_service_files/GetProfiles_AEC.xml", 10, "%PROFILE%", profile[h], "%AUDIO_ENCODING%", audio_enc_h);
-                    }
-                }
-                if (typePTZ) {
-                    if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                        size += cat(dest, "media2_service_files/GetProfiles_PTZ.xml", 6,
-                                "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                                "%ZOOM_SPEED%", zoom_spd,
-                                "%ZOOM_LIMITS%", zoom_lim);
-                    }
-                }
-                if (service_ctx.profiles[h].audio_decoder != AUDIO_NONE) {
-                    if (typeAOC && service_ctx.audio.output_enabled) {
-                        size += cat(dest,
-                                    "media2_service_files/GetProfiles_AOC.xml",
-                                    10,
-                                    "%PROFILES_NUM%",
-                                    audio_profiles_num,
-                                    "%AUDIO_OUTPUT_CONFIG_TOKEN%",
-                                    audio_output_config_token,
-                                    "%AUDIO_OUTPUT_NAME%",
-                                    audio_output_name,
-                                    "%AUDIO_OUTPUT_TOKEN%",
-                                    audio_output_token,
-                                    "%AUDIO_OUTPUT_LEVEL%",
-                                    audio_output_level);
-                    }
-                    if (typeADC) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ADC.xml", 2, "%PROFILE%", profile[h]);
-                    }
-                }
-
-                size += cat(dest, "media2_service_files/GetProfiles_confend.xml", 0);
+                size += cat(dest, "media2_service_files/GetProfiles_middle.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
             }
-            size += cat(dest, "media2_service_files/GetProfiles_footer.xml", 0);
+            if (fragments[i] != NULL)
+                size += cat_string(dest, fragments[i]);
         }
-    } else if (q == 2) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
-            } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
+        size += cat(dest, "media2_service_files/GetProfiles_footer.xml", 0);
+    }
 
-            h = 0;
-            size = cat(dest, "media2_service_files/GetProfiles_header.xml", 2, "%PROFILE%", profile[h]);
-
-            if (n_type > 0) {
-                size += cat(dest, "media2_service_files/GetProfiles_confstart.xml", 0);
-
-                if (typeVSC) {
-                    // Get VideoSource from Profile_0
-                    sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-                    sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-                    sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-                    sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VSC.xml",
-                                6,
-                                "%PROFILES_NUM%",
-                                profiles_num,
-                                "%VSC_WIDTH%",
-                                stmp_w_h,
-                                "%VSC_HEIGHT%",
-                                stmp_h_h);
-                }
-                if (typeASC) {
-                    if (((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE))
-                        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-                    }
-                }
-                if (typeVEC) {
-                    sprintf(stmp_w_h, "%d", service_ctx.profiles[h].width);
-                    sprintf(stmp_h_h, "%d", service_ctx.profiles[h].height);
-                    sprintf(stmp_fps_h, "%d", service_ctx.profiles[h].framerate);
-                    sprintf(stmp_br_h, "%d", service_ctx.profiles[h].bitrate);
-                    set_video_codec(video_enc_h, 16, service_ctx.profiles[h].type, 2);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VEC.xml",
-                                14,
-                                "%H264PROFILE%",
-                                h264profile[h],
-                                "%PROFILE%",
-                                profile[h],
-                                "%VIDEO_ENCODING%",
-                                video_enc_h,
-                                "%VEC_WIDTH%",
-                                stmp_w_h,
-                                "%VEC_HEIGHT%",
-                                stmp_h_h,
-                                "%FRAMERATE%",
-                                stmp_fps_h,
-                                "%BITRATE%",
-                                stmp_br_h);
-                }
-                if (typeAEC) {
-                    if (service_ctx.profiles[h].audio_encoder != AUDIO_NONE) {
-                        set_audio_codec(audio_enc_h, 16, service_ctx.profiles[h].audio_encoder, 2);
-                        size += cat(dest, "media2_service_files/GetProfiles_AEC.xml", 10, "%PROFILE%", profile[h], "%AUDIO_ENCODING%", audio_enc_h);
-                    }
-                }
-                if (typePTZ) {
-                    if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                        size += cat(dest, "media2_service_files/GetProfiles_PTZ.xml", 6,
-                                "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                                "%ZOOM_SPEED%", zoom_spd,
-                                "%ZOOM_LIMITS%", zoom_lim);
-                    }
-                }
-                if (service_ctx.profiles[h].audio_decoder != AUDIO_NONE) {
-                    if (typeAOC && service_ctx.audio.output_enabled) {
-                        size += cat(dest,
-                                    "media2_service_files/GetProfiles_AOC.xml",
-                                    10,
-                                    "%PROFILES_NUM%",
-                                    audio_profiles_num,
-                                    "%AUDIO_OUTPUT_CONFIG_TOKEN%",
-                                    audio_output_config_token,
-                                    "%AUDIO_OUTPUT_NAME%",
-                                    audio_output_name,
-                                    "%AUDIO_OUTPUT_TOKEN%",
-                                    audio_output_token,
-                                    "%AUDIO_OUTPUT_LEVEL%",
-                                    audio_output_level);
-                    }
-                    if (typeADC) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ADC.xml", 2, "%PROFILE%", profile[h]);
-                    }
-                }
-
-                size += cat(dest, "media2_service_files/GetProfiles_confend.xml", 0);
-            }
+    for (i = first; i <= last; i++)
+        free(fragments[i]);
 
-            h = 1;
-            size += cat(dest, "media2_service_files/GetProfiles_middle.xml", 2, "%PROFILE%", profile[h]);
-
-            if (n_type > 0) {
-                size += cat(dest, "media2_service_files/GetProfiles_confstart.xml", 0);
-
-                if (typeVSC) {
-                    // Get VideoSource from Profile_0
-                    sprintf(stmp_w_l, "%d", service_ctx.profiles[0].width);
-                    sprintf(stmp_h_l, "%d", service_ctx.profiles[0].height);
-                    sprintf(stmp_fps_l, "%d", service_ctx.profiles[0].framerate);
-                    sprintf(stmp_br_l, "%d", service_ctx.profiles[0].bitrate);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VSC.xml",
-                                6,
-                                "%PROFILES_NUM%",
-                                profiles_num,
-                                "%VSC_WIDTH%",
-                                stmp_w_l,
-                                "%VSC_HEIGHT%",
-                                stmp_h_l);
-                }
-                if (typeASC) {
-                    if (((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE))
-                        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-                    }
-                }
-                if (typeVEC) {
-                    sprintf(stmp_w_l, "%d", service_ctx.profiles[h].width);
-                    sprintf(stmp_h_l, "%d", service_ctx.profiles[h].height);
-                    sprintf(stmp_fps_l, "%d", service_ctx.profiles[h].framerate);
-                    sprintf(stmp_br_l, "%d", service_ctx.profiles[h].bitrate);
-                    set_video_codec(video_enc_l, 16, service_ctx.profiles[h].type, 2);
-                    size += cat(dest,
-                                "media2_service_files/GetProfiles_VEC.xml",
-                                14,
-                                "%H264PROFILE%",
-                                h264profile[h],
-                                "%PROFILE%",
-                                profile[h],
-                                "%VIDEO_ENCODING%",
-                                video_enc_l,
-                                "%VEC_WIDTH%",
-                                stmp_w_l,
-                                "%VEC_HEIGHT%",
-                                stmp_h_l,
-                                "%FRAMERATE%",
-                                stmp_fps_l,
-                                "%BITRATE%",
-                                stmp_br_l);
-                }
-                if (typeAEC) {
-                    if (service_ctx.profiles[h].audio_encoder != AUDIO_NONE) {
-                        set_audio_codec(audio_enc_l, 16, service_ctx.profiles[h].audio_encoder, 2);
-                        size += cat(dest, "media2_service_files/GetProfiles_AEC.xml", 10, "%PROFILE%", profile[h], "%AUDIO_ENCODING%", audio_enc_l);
-                    }
-                }
-                if (typePTZ) {
-                    if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                        size += cat(dest, "media2_service_files/GetProfiles_PTZ.xml", 6,
-                                "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                                "%ZOOM_SPEED%", zoom_spd,
-                                "%ZOOM_LIMITS%", zoom_lim);
-                    }
-                }
-                if (service_ctx.profiles[h].audio_decoder != AUDIO_NONE) {
-                    if (typeAOC && service_ctx.audio.output_enabled) {
-                        size += cat(dest,
-                                    "media2_service_files/GetProfiles_AOC.xml",
-                                    10,
-                                    "%PROFILES_NUM%",
-                                    audio_profiles_num,
-                                    "%AUDIO_OUTPUT_CONFIG_TOKEN%",
-                                    audio_output_config_token,
-                                    "%AUDIO_OUTPUT_NAME%",
-                                    audio_output_name,
-                                    "%AUDIO_OUTPUT_TOKEN%",
-                                    audio_output_token,
-                                    "%AUDIO_OUTPUT_LEVEL%",
-                                    audio_output_level);
-                    }
-                    if (typeADC) {
-                        size += cat(dest, "media2_service_files/GetProfiles_ADC.xml", 2, "%PROFILE%", profile[h]);
-                    }
-                }
-
-                size += cat(dest, "media2_service_files/GetProfiles_confend.xml", 0);
-            }
-            size += cat(dest, "media2_service_files/GetProfiles_footer.xml", 0);
-        }
-    }
+    return size;
 }
 
 int media2_get_video_source_modes()
@@ -526,45 +329,20 @@ int media2_get_video_source_configurations()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-    char profiles_num[2], stmp_w[16], stmp_h[16];
-
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else if (service_ctx.profiles_num > 0) {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
+    const char *vsc;
 
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0) || (strcasecmp(service_ctx.profiles[1].name, token) == 0)
-        || (strcasecmp("VideoSourceConfigToken", token) == 0)) {
-        sprintf(profiles_num, "%d", service_ctx.profiles_num);
-        sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-        long size = cat(NULL,
-                        "media2_service_files/GetVideoSourceConfigurations.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h);
+    if (media_shared_token_valid(profile_token, configuration_token, "VideoSourceConfigToken")) {
+        vsc = media_source_fragment();
+        if (vsc == NULL) {
+            send_action_failed_fault("media2_service", -2);
+            return -2;
+        }
+
+        long size = cat(NULL, "media2_service_files/GetVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
 
         output_http_headers(size);
 
-        return cat("stdout",
-                   "media2_service_files/GetVideoSourceConfigurations.xml",
-                   6,
-                   "%PROFILES_NUM%",
-                   profiles_num,
-                   "%WIDTH%",
-                   stmp_w,
-                   "%HEIGHT%",
-                   stmp_h);
+        return cat("stdout", "media2_service_files/GetVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
     } else {
         send_fault("media2_service",
                    "Sender",
@@ -580,21 +358,9 @@ int media2_get_video_source_configuration_options()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
     char stmp_w[16], stmp_h[16];
 
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else if (service_ctx.profiles_num > 0) {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
-
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0) || (strcasecmp(service_ctx.profiles[1].name, token) == 0)
-        || (strcasecmp("VideoSourceConfigToken", token) == 0)) {
+    if (media_shared_token_valid(profile_token, configuration_token, "VideoSourceConfigToken")) {
         sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
         sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
         long size = cat(NULL, "media2_service_files/GetVideoSourceConfigurationOptions.xml", 4, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h);
@@ -616,221 +382,62 @@ int media2_get_video_source_configuration_options()
 
 int media2_get_video_encoder_configurations()
 {
-    char stmp_w_l[16], stmp_h_l[16];
-    char stmp_fps_h[16], stmp_br_h[16];
-    char stmp_fps_l[16], stmp_br_l[16];
-    char stmp_w_h[16], stmp_h_h[16];
     const char *profile_token = get_element("ProfileToken", "Body");
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
-    char video_enc_h[16], video_enc_l[16];
+    const media_profile_fragments_t *fragments;
+    long size;
+    int first, last;
+    int c, i;
+    char dest_a[] = "stdout";
+    char *dest;
 
-    memset(token, '\0', sizeof(token));
     if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
+        // Profile_x from token Profile_x_VideoEncoderToken
+        first = media_profile_find_config(configuration_token);
+        last = first;
     } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
+        first = media_profile_find(profile_token);
+        last = first;
+    } else {
+        first = 0;
+        last = service_ctx.profiles_num - 1;
     }
 
-    if (token[0] == '\0') {
-        if (service_ctx.profiles_num == 1) {
-            sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-            sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-            sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-            set_video_codec(video_enc_h, 16, service_ctx.profiles[0].type, 2);
-            long size = cat(NULL,
-                            "media2_service_files/GetVideoEncoderConfigurations.xml",
-                            14,
-                            "%H264PROFILE%",
-                            "High",
-                            "%PROFILE%",
-                            "Profile_0",
-                            "%WIDTH%",
-                            stmp_w_h,
-                            "%HEIGHT%",
-                            stmp_h_h,
-                            "%VIDEO_ENCODING%",
-                            video_enc_h,
-                            "%FRAMERATE%",
-                            stmp_fps_h,
-                            "%BITRATE%",
-                            stmp_br_h);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media2_service_files/GetVideoEncoderConfigurations.xml",
-                       14,
-                       "%H264PROFILE%",
-                       "High",
-                       "%PROFILE%",
-                       "Profile_0",
-                       "%WIDTH%",
-                       stmp_w_h,
-                       "%HEIGHT%",
-                       stmp_h_h,
-                       "%VIDEO_ENCODING%",
-                       video_enc_h,
-                       "%FRAMERATE%",
-                       stmp_fps_h,
-                       "%BITRATE%",
-                       stmp_br_h);
-
-        } else if (service_ctx.profiles_num == 2) {
-            sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-            sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-            sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-            sprintf(stmp_w_l, "%d", service_ctx.profiles[1].width);
-            sprintf(stmp_h_l, "%d", service_ctx.profiles[1].height);
-            sprintf(stmp_fps_l, "%d", service_ctx.profiles[1].framerate);
-            sprintf(stmp_br_l, "%d", service_ctx.profiles[1].bitrate);
-            set_video_codec(video_enc_h, 16, service_ctx.profiles[0].type, 2);
-            set_video_codec(video_enc_l, 16, service_ctx.profiles[1].type, 2);
-            long size = cat(NULL,
-                            "media2_service_files/GetVideoEncoderConfigurations_both.xml",
-                            20,
-                            "%WIDTH_HIGH%",
-                            stmp_w_h,
-                            "%HEIGHT_HIGH%",
-                            stmp_h_h,
-                            "%WIDTH_LOW%",
-                            stmp_w_l,
-                            "%HEIGHT_LOW%",
-                            stmp_h_l,
-                            "%VIDEO_ENCODING_HIGH%",
-                            video_enc_h,
-                            "%VIDEO_ENCODING_LOW%",
-                            video_enc_l,
-                            "%FRAMERATE_HIGH%",
-                            stmp_fps_h,
-                            "%BITRATE_HIGH%",
-                            stmp_br_h,
-                            "%FRAMERATE_LOW%",
-                            stmp_fps_l,
-                            "%BITRATE_LOW%",
-                            stmp_br_l);
+    if ((first < 0) || (last < 0)) {
+        send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
+        return -1;
+    }
+    if (media_profile_fragments(first) == NULL) {
+        send_action_failed_fault("media2_service", -2);
+        return -2;
+    }
 
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
             output_http_headers(size);
-
-            return cat("stdout",
-                       "media2_service_files/GetVideoEncoderConfigurations_both.xml",
-                       20,
-                       "%WIDTH_HIGH%",
-                       stmp_w_h,
-                       "%HEIGHT_HIGH%",
-                       stmp_h_h,
-                       "%WIDTH_LOW%",
-                       stmp_w_l,
-                       "%HEIGHT_LOW%",
-                       stmp_h_l,
-                       "%VIDEO_ENCODING_HIGH%",
-                       video_enc_h,
-                       "%VIDEO_ENCODING_LOW%",
-                       video_enc_l,
-                       "%FRAMERATE_HIGH%",
-                       stmp_fps_h,
-                       "%BITRATE_HIGH%",
-                       stmp_br_h,
-                       "%FRAMERATE_LOW%",
-                       stmp_fps_l,
-                       "%BITRATE_LOW%",
-                       stmp_br_l);
         }
-    } else if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-        sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-        sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-        set_video_codec(video_enc_h, 16, service_ctx.profiles[0].type, 2);
-        long size = cat(NULL,
-                        "media2_service_files/GetVideoEncoderConfigurations.xml",
-                        14,
-                        "%H264PROFILE%",
-                        "High",
-                        "%PROFILE%",
-                        "Profile_0",
-                        "%WIDTH%",
-                        stmp_w_h,
-                        "%HEIGHT%",
-                        stmp_h_h,
-                        "%VIDEO_ENCODING%",
-                        video_enc_h,
-                        "%FRAMERATE%",
-                        stmp_fps_h,
-                        "%BITRATE%",
-                        stmp_br_h);
 
-        output_http_headers(size);
-
-        return cat("stdout",
-                   "media2_service_files/GetVideoEncoderConfigurations.xml",
-                   14,
-                   "%H264PROFILE%",
-                   "High",
-                   "%PROFILE%",
-                   "Profile_0",
-                   "%WIDTH%",
-                   stmp_w_h,
-                   "%HEIGHT%",
-                   stmp_h_h,
-                   "%VIDEO_ENCODING%",
-                   video_enc_h,
-                   "%FRAMERATE%",
-                   stmp_fps_h,
-                   "%BITRATE%",
-                   stmp_br_h);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        sprintf(stmp_w_l, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h_l, "%d", service_ctx.profiles[1].height);
-        sprintf(stmp_fps_l, "%d", service_ctx.profiles[1].framerate);
-        sprintf(stmp_br_l, "%d", service_ctx.profiles[1].bitrate);
-        set_video_codec(video_enc_l, 16, service_ctx.profiles[1].type, 2);
-        long size = cat(NULL,
-                        "media2_service_files/GetVideoEncoderConfigurations.xml",
-                        14,
+        size = cat(dest, "media2_service_files/GetVideoEncoderConfigurations_header.xml", 0);
+        for (i = first; i <= last; i++) {
+            fragments = media_profile_fragments(i);
+            size += cat(dest,
+                        "media2_service_files/GetVideoEncoderConfigurations_item.xml",
+                        6,
                         "%H264PROFILE%",
-                        "Main",
+                        media_profile_h264(i),
                         "%PROFILE%",
-                        "Profile_1",
-                        "%WIDTH%",
-                        stmp_w_l,
-                        "%HEIGHT%",
-                        stmp_h_l,
-                        "%VIDEO_ENCODING%",
-                        video_enc_l,
-                        "%FRAMERATE%",
-                        stmp_fps_l,
-                        "%BITRATE%",
-                        stmp_br_l);
-
-        output_http_headers(size);
-
-        return cat("stdout",
-                   "media2_service_files/GetVideoEncoderConfigurations.xml",
-                   14,
-                   "%H264PROFILE%",
-                   "Main",
-                   "%PROFILE%",
-                   "Profile_1",
-                   "%WIDTH%",
-                   stmp_w_l,
-                   "%HEIGHT%",
-                   stmp_h_l,
-                   "%VIDEO_ENCODING%",
-                   video_enc_l,
-                   "%FRAMERATE%",
-                   stmp_fps_l,
-                   "%BITRATE%",
-                   stmp_br_l);
-    } else {
-        send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -1;
+                        service_ctx.profiles[i].name,
+                        "%VEC%",
+                        fragments->vec2);
+        }
+        size += cat(dest, "media2_service_files/GetVideoEncoderConfigurations_footer.xml", 0);
     }
+
+    return size;
 }
 
 int media2_get_video_encoder_configuration_options()
@@ -838,24 +445,22 @@ int media2_get_video_encoder_configuration_options()
     char stmp_w[16], stmp_h[16];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
     char video_enc[16];
+    int i;
 
-    memset(token, '\0', sizeof(token));
     if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
+        // Profile_x from token Profile_x_VideoEncoderToken
+        i = media_profile_find_config(configuration_token);
     } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (service_ctx.profiles_num > 0) {
-        strncpy(token, service_ctx.profiles[0].name, 9);
+        i = media_profile_find(profile_token);
+    } else {
+        i = (service_ctx.profiles_num > 0) ? 0 : -1;
     }
 
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-        set_video_codec(video_enc, 16, service_ctx.profiles[0].type, 2);
+    if (i >= 0) {
+        sprintf(stmp_w, "%d", service_ctx.profiles[i].width);
+        sprintf(stmp_h, "%d", service_ctx.profiles[i].height);
+        set_video_codec(video_enc, 16, service_ctx.profiles[i].type, 2);
         long size = cat(NULL,
                         "media2_service_files/GetVideoEncoderConfigurationOptions.xml",
                         8,
@@ -864,7 +469,7 @@ int media2_get_video_encoder_configuration_options()
                         "%HEIGHT%",
                         stmp_h,
                         "%H264PROFILE%",
-                        "High",
+                        media_profile_h264(i),
                         "%VIDEO_ENCODING%",
                         video_enc);
 
@@ -878,37 +483,7 @@ int media2_get_video_encoder_configuration_options()
                    "%HEIGHT%",
                    stmp_h,
                    "%H264PROFILE%",
-                   "High",
-                   "%VIDEO_ENCODING%",
-                   video_enc);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        sprintf(stmp_w, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[1].height);
-        set_video_codec(video_enc, 16, service_ctx.profiles[1].type, 2);
-        long size = cat(NULL,
-                        "media2_service_files/GetVideoEncoderConfigurationOptions.xml",
-                        8,
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "Main",
-                        "%VIDEO_ENCODING%",
-                        video_enc);
-
-        output_http_headers(size);
-
-        return cat("stdout",
-                   "media2_service_files/GetVideoEncoderConfigurationOptions.xml",
-                   8,
-                   "%WIDTH%",
-                   stmp_w,
-                   "%HEIGHT%",
-                   stmp_h,
-                   "%H264PROFILE%",
-                   "Main",
+                   media_profile_h264(i),
                    "%VIDEO_ENCODING%",
                    video_enc);
 
@@ -922,37 +497,11 @@ int media2_get_audio_source_configurations()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-    char stmp_w[16], stmp_h[16];
-    char s_profiles_num[2];
+    char s_profiles_num[8];
     int profiles_num;
 
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else if (service_ctx.profiles_num > 0) {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
-
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0) || (strcasecmp(service_ctx.profiles[1].name, token) == 0)
-        || (strcasecmp("AudioSourceConfigToken", token) == 0)) {
-        profiles_num = service_ctx.profiles_num;
-
-        if (profiles_num == 1) {
-            if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-        } else if (profiles_num == 2) {
-            if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-            if (service_ctx.profiles[1].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-        }
+    if (media_shared_token_valid(profile_token, configuration_token, "AudioSourceConfigToken")) {
+        profiles_num = media_audio_encoder_count();
 
         sprintf(s_profiles_num, "%d", profiles_num);
 
@@ -986,80 +535,41 @@ int media2_get_audio_source_configuration_options()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else {
-        if ((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[0].name, 9);
-        } else if ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[1].name, 9);
-        } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -1;
-        }
-    }
-
-    if (((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE))
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
-        if (((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0))
-            || ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0))
-            || (strcasecmp("AudioSourceConfigToken", token) == 0)) {
-            long size = cat(NULL, "media2_service_files/GetAudioSourceConfigurationOptions.xml", 0);
-
-            output_http_headers(size);
 
-            return cat("stdout", "media2_service_files/GetAudioSourceConfigurationOptions.xml", 0);
-        } else {
-            send_fault("media2_service",
-                       "Sender",
-                       "ter:InvalidArgVal",
-                       "ter:NoConfig",
-                       "No config",
-                       "The requested configuration indicated does not exist");
-            return -2;
-        }
-    } else {
+    if (media_audio_encoder_count() == 0) {
         send_fault("media2_service",
                    "Receiver",
                    "ter:ActionNotSupported",
                    "ter:AudioNotSupported",
                    "AudioNotSupported",
                    "The device does not support audio");
-        return -3;
+        return -1;
+    }
+
+    if (media_shared_token_valid(profile_token, configuration_token, "AudioSourceConfigToken")) {
+        long size = cat(NULL, "media2_service_files/GetAudioSourceConfigurationOptions.xml", 0);
+
+        output_http_headers(size);
+
+        return cat("stdout", "media2_service_files/GetAudioSourceConfigurationOptions.xml", 0);
+    } else {
+        send_fault("media2_service",
+                   "Sender",
+                   "ter:InvalidArgVal",
+                   "ter:NoConfig",
+                   "No config",
+                   "The requested configuration indicated does not exist");
+        return -2;
     }
 }
 
 int media2_get_audio_encoder_configurations()
 {
-    char audio_enc_h[16];
-    char audio_enc_l[16];
     const char *profile_token = get_element("ProfileToken", "Body");
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
-
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    }
+    int i, first, last;
 
-    if (((service_ctx.profiles_num == 0) && (service_ctx.profiles[0].audio_encoder == AUDIO_NONE))
-        || ((service_ctx.profiles_num == 2) && (service_ctx.profiles[0].audio_encoder == AUDIO_NONE)
-            && (service_ctx.profiles[1].audio_encoder == AUDIO_NONE))) {
+    if (media_audio_encoder_count() == 0) {
         send_fault("media2_service",
                    "Receiver",
                    "ter:ActionNotSupported",
@@ -1069,165 +579,34 @@ int media2_get_audio_encoder_configurations()
         return -1;
     }
 
-    if (token[0] == '\0') {
-        if (service_ctx.profiles_num == 1) {
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-                long size = cat(NULL,
-                                "media2_service_files/GetAudioEncoderConfigurations.xml",
-                                4,
-                                "%PROFILE%",
-                                "Profile_0",
-                                "%AUDIO_ENCODING%",
-                                audio_enc_h);
-
-                output_http_headers(size);
-
-                return cat("stdout",
-                           "media2_service_files/GetAudioEncoderConfigurations.xml",
-                           4,
-                           "%PROFILE%",
-                           "Profile_0",
-                           "%AUDIO_ENCODING%",
-                           audio_enc_h);
-
-            } else {
-                send_fault("media2_service",
-                           "Receiver",
-                           "ter:ActionNotSupported",
-                           "ter:AudioNotSupported",
-                           "AudioNotSupported",
-                           "The device does not support audio");
-                return -2;
-            }
-
-        } else if (service_ctx.profiles_num == 2) {
-            if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-                set_audio_codec(audio_enc_l, 16, service_ctx.profiles[1].audio_encoder, 2);
-                long size = cat(NULL,
-                                "media2_service_files/GetAudioEncoderConfigurations_both.xml",
-                                4,
-                                "%AUDIO_ENCODING_HIGH%",
-                                audio_enc_h,
-                                "%AUDIO_ENCODING_LOW%",
-                                audio_enc_l);
-
-                output_http_headers(size);
-
-                return cat("stdout",
-                           "media2_service_files/GetAudioEncoderConfigurations_both.xml",
-                           4,
-                           "%AUDIO_ENCODING_HIGH%",
-                           audio_enc_h,
-                           "%AUDIO_ENCODING_LOW%",
-                           audio_enc_l);
-
-            } else if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-                set_audio_codec(audio_enc_l, 16, service_ctx.profiles[1].audio_encoder, 2);
-                long size = cat(NULL,
-                                "media2_service_files/GetAudioEncoderConfigurations.xml",
-                                4,
-                                "%PROFILE%",
-                                "Profile_0",
-                                "%AUDIO_ENCODING%",
-                                audio_enc_h);
-
-                output_http_headers(size);
-
-                return cat("stdout",
-                           "media2_service_files/GetAudioEncoderConfigurations.xml",
-                           4,
-                           "%PROFILE%",
-                           "Profile_0",
-                           "%AUDIO_ENCODING%",
-                           audio_enc_h);
-
-            } else if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-                set_audio_codec(audio_enc_l, 16, service_ctx.profiles[1].audio_encoder, 2);
-                long size = cat(NULL,
-                                "media2_service_files/GetAudioEncoderConfigurations.xml",
-                                4,
-                                "%PROFILE%",
-                                "Profile_1",
-                                "%AUDIO_ENCODING%",
-                                audio_enc_l);
-
-                output_http_headers(size);
-
-                return cat("stdout",
-                           "media2_service_files/GetAudioEncoderConfigurations.xml",
-                           4,
-                           "%PROFILE%",
-                           "Profile_1",
-                           "%AUDIO_ENCODING%",
-                           audio_enc_l);
-
-            } else {
-                send_fault("media2_service",
-                           "Receiver",
-                           "ter:ActionNotSupported",
-                           "ter:AudioNotSupported",
-                           "AudioNotSupported",
-                           "The device does not support audio");
-                return -3;
-            }
-        }
-    } else if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 2);
-            long size
-                = cat(NULL, "media2_service_files/GetAudioEncoderConfigurations.xml", 4, "%PROFILE%", "Profile_0", "%AUDIO_ENCODING%", audio_enc_h);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media2_service_files/GetAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       "Profile_0",
-                       "%AUDIO_ENCODING%",
-                       audio_enc_h);
+    if ((configuration_token != NULL) || (profile_token != NULL)) {
+        // Profile_x from token Profile_x_AudioEncoderToken or Profile_x
+        if (configuration_token != NULL) {
+            i = media_profile_find_config(configuration_token);
         } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -4;
+            i = media_profile_find(profile_token);
         }
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_enc_l, 16, service_ctx.profiles[1].audio_encoder, 2);
-            long size
-                = cat(NULL, "media2_service_files/GetAudioEncoderConfigurations.xml", 4, "%PROFILE%", "Profile_1", "%AUDIO_ENCODING%", audio_enc_l);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media2_service_files/GetAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       "Profile_1",
-                       "%AUDIO_ENCODING%",
-                       audio_enc_l);
-        } else {
+        if (i < 0) {
+            send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
+            return -2;
+        }
+        if (service_ctx.profiles[i].audio_encoder == AUDIO_NONE) {
             send_fault("media2_service",
                        "Receiver",
                        "ter:ActionNotSupported",
                        "ter:AudioNotSupported",
                        "AudioNotSupported",
                        "The device does not support audio");
-            return -5;
+            return -3;
         }
+        first = i;
+        last = i;
     } else {
-        send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -6;
+        first = 0;
+        last = service_ctx.profiles_num - 1;
     }
+
+    return media_audio_configurations_send("media2_service_files/GetAudioEncoderConfigurations", first, last, 0, 2);
 }
 
 int media2_get_audio_encoder_configuration_options()
@@ -1235,23 +614,13 @@ int media2_get_audio_encoder_configuration_options()
     char audio_enc[16];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
+    int i, encoder;
 
     char bitrate[4], samplerate[4];
 
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else {
-        if ((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[0].name, 9);
-        } else if ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[1].name, 9);
-        } else {
+    i = media_audio_profile_find(configuration_token, profile_token, 0);
+    if (i < 0) {
+        if ((configuration_token == NULL) && (profile_token == NULL)) {
             send_fault("media2_service",
                        "Receiver",
                        "ter:ActionNotSupported",
@@ -1260,55 +629,31 @@ int media2_get_audio_encoder_configuration_options()
                        "The device does not support audio");
             return -1;
         }
-    }
-
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        // G726 is not suppoerted
-        if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[0].audio_encoder != G726)) {
-            set_audio_codec(audio_enc, 16, service_ctx.profiles[0].audio_encoder, 2);
-
-            if (service_ctx.profiles[0].audio_encoder == G711) {
-                sprintf(bitrate, "%d", 64);
-                sprintf(samplerate, "%d", 8);
-            } else if (service_ctx.profiles[0].audio_encoder == AAC) {
-                sprintf(bitrate, "%d", 50);
-                sprintf(samplerate, "%d", 16);
-            }
-        } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -2;
-        }
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        // G726 is not suppoerted
-        if ((service_ctx.profiles[1].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_encoder != G726)) {
-            set_audio_codec(audio_enc, 16, service_ctx.profiles[1].audio_encoder, 2);
-
-            if (service_ctx.profiles[1].audio_encoder == G711) {
-                sprintf(bitrate, "%d", 64);
-                sprintf(samplerate, "%d", 8);
-            } else if (service_ctx.profiles[1].audio_encoder == AAC) {
-                sprintf(bitrate, "%d", 50);
-                sprintf(samplerate, "%d", 16);
-            }
-        } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -3;
-        }
-    } else {
         send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -4;
     }
 
+    // G726 is not suppoerted
+    encoder = service_ctx.profiles[i].audio_encoder;
+    if ((encoder == AUDIO_NONE) || (encoder == G726)) {
+        send_fault("media2_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioNotSupported",
+                   "AudioNotSupported",
+                   "The device does not support audio");
+        return -2;
+    }
+    set_audio_codec(audio_enc, 16, encoder, 2);
+
+    if (encoder == G711) {
+        sprintf(bitrate, "%d", 64);
+        sprintf(samplerate, "%d", 8);
+    } else if (encoder == AAC) {
+        sprintf(bitrate, "%d", 50);
+        sprintf(samplerate, "%d", 16);
+    }
+
     long size = cat(NULL,
                     "media2_service_files/GetAudioEncoderConfigurationOptions.xml",
                     6,
@@ -1336,27 +681,14 @@ int media2_get_audio_output_configurations()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-    char stmp_w[16], stmp_h[16];
     char s_profiles_num[8];
     int profiles_num;
 
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else if (service_ctx.profiles_num > 0) {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
-
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0) || (strcasecmp(service_ctx.profiles[1].name, token) == 0)
-        || (strcasecmp("AudioOutputConfigToken", token) == 0)) {
+    if (media_shared_token_valid(profile_token, configuration_token, "AudioOutputConfigToken")) {
         if (!media2_audio_output_supported())
             return -1;
 
-        profiles_num = media2_audio_decoder_profile_count();
+        profiles_num = media_audio_decoder_count();
         if (profiles_num <= 0) {
             send_fault("media2_service",
                        "Receiver",
@@ -1418,36 +750,21 @@ int media2_get_audio_output_configuration_options()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else {
-        if ((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_decoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[0].name, 9);
-        } else if ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_decoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[1].name, 9);
-        } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioOutputNotSupported",
-                       "AudioOutputNotSupported",
-                       "Audio or Audio Outputs are not supported by the device");
-            return -1;
-        }
+
+    if ((configuration_token == NULL) && (profile_token == NULL) && (media_audio_decoder_count() == 0)) {
+        send_fault("media2_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioOutputNotSupported",
+                   "AudioOutputNotSupported",
+                   "Audio or Audio Outputs are not supported by the device");
+        return -1;
     }
 
     if (!media2_audio_output_supported())
         return -3;
 
-    if (((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0))
-        || ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0))
-        || (strcasecmp("AudioOutputConfigToken", token) == 0)) {
+    if (media_shared_token_valid(profile_token, configuration_token, "AudioOutputConfigToken")) {
         const char *output_token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
         char min_level[8];
         char max_level[8];
@@ -1490,144 +807,63 @@ int media2_get_audio_decoder_configurations()
 {
     const char *profile_token = get_element("ProfileToken", "Body");
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
+    int i, first, last;
 
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoDecoderConfig
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
+    if (media_audio_decoder_count() == 0) {
+        send_fault("media2_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioDecodingNotSupported",
+                   "AudioDecodingNotSupported",
+                   "Audio or Audio decoding is not supported by the device");
+        return -1;
     }
 
-    if (token[0] == '\0') {
-        if (service_ctx.profiles_num == 1) {
-            if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-                long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-
-                output_http_headers(size);
-
-                return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-            } else {
-                send_fault("media2_service2",
-                           "Receiver",
-                           "ter:ActionNotSupported",
-                           "ter:AudioDecodingNotSupported",
-                           "AudioDecodingNotSupported",
-                           "Audio or Audio decoding is not supported by the device");
-                return -1;
-            }
-        } else if (service_ctx.profiles_num == 2) {
-            if ((service_ctx.profiles[0].audio_decoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_decoder != AUDIO_NONE)) {
-                long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations_both.xml", 0);
-
-                output_http_headers(size);
-
-                return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations_both.xml", 0);
-
-            } else if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-                long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-
-                output_http_headers(size);
-
-                return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-            } else if (service_ctx.profiles[1].audio_decoder != AUDIO_NONE) {
-                long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
-
-                output_http_headers(size);
-
-                return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
-            } else {
-                send_fault("media2_service2",
-                           "Receiver",
-                           "ter:ActionNotSupported",
-                           "ter:AudioDecodingNotSupported",
-                           "AudioDecodingNotSupported",
-                           "Audio or Audio decoding is not supported by the device");
-                return -2;
-            }
-        }
-    } else if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-
-            output_http_headers(size);
-
-            return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
+    if ((configuration_token != NULL) || (profile_token != NULL)) {
+        // Profile_x from token Profile_x_AudioDecoderToken or Profile_x
+        if (configuration_token != NULL) {
+            i = media_profile_find_config(configuration_token);
         } else {
-            send_fault("media2_service2",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -3;
+            i = media_profile_find(profile_token);
         }
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        if (service_ctx.profiles[1].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
-
-            output_http_headers(size);
-
-            return cat("stdout", "media2_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
-        } else {
-            send_fault("media2_service2",
+        if (i < 0) {
+            send_fault("media2_service",
+                       "Sender",
+                       "ter:InvalidArgVal",
+                       "ter:NoConfig",
+                       "No config",
+                       "The requested configuration indicated does not exist");
+            return -2;
+        }
+        if (service_ctx.profiles[i].audio_decoder == AUDIO_NONE) {
+            send_fault("media2_service",
                        "Receiver",
                        "ter:ActionNotSupported",
                        "ter:AudioDecodingNotSupported",
                        "AudioDecodingNotSupported",
                        "Audio or Audio decoding is not supported by the device");
-            return -4;
+            return -3;
         }
+        first = i;
+        last = i;
     } else {
-        send_fault("media2_service",
-                   "Sender",
-                   "ter:InvalidArgVal",
-                   "ter:NoConfig",
-                   "No config",
-                   "The requested configuration indicated does not exist");
-        return -5;
+        first = 0;
+        last = service_ctx.profiles_num - 1;
     }
+
+    return media_audio_configurations_send("media2_service_files/GetAudioDecoderConfigurations", first, last, 1, 2);
 }
 
 int media2_get_audio_decoder_configuration_options()
 {
-    int decoder_type = AUDIO_NONE;
+    int i, decoder_type;
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
     char audio_decoder[16];
     char bitrate[4], samplerate[4];
 
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else {
-        if ((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_decoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[0].name, 9);
-        } else if ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_decoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[1].name, 9);
-        } else {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -1;
-        }
-    }
-
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        decoder_type = service_ctx.profiles[0].audio_decoder;
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        decoder_type = service_ctx.profiles[1].audio_decoder;
-    }
+    i = media_audio_profile_find(configuration_token, profile_token, 1);
+    decoder_type = (i >= 0) ? service_ctx.profiles[i].audio_decoder : AUDIO_NONE;
 
     // G726 is not suppoerted
     if ((decoder_type != AUDIO_NONE) && (decoder_type != G726)) {
@@ -1669,29 +905,24 @@ int media2_get_audio_decoder_configuration_options()
                    "ter:AudioDecodingNotSupported",
                    "AudioDecodingNotSupported",
                    "Audio or Audio decoding is not supported by the device");
-        return -2;
+        return -1;
     }
 }
 
 int media2_get_snapshot_uri()
 {
-    char address[16];
-    char netmask[16];
-    char *s;
-    char line[MAX_LEN];
     const char *profile_token = get_element("ProfileToken", "Body");
-
-    memset(line, '\0', sizeof(line));
-
-    get_ip_address(address, netmask, service_ctx.ifs);
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0)) {
-        if (service_ctx.profiles[0].snapurl == NULL) {
+    i = media_profile_find(profile_token);
+    if (i >= 0) {
+        if (service_ctx.profiles[i].snapurl == NULL) {
             send_fault(
                 "media2_service",
                 "Receiver",
@@ -1702,67 +933,38 @@ int media2_get_snapshot_uri()
             return -2;
         }
 
-        // Construct snapshot URL with token authentication
-        construct_uri_with_token(line, MAX_LEN, service_ctx.profiles[0].snapurl, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
-
-        output_http_headers(size);
-
-        return cat("stdout", "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].snapurl == NULL) {
-            send_fault(
-                "media2_service",
-                "Receiver",
-                "ter:Action",
-                "ter:IncompleteConfiguration",
-                "Incomplete configuration",
-                "The specified media profile does not contain either a reference to a video encoder configuration or a reference to a video source configuration");
-            return -3;
+        fragments = media_profile_fragments(i);
+        if (fragments == NULL) {
+            send_action_failed_fault("media2_service", -4);
+            return -4;
         }
 
-        // Construct snapshot URL with token authentication
-        construct_uri_with_token(line, MAX_LEN, service_ctx.profiles[1].snapurl, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
+        long size = cat(NULL, "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", fragments->snapshot_uri);
 
         output_http_headers(size);
 
-        return cat("stdout", "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
+        return cat("stdout", "media2_service_files/GetSnapshotUri.xml", 2, "%URI%", fragments->snapshot_uri);
 
     } else {
         send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -4;
+        return -3;
     }
 }
 
 int media2_get_stream_uri()
 {
-    char address[16];
-    char netmask[16];
-    char *s;
-    char line[MAX_LEN];
     const char *profile_token = get_element("ProfileToken", "Body");
-
-    memset(line, '\0', sizeof(line));
-
-    get_ip_address(address, netmask, service_ctx.ifs);
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        if (service_ctx.profiles[0].url == NULL) {
+    i = media_profile_find(profile_token);
+    if (i >= 0) {
+        if (service_ctx.profiles[i].url == NULL) {
             send_fault("media2_service",
                        "Receiver",
                        "ter:Action",
@@ -1772,44 +974,21 @@ int media2_get_stream_uri()
             return -2;
         }
 
-        // Construct RTSP URL
-        construct_uri(line, MAX_LEN, service_ctx.profiles[0].url, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media2_service_files/GetStreamUri.xml", 2, "%URI%", line);
-
-        output_http_headers(size);
-
-        return cat("stdout", "media2_service_files/GetStreamUri.xml", 2, "%URI%", line);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].url == NULL) {
-            send_fault("media2_service",
-                       "Receiver",
-                       "ter:Action",
-                       "ter:IncompleteConfiguration",
-                       "Incomplete configuration",
-                       "The specified media profile does contain either unused sources or encoder configurations without a corresponding source");
-            return -3;
+        fragments = media_profile_fragments(i);
+        if (fragments == NULL) {
+            send_action_failed_fault("media2_service", -4);
+            return -4;
         }
 
-        // Construct RTSP URL
-        construct_uri(line, MAX_LEN, service_ctx.profiles[1].url, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media2_service_files/GetStreamUri.xml", 2, "%URI%", line);
+        long size = cat(NULL, "media2_service_files/GetStreamUri.xml", 2, "%URI%", fragments->stream_uri);
 
         output_http_headers(size);
 
-        return cat("stdout", "media2_service_files/GetStreamUri.xml", 2, "%URI%", line);
+        return cat("stdout", "media2_service_files/GetStreamUri.xml", 2, "%URI%", fragments->stream_uri);
 
     } else {
         send_fault("media2_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -4;
+        return -3;
     }
 }
 
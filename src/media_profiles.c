@@ -0,0 +1,431 @@
+/*
+ * Copyright (c) 2025 Thingino
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "media_profiles.h"
+
+#include "log.h"
+#include "onvif_simple_server.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MEDIA_RUN_DIR "/run/onvif_media"
+#define MEDIA_FRAGMENTS_FILE MEDIA_RUN_DIR "/profiles"
+#define MEDIA_API_KEY_FILE "/etc/thingino-api.key" // Read by construct_uri_with_token()
+
+extern service_context_t service_ctx;
+
+static int fragments_loaded;
+static char *source_fragment;
+static media_profile_fragments_t fragments[MAX_PROFILES];
+
+/**
+ * Find a media profile by token
+ * @param token The profile token (case insensitive)
+ * @return the index in service_ctx.profiles, -1 if there is no such profile
+ */
+int media_profile_find(const char *token)
+{
+    if (token == NULL)
+        return -1;
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        if ((service_ctx.profiles[i].name != NULL) && (strcasecmp(service_ctx.profiles[i].name, token) == 0))
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Find the media profile of a configuration token (<profile>_VideoEncoderToken)
+ * or of a profile token. Profile names may contain '_' ("Profile" and
+ * "Profile_1"), so the longest name the token starts with wins.
+ * @return the index in service_ctx.profiles, -1 if there is no such profile
+ */
+int media_profile_find_config(const char *token)
+{
+    size_t best_len = 0;
+    int best = -1;
+
+    if (token == NULL)
+        return -1;
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        size_t len;
+
+        if (service_ctx.profiles[i].name == NULL)
+            continue;
+        len = strlen(service_ctx.profiles[i].name);
+        if (((best < 0) || (len > best_len)) && (strncasecmp(service_ctx.profiles[i].name, token, len) == 0) && ((token[len] == '\0') || (token[len] == '_'))) {
+            best = i;
+            best_len = len;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Check the token of a configuration shared by all the profiles (video or
+ * audio source, audio output)
+ * @param profile_token The requested profile, NULL if none
+ * @param configuration_token The requested configuration, NULL if none
+ * @param shared_token The token of the shared configuration
+ * @return 1 if the request designates it, 0 otherwise
+ */
+int media_shared_token_valid(const char *profile_token, const char *configuration_token, const char *shared_token)
+{
+    if (profile_token != NULL)
+        return media_profile_find(profile_token) >= 0;
+    if (configuration_token != NULL)
+        return (strcasecmp(shared_token, configuration_token) == 0) || (media_profile_find(configuration_token) >= 0);
+
+    return service_ctx.profiles_num > 0;
+}
+
+// Number of profiles with an audio encoder
+int media_audio_encoder_count()
+{
+    int count = 0;
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        if (service_ctx.profiles[i].audio_encoder != AUDIO_NONE)
+            count++;
+    }
+    return count;
+}
+
+// Number of profiles with an audio decoder (back channel)
+int media_audio_decoder_count()
+{
+    int count = 0;
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        if (service_ctx.profiles[i].audio_decoder != AUDIO_NONE)
+            count++;
+    }
+    return count;
+}
+
+/**
+ * Find the profile of an audio encoder or decoder request
+ * @param configuration_token <profile>_Audio...Token, NULL if none
+ * @param profile_token The profile token, NULL if none
+ * @param decoder 0 for the audio encoder, 1 for the audio decoder
+ * @return the index in service_ctx.profiles (without a token the first
+ * profile with audio), -1 if there is no such profile
+ */
+int media_audio_profile_find(const char *configuration_token, const char *profile_token, int decoder)
+{
+    if (configuration_token != NULL)
+        return media_profile_find_config(configuration_token);
+    if (profile_token != NULL)
+        return media_profile_find(profile_token);
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        if ((decoder ? service_ctx.profiles[i].audio_decoder : service_ctx.profiles[i].audio_encoder) != AUDIO_NONE)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Send the audio encoder or decoder configurations of the profiles
+ * first..last that have one
+ * @param templates Path of the _header, _item and _footer templates without the suffix
+ * @param decoder 0 for the audio encoders, 1 for the audio decoders
+ * @param version 1 for media, 2 for media2 (encoding names)
+ */
+long media_audio_configurations_send(const char *templates, int first, int last, int decoder, int version)
+{
+    char header[MAX_LEN], item[MAX_LEN], footer[MAX_LEN];
+    char audio_enc[16];
+    char dest_a[] = "stdout";
+    char *dest;
+    long size = 0;
+    int c, i, type;
+
+    snprintf(header, sizeof(header), "%s_header.xml", templates);
+    snprintf(item, sizeof(item), "%s_item.xml", templates);
+    snprintf(footer, sizeof(footer), "%s_footer.xml", templates);
+
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
+            output_http_headers(size);
+        }
+
+        size = cat(dest, header, 0);
+        for (i = first; i <= last; i++) {
+            type = decoder ? service_ctx.profiles[i].audio_decoder : service_ctx.profiles[i].audio_encoder;
+            if (type == AUDIO_NONE)
+                continue;
+            set_audio_codec(audio_enc, 16, type, version);
+            size += cat(dest, item, 4, "%PROFILE%", service_ctx.profiles[i].name, "%AUDIO_ENCODING%", audio_enc);
+        }
+        size += cat(dest, footer, 0);
+    }
+
+    return size;
+}
+
+// Profiles are sorted by resolution: the main stream gets High, sub streams Main
+const char *media_profile_h264(int index)
+{
+    return (index == 0) ? "High" : "Main";
+}
+
+static void fragments_free()
+{
+    free(source_fragment);
+    source_fragment = NULL;
+    for (int i = 0; i < MAX_PROFILES; i++) {
+        free(fragments[i].vec);
+        free(fragments[i].vec2);
+        free(fragments[i].stream_uri);
+        free(fragments[i].snapshot_uri);
+    }
+    memset(fragments, 0, sizeof(fragments));
+}
+
+static char *uri_fragment(const char *uri_template, const char *address, int snapshot)
+{
+    char line[MAX_LEN];
+
+    line[0] = '\0';
+    if (uri_template != NULL) {
+        if (snapshot) {
+            construct_uri_with_credentials(line, MAX_LEN, uri_template, address, service_ctx.username, service_ctx.password);
+        } else {
+            construct_uri(line, MAX_LEN, uri_template, address);
+        }
+        html_escape(line, MAX_LEN);
+    }
+
+    return strdup(line);
+}
+
+static int fragments_build(const char *address)
+{
+    char profiles_num[8];
+    char stmp_w[16], stmp_h[16];
+    char stmp_fps[16], stmp_br[16];
+    char video_enc[16];
+
+    snprintf(profiles_num, sizeof(profiles_num), "%d", service_ctx.profiles_num);
+    // The video source is the one of the 1st profile
+    sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
+    sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
+    source_fragment = cat_alloc("media_service_files/VideoSourceConfiguration.xml", 6, "%PROFILES_NUM%", profiles_num, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h);
+    if (source_fragment == NULL)
+        return -1;
+
+    for (int i = 0; i < service_ctx.profiles_num; i++) {
+        stream_profile_t *profile = &service_ctx.profiles[i];
+
+        sprintf(stmp_w, "%d", profile->width);
+        sprintf(stmp_h, "%d", profile->height);
+        sprintf(stmp_fps, "%d", profile->framerate);
+        sprintf(stmp_br, "%d", profile->bitrate);
+        set_video_codec(video_enc, 16, profile->type, 2);
+
+        fragments[i].vec = cat_alloc("media_service_files/VideoEncoderConfiguration.xml",
+                                     12,
+                                     "%PROFILE%",
+                                     profile->name,
+                                     "%WIDTH%",
+                                     stmp_w,
+                                     "%HEIGHT%",
+                                     stmp_h,
+                                     "%H264PROFILE%",
+                                     media_profile_h264(i),
+                                     "%FRAMERATE%",
+                                     stmp_fps,
+                                     "%BITRATE%",
+                                     stmp_br);
+        fragments[i].vec2 = cat_alloc("media2_service_files/VideoEncoder.xml",
+                                      12,
+                                      "%PROFILE%",
+                                      profile->name,
+                                      "%VIDEO_ENCODING%",
+                                      video_enc,
+                                      "%WIDTH%",
+                                      stmp_w,
+                                      "%HEIGHT%",
+                                      stmp_h,
+                                      "%FRAMERATE%",
+                                      stmp_fps,
+                                      "%BITRATE%",
+                                      stmp_br);
+        fragments[i].stream_uri = uri_fragment(profile->url, address, 0);
+        fragments[i].snapshot_uri = uri_fragment(profile->snapurl, address, 1);
+        if ((fragments[i].vec == NULL) || (fragments[i].vec2 == NULL) || (fragments[i].stream_uri == NULL) || (fragments[i].snapshot_uri == NULL))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Fragment cache.
+ * The fragments only depend on the configuration, on the API key appended
+ * to the snapshot URIs and on the camera address, so they are kept in
+ * MEDIA_FRAGMENTS_FILE for the next requests. The first line holds the
+ * configuration and API key generations and the address they were built
+ * with, then each fragment takes one line: cat() output has no newlines.
+ */
+static char *cache_line(FILE *fp)
+{
+    char *line = NULL;
+    size_t line_len = 0;
+    ssize_t n;
+
+    n = getline(&line, &line_len, fp);
+    if ((n <= 0) || (line[n - 1] != '\n')) {
+        free(line);
+        return NULL;
+    }
+    line[n - 1] = '\0';
+
+    return line;
+}
+
+static int fragments_cache_load(unsigned long long key_generation, const char *address)
+{
+    FILE *fp;
+    struct stat st;
+    unsigned long long file_conf, file_key;
+    char file_address[16];
+    int file_profiles_num;
+    int ret = -1;
+
+    fp = fopen(MEDIA_FRAGMENTS_FILE, "r");
+    if (fp == NULL)
+        return -1;
+    // A file readable by others is rebuilt private
+    if ((fstat(fileno(fp), &st) != 0) || ((st.st_mode & 077) != 0)
+        || (fscanf(fp, "#generation %llx %llx %15s %d\n", &file_conf, &file_key, file_address, &file_profiles_num) != 4)
+        || (file_conf != service_ctx.conf_generation) || (file_key != key_generation) || (strcmp(file_address, address) != 0)
+        || (file_profiles_num != service_ctx.profiles_num)) {
+        fclose(fp);
+        return -1;
+    }
+
+    source_fragment = cache_line(fp);
+    if (source_fragment != NULL) {
+        ret = 0;
+        for (int i = 0; i < service_ctx.profiles_num; i++) {
+            fragments[i].vec = cache_line(fp);
+            fragments[i].vec2 = cache_line(fp);
+            fragments[i].stream_uri = cache_line(fp);
+            fragments[i].snapshot_uri = cache_line(fp);
+            if ((fragments[i].vec == NULL) || (fragments[i].vec2 == NULL) || (fragments[i].stream_uri == NULL) || (fragments[i].snapshot_uri == NULL)) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    if (ret != 0)
+        fragments_free();
+
+    return ret;
+}
+
+static void fragments_cache_save(unsigned long long key_generation, const char *address)
+{
+    char tmp_file[sizeof(MEDIA_FRAGMENTS_FILE) + 8];
+    FILE *fp;
+
+    // The snapshot URIs hold the API key: keep the file private
+    fp = run_file_create(MEDIA_RUN_DIR, MEDIA_FRAGMENTS_FILE, 0600, tmp_file, sizeof(tmp_file));
+    if (fp == NULL)
+        return;
+    fprintf(fp, "#generation %llx %llx %s %d\n%s\n", service_ctx.conf_generation, key_generation, address, service_ctx.profiles_num, source_fragment);
+    for (int i = 0; i < service_ctx.profiles_num; i++)
+        fprintf(fp, "%s\n%s\n%s\n%s\n", fragments[i].vec, fragments[i].vec2, fragments[i].stream_uri, fragments[i].snapshot_uri);
+    run_file_commit(fp, tmp_file, MEDIA_FRAGMENTS_FILE);
+}
+
+/*
+ * Get the fragments of all the profiles, built once per configuration and
+ * shared by the media and media2 services.
+ */
+static int fragments_load()
+{
+    char address[16];
+    char netmask[16];
+    unsigned long long key_generation;
+
+    if (fragments_loaded)
+        return 0;
+    if (service_ctx.profiles_num == 0)
+        return -1;
+
+    address[0] = '\0';
+    get_ip_address(address, netmask, service_ctx.ifs);
+    key_generation = file_generation(MEDIA_API_KEY_FILE);
+
+    if ((service_ctx.conf_generation != 0) && (fragments_cache_load(key_generation, address) == 0)) {
+        fragments_loaded = 1;
+        return 0;
+    }
+
+    if (fragments_build(address) != 0) {
+        log_error("Unable to build the media profile fragments");
+        fragments_free();
+        return -1;
+    }
+    if (service_ctx.conf_generation != 0)
+        fragments_cache_save(key_generation, address);
+    fragments_loaded = 1;
+
+    return 0;
+}
+
+/**
+ * Get the children of the VideoSourceConfiguration
+ * @return the fragment, NULL on error
+ */
+const char *media_source_fragment()
+{
+    if (fragments_load() != 0)
+        return NULL;
+
+    return source_fragment;
+}
+
+/**
+ * Get the fragments of a profile
+ * @param index The index of the profile in service_ctx.profiles
+ * @return the fragments, NULL on error
+ */
+const media_profile_fragments_t *media_profile_fragments(int index)
+{
+    if ((index < 0) || (index >= service_ctx.profiles_num) || (fragments_load() != 0))
+        return NULL;
+
+    return &fragments[index];
+}
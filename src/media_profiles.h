@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2025 Thingino
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEDIA_PROFILES_H
+#define MEDIA_PROFILES_H
+
+// Parts of the media and media2 responses built from a profile
+typedef struct {
+    char *vec;          // Children of the media VideoEncoderConfiguration
+    char *vec2;         // Children of the media2 VideoEncoder
+    char *stream_uri;   // Escaped, "" without url
+    char *snapshot_uri; // Escaped, "" without snapurl
+} media_profile_fragments_t;
+
+int media_profile_find(const char *token);
+int media_profile_find_config(const char *token);
+int media_shared_token_valid(const char *profile_token, const char *configuration_token, const char *shared_token);
+int media_audio_encoder_count();
+int media_audio_decoder_count();
+int media_audio_profile_find(const char *configuration_token, const char *profile_token, int decoder);
+long media_audio_configurations_send(const char *templates, int first, int last, int decoder, int version);
+const char *media_profile_h264(int index);
+const char *media_source_fragment();
+const media_profile_fragments_t *media_profile_fragments(int index);
+
+#endif // MEDIA_PROFILES_H
@@ -19,29 +19,21 @@
 #include "conf.h"
 #include "fault.h"
 #include "log.h"
+#include "media_profiles.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
 #include "ptz_service.h"
 #include "utils.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 extern service_context_t service_ctx;
 
-static int audio_decoder_profile_count()
-{
-    int count = 0;
-    for (int i = 0; i < service_ctx.profiles_num; i++) {
-        if (service_ctx.profiles[i].audio_decoder != AUDIO_NONE)
-            count++;
-    }
-    return count;
-}
-
 static int media_audio_output_supported()
 {
-    if (!service_ctx.audio.output_enabled || audio_decoder_profile_count() == 0) {
+    if (!service_ctx.audio.output_enabled || media_audio_decoder_count() == 0) {
         send_fault("media_service",
                    "Receiver",
                    "ter:ActionNotSupported",
@@ -61,7 +53,7 @@ static int media_audio_output_supported()
  * breaking profile discovery for every client. */
 static int media_audio_output_available()
 {
-    return service_ctx.audio.output_enabled && audio_decoder_profile_count() > 0;
+    return service_ctx.audio.output_enabled && media_audio_decoder_count() > 0;
 }
 
 int media_get_service_capabilities()
@@ -89,31 +81,24 @@ int media_get_video_sources()
 
 int media_get_video_source_configurations()
 {
-    char profiles_num[2], stmp_w[16], stmp_h[16];
+    const char *vsc = media_source_fragment();
 
-    sprintf(profiles_num, "%d", service_ctx.profiles_num);
-    sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-    sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-    long size
-        = cat(NULL, "media_service_files/GetVideoSourceConfigurations.xml", 6, "%PROFILES_NUM%", profiles_num, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h);
+    if (vsc == NULL) {
+        send_action_failed_fault("media_service", -1);
+        return -1;
+    }
+
+    long size = cat(NULL, "media_service_files/GetVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
 
     output_http_headers(size);
 
-    return cat("stdout",
-               "media_service_files/GetVideoSourceConfigurations.xml",
-               6,
-               "%PROFILES_NUM%",
-               profiles_num,
-               "%WIDTH%",
-               stmp_w,
-               "%HEIGHT%",
-               stmp_h);
+    return cat("stdout", "media_service_files/GetVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
 }
 
 int media_get_video_source_configuration()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char profiles_num[2], stmp_w[16], stmp_h[16];
+    const char *vsc;
 
     if (configuration_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
@@ -121,30 +106,17 @@ int media_get_video_source_configuration()
     }
 
     if (strncasecmp("VideoSourceConfigToken", configuration_token, 22) == 0) {
-        sprintf(profiles_num, "%d", service_ctx.profiles_num);
-        sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-        long size = cat(NULL,
-                        "media_service_files/GetVideoSourceConfiguration.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h);
+        vsc = media_source_fragment();
+        if (vsc == NULL) {
+            send_action_failed_fault("media_service", -3);
+            return -3;
+        }
+
+        long size = cat(NULL, "media_service_files/GetVideoSourceConfiguration.xml", 2, "%VSC%", vsc);
 
         output_http_headers(size);
 
-        return cat("stdout",
-                   "media_service_files/GetVideoSourceConfiguration.xml",
-                   6,
-                   "%PROFILES_NUM%",
-                   profiles_num,
-                   "%WIDTH%",
-                   stmp_w,
-                   "%HEIGHT%",
-                   stmp_h);
+        return cat("stdout", "media_service_files/GetVideoSourceConfiguration.xml", 2, "%VSC%", vsc);
 
     } else {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
@@ -156,59 +128,27 @@ int media_get_compatible_video_source_configurations()
 {
     // Get the video source configuration from the 1st profile
     // Ignore the requested token
-    char profiles_num[2];
-    char stmp_w[16], stmp_h[16];
+    const char *vsc = media_source_fragment();
 
-    sprintf(profiles_num, "%d", service_ctx.profiles_num);
-    sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-    sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-    long size = cat(NULL,
-                    "media_service_files/GetCompatibleVideoSourceConfigurations.xml",
-                    8,
-                    "%PROFILES_NUM%",
-                    profiles_num,
-                    "%WIDTH%",
-                    stmp_w,
-                    "%HEIGHT%",
-                    stmp_h,
-                    "%PROFILE_TYPE",
-                    "High");
+    if (vsc == NULL) {
+        send_action_failed_fault("media_service", -1);
+        return -1;
+    }
+
+    long size = cat(NULL, "media_service_files/GetCompatibleVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
 
     output_http_headers(size);
 
-    return cat("stdout",
-               "media_service_files/GetCompatibleVideoSourceConfigurations.xml",
-               8,
-               "%PROFILES_NUM%",
-               profiles_num,
-               "%WIDTH%",
-               stmp_w,
-               "%HEIGHT%",
-               stmp_h,
-               "%PROFILE_TYPE",
-               "High");
+    return cat("stdout", "media_service_files/GetCompatibleVideoSourceConfigurations.xml", 2, "%VSC%", vsc);
 }
 
 int media_get_video_source_configuration_options()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
     char stmp_w[16], stmp_h[16];
 
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
-
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0)
-        || ((service_ctx.profiles_num > 1) && (strcasecmp(service_ctx.profiles[1].name, token) == 0))
-        || (strcasecmp("VideoSourceConfigToken", token) == 0)) {
+    if (media_shared_token_valid(profile_token, configuration_token, "VideoSourceConfigToken")) {
         sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
         sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
         long size = cat(NULL, "media_service_files/GetVideoSourceConfigurationOptions.xml", 4, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h);
@@ -223,449 +163,184 @@ int media_get_video_source_configuration_options()
     }
 }
 
-int media_get_profiles()
+/**
+ * Render the configurations of a profile (VSC, ASC, VEC, AEC, PTZ, AOC),
+ * shared by GetProfiles and GetProfile
+ * @param index The index of the profile in service_ctx.profiles
+ * @return a malloc'ed string, NULL on error
+ */
+static char *media_profile_fragment(int index)
 {
-    char profiles_num[2];
-    char stmp_vsc_w[16], stmp_vsc_h[16];
-    char stmp_w[16], stmp_h[16];
-    char stmp_fps[16], stmp_br[16];
-    char audio_enc_h[16], audio_enc_l[16];
+    stream_profile_t *profile = &service_ctx.profiles[index];
+    const media_profile_fragments_t *fragments = media_profile_fragments(index);
+    const char *vsc = media_source_fragment();
+    char profiles_num[8];
+    char audio_enc[16];
     char audio_output_level[8];
-    long size;
-    int c;
-    char dest_a[] = "stdout";
-    char *dest;
-    char min_x[256], max_x[256], min_y[256], max_y[256], min_z[256], max_z[256];
     const char *audio_output_config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token : "";
     const char *audio_output_name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
     const char *audio_output_token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
+    const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
+    const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
+    const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
+    char *fragment = NULL;
+    char *dest = NULL;
+    long size = 0;
+    int c;
 
-    audio_enc_h[0] = '\0';
-    audio_enc_l[0] = '\0';
+    snprintf(profiles_num, sizeof(profiles_num), "%d", service_ctx.profiles_num);
     snprintf(audio_output_level, sizeof(audio_output_level), "%d", service_ctx.audio.backchannel.output_level);
-    sprintf(profiles_num, "%d", service_ctx.profiles_num);
-    sprintf(min_x, "%.1f", service_ctx.ptz_node.min_step_x);
-    sprintf(max_x, "%.1f", service_ctx.ptz_node.max_step_x);
-    sprintf(min_y, "%.1f", service_ctx.ptz_node.min_step_y);
-    sprintf(max_y, "%.1f", service_ctx.ptz_node.max_step_y);
-    sprintf(min_z, "%.1f", service_ctx.ptz_node.min_step_z);
-    sprintf(max_z, "%.1f", service_ctx.ptz_node.max_step_z);
-
-    if (service_ctx.profiles_num == 1) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
-            } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
-
-            size = cat(dest, "media_service_files/GetProfiles_header.xml", 0);
-
-            // Get the video source configuration from the 1st profile
-            sprintf(stmp_vsc_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_vsc_h, "%d", service_ctx.profiles[0].height);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VSC.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%VSC_WIDTH%",
-                        stmp_vsc_w,
-                        "%VSC_HEIGHT%",
-                        stmp_vsc_h);
-
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                size += cat(dest, "media_service_files/GetProfile_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-            }
-
-            sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-            sprintf(stmp_fps, "%d", service_ctx.profiles[0].framerate);
-            sprintf(stmp_br, "%d", service_ctx.profiles[0].bitrate);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VEC.xml",
-                        12,
-                        "%PROFILE%",
-                        "Profile_0",
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "High",
-                        "%FRAMERATE%",
-                        stmp_fps,
-                        "%BITRATE%",
-                        stmp_br);
-
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 1);
-                size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", "Profile_0", "%AUDIO_ENCODING%", audio_enc_h);
-            }
-
-            if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 8,
-                        "%USE_COUNT%", "1",
-                        "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                        "%ZOOM_SPEED%", zoom_spd,
-                        "%ZOOM_LIMITS%", zoom_lim);
-            }
+    if ((fragments == NULL) || (vsc == NULL))
+        return NULL;
+    audio_enc[0] = '\0';
+    if (profile->audio_encoder != AUDIO_NONE)
+        set_audio_codec(audio_enc, 16, profile->audio_encoder, 1);
+
+    // We need 1st step to evaluate the size of the buffer
+    for (c = 0; c < 2; c++) {
+        if (c == 1) {
+            fragment = (char *) malloc(size + 1);
+            if (fragment == NULL)
+                return NULL;
+            fragment[0] = '\0';
+        }
 
-            if (media_audio_output_available()) {
-                size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
-                    "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
-                    "%AUDIO_OUTPUT_NAME%", audio_output_name,
-                    "%PROFILES_NUM%", profiles_num,
-                    "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
-                    "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
-            }
+        dest = fragment;
+        size = cat(dest, "media_service_files/GetProfile_VSC.xml", 2, "%VSC%", vsc);
 
-            size += cat(dest, "media_service_files/GetProfiles_footer.xml", 0);
+        if (profile->audio_encoder != AUDIO_NONE) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media_service_files/GetProfile_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
         }
 
-    } else if (service_ctx.profiles_num == 2) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
-            } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
-
-            size = cat(dest, "media_service_files/GetProfiles_header.xml", 0);
+        dest = (fragment == NULL) ? NULL : fragment + size;
+        size += cat(dest, "media_service_files/GetProfile_VEC.xml", 4, "%PROFILE%", profile->name, "%VEC%", fragments->vec);
 
-            // Get the video source configuration from the 1st profile
-            sprintf(stmp_vsc_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_vsc_h, "%d", service_ctx.profiles[0].height);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VSC.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%VSC_WIDTH%",
-                        stmp_vsc_w,
-                        "%VSC_HEIGHT%",
-                        stmp_vsc_h);
-
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                size += cat(dest, "media_service_files/GetProfile_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-            }
+        if (profile->audio_encoder != AUDIO_NONE) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", profile->name, "%AUDIO_ENCODING%", audio_enc);
+        }
 
-            sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-            sprintf(stmp_fps, "%d", service_ctx.profiles[0].framerate);
-            sprintf(stmp_br, "%d", service_ctx.profiles[0].bitrate);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VEC.xml",
-                        12,
-                        "%PROFILE%",
-                        "Profile_0",
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "High",
-                        "%FRAMERATE%",
-                        stmp_fps,
-                        "%BITRATE%",
-                        stmp_br);
+        if (service_ctx.ptz_node.enable == 1) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 8,
+                    "%USE_COUNT%", profiles_num,
+                    "%ZOOM_DEFAULT_SPACES%", zoom_def,
+                    "%ZOOM_SPEED%", zoom_spd,
+                    "%ZOOM_LIMITS%", zoom_lim);
+        }
 
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 1);
-                size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", "Profile_0", "%AUDIO_ENCODING%", audio_enc_h);
-            }
+        if (media_audio_output_available()) {
+            dest = (fragment == NULL) ? NULL : fragment + size;
+            size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
+                "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
+                "%AUDIO_OUTPUT_NAME%", audio_output_name,
+                "%PROFILES_NUM%", profiles_num,
+                "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
+                "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
+        }
+    }
 
-            if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 8,
-                        "%USE_COUNT%", "2",
-                        "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                        "%ZOOM_SPEED%", zoom_spd,
-                        "%ZOOM_LIMITS%", zoom_lim);
-            }
+    return fragment;
+}
 
-            if (media_audio_output_available()) {
-                size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
-                    "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
-                    "%AUDIO_OUTPUT_NAME%", audio_output_name,
-                    "%PROFILES_NUM%", profiles_num,
-                    "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
-                    "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
-            }
+int media_get_profiles()
+{
+    char *fragments[MAX_PROFILES];
+    long size;
+    int c, i;
+    char dest_a[] = "stdout";
+    char *dest;
 
-            size += cat(dest, "media_service_files/GetProfiles_middle.xml", 0);
+    if (service_ctx.profiles_num == 0) {
+        size = cat(NULL, "media_service_files/GetProfiles_none.xml", 0);
 
-            // Get the video source configuration from the 1st profile
-            sprintf(stmp_vsc_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_vsc_h, "%d", service_ctx.profiles[0].height);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VSC.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%VSC_WIDTH%",
-                        stmp_vsc_w,
-                        "%VSC_HEIGHT%",
-                        stmp_vsc_h);
-
-            if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-                size += cat(dest, "media_service_files/GetProfile_ASC.xml", 4, "%USE_COUNT%", "2", "%PROFILES_NUM%", profiles_num);
-            }
+        output_http_headers(size);
 
-            sprintf(stmp_w, "%d", service_ctx.profiles[1].width);
-            sprintf(stmp_h, "%d", service_ctx.profiles[1].height);
-            sprintf(stmp_fps, "%d", service_ctx.profiles[1].framerate);
-            sprintf(stmp_br, "%d", service_ctx.profiles[1].bitrate);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VEC.xml",
-                        12,
-                        "%PROFILE%",
-                        "Profile_1",
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "Main",
-                        "%FRAMERATE%",
-                        stmp_fps,
-                        "%BITRATE%",
-                        stmp_br);
+        return cat("stdout", "media_service_files/GetProfiles_none.xml", 0);
+    }
 
-            if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_l, 16, service_ctx.profiles[1].audio_encoder, 1);
-                size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", "Profile_1", "%AUDIO_ENCODING%", audio_enc_l);
-            }
+    // Render each profile once, for both steps
+    for (i = 0; i < service_ctx.profiles_num; i++) {
+        fragments[i] = media_profile_fragment(i);
+        if (fragments[i] == NULL) {
+            log_error("Unable to render profile %s", service_ctx.profiles[i].name);
+            while (i > 0)
+                free(fragments[--i]);
+            send_action_failed_fault("media_service", -1);
+            return -1;
+        }
+    }
 
-            if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 8,
-                        "%USE_COUNT%", "2",
-                        "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                        "%ZOOM_SPEED%", zoom_spd,
-                        "%ZOOM_LIMITS%", zoom_lim);
-            }
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
+            output_http_headers(size);
+        }
 
-            if (media_audio_output_available()) {
-                size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
-                    "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
-                    "%AUDIO_OUTPUT_NAME%", audio_output_name,
-                    "%PROFILES_NUM%", profiles_num,
-                    "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
-                    "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
+        for (i = 0; i < service_ctx.profiles_num; i++) {
+            if (i == 0) {
+                size = cat(dest, "media_service_files/GetProfiles_header.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
+            } else {
+                size += cat(dest, "media_service_files/GetProfiles_middle.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
             }
-
-            size += cat(dest, "media_service_files/GetProfiles_footer.xml", 0);
+            size += cat_string(dest, fragments[i]);
         }
-    } else {
-        long size = cat(NULL, "media_service_files/GetProfiles_none.xml", 0);
+        size += cat(dest, "media_service_files/GetProfiles_footer.xml", 0);
+    }
 
-        output_http_headers(size);
+    for (i = 0; i < service_ctx.profiles_num; i++)
+        free(fragments[i]);
 
-        return cat("stdout", "media_service_files/GetProfiles_none.xml", 0);
-    }
+    return size;
 }
 
 int media_get_profile()
 {
-    char profiles_num[2];
-    char stmp_vsc_w[16], stmp_vsc_h[16];
-    char stmp_w[16], stmp_h[16];
-    char stmp_fps[16], stmp_br[16];
     const char *profile_token = get_element("ProfileToken", "Body");
-    char audio_enc_h[16], audio_enc_l[16];
+    char *fragment;
     long size;
-    int c;
+    int c, i;
     char dest_a[] = "stdout";
     char *dest;
-    char min_x[256], max_x[256], min_y[256], max_y[256], min_z[256], max_z[256];
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile token does not exist");
         return -1;
     }
 
-    sprintf(profiles_num, "%d", service_ctx.profiles_num);
-    sprintf(min_x, "%.1f", service_ctx.ptz_node.min_step_x);
-    sprintf(max_x, "%.1f", service_ctx.ptz_node.max_step_x);
-    sprintf(min_y, "%.1f", service_ctx.ptz_node.min_step_y);
-    sprintf(max_y, "%.1f", service_ctx.ptz_node.max_step_y);
-    sprintf(min_z, "%.1f", service_ctx.ptz_node.min_step_z);
-    sprintf(max_z, "%.1f", service_ctx.ptz_node.max_step_z);
-
-    const char *audio_output_config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token : "";
-    const char *audio_output_name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
-    const char *audio_output_token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
-    char audio_output_level[8];
-    snprintf(audio_output_level, sizeof(audio_output_level), "%d", service_ctx.audio.backchannel.output_level);
-
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0)) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
-            } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
-
-            size = cat(dest, "media_service_files/GetProfile_header.xml", 2, "%PROFILE%", profile_token);
-
-            // Get the video source configuration from the 1st profile
-            sprintf(stmp_vsc_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_vsc_h, "%d", service_ctx.profiles[0].height);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VSC.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%VSC_WIDTH%",
-                        stmp_vsc_w,
-                        "%VSC_HEIGHT%",
-                        stmp_vsc_h);
-
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                size += cat(dest, "media_service_files/GetProfile_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-            }
-
-            sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-            sprintf(stmp_fps, "%d", service_ctx.profiles[0].framerate);
-            sprintf(stmp_br, "%d", service_ctx.profiles[0].bitrate);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VEC.xml",
-                        12,
-                        "%PROFILE%",
-                        profile_token,
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "High",
-                        "%FRAMERATE%",
-                        stmp_fps,
-                        "%BITRATE%",
-                        stmp_br);
-
-            if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[0].audio_encoder, 1);
-                size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", "Profile_0", "%AUDIO_ENCODING%", audio_enc_h);
-            }
-
-            if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 6,
-                        "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                        "%ZOOM_SPEED%", zoom_spd,
-                        "%ZOOM_LIMITS%", zoom_lim);
-            }
-
-            if (media_audio_output_available()) {
-                size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
-                    "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
-                    "%AUDIO_OUTPUT_NAME%", audio_output_name,
-                    "%PROFILES_NUM%", profiles_num,
-                    "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
-                    "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
-            }
-
-            size += cat(dest, "media_service_files/GetProfile_footer.xml", 0);
-        }
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        // We need 1st step to evaluate content length
-        for (c = 0; c < 2; c++) {
-            if (c == 0) {
-                dest = NULL;
-            } else {
-                dest = dest_a;
-                output_http_headers(size);
-            }
-
-            size = cat(dest, "media_service_files/GetProfile_header.xml", 2, "%PROFILE%", profile_token);
-
-            // Get the video source configuration from the 1st profile
-            sprintf(stmp_vsc_w, "%d", service_ctx.profiles[0].width);
-            sprintf(stmp_vsc_h, "%d", service_ctx.profiles[0].height);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VSC.xml",
-                        6,
-                        "%PROFILES_NUM%",
-                        profiles_num,
-                        "%VSC_WIDTH%",
-                        stmp_vsc_w,
-                        "%VSC_HEIGHT%",
-                        stmp_vsc_h);
-
-            if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-                size += cat(dest, "media_service_files/GetProfile_ASC.xml", 2, "%PROFILES_NUM%", profiles_num);
-            }
-
-            sprintf(stmp_w, "%d", service_ctx.profiles[1].width);
-            sprintf(stmp_h, "%d", service_ctx.profiles[1].height);
-            sprintf(stmp_fps, "%d", service_ctx.profiles[1].framerate);
-            sprintf(stmp_br, "%d", service_ctx.profiles[1].bitrate);
-            size += cat(dest,
-                        "media_service_files/GetProfile_VEC.xml",
-                        12,
-                        "%PROFILE%",
-                        profile_token,
-                        "%WIDTH%",
-                        stmp_w,
-                        "%HEIGHT%",
-                        stmp_h,
-                        "%H264PROFILE%",
-                        "Main",
-                        "%FRAMERATE%",
-                        stmp_fps,
-                        "%BITRATE%",
-                        stmp_br);
-
-            if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-                set_audio_codec(audio_enc_h, 16, service_ctx.profiles[1].audio_encoder, 1);
-                size += cat(dest, "media_service_files/GetProfile_AEC.xml", 4, "%PROFILE%", "Profile_1", "%AUDIO_ENCODING%", audio_enc_h);
-            }
-
-            if (service_ctx.ptz_node.enable == 1) {
-                        const char *zoom_def = ptz_supports_zoom() ? ZOOM_DEFAULT_SPACES_XML : "";
-                        const char *zoom_spd = ptz_supports_zoom() ? ZOOM_SPEED_XML : "";
-                        const char *zoom_lim = ptz_supports_zoom() ? ZOOM_LIMITS_XML : "";
-                size += cat(dest, "media_service_files/GetProfile_PTZ.xml", 6,
-                        "%ZOOM_DEFAULT_SPACES%", zoom_def,
-                        "%ZOOM_SPEED%", zoom_spd,
-                        "%ZOOM_LIMITS%", zoom_lim);
-            }
+    i = media_profile_find(profile_token);
+    if (i < 0) {
+        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile token does not exist");
+        return -2;
+    }
 
-            if (media_audio_output_available()) {
-                size += cat(dest, "media_service_files/GetProfile_AOC.xml", 10,
-                    "%AUDIO_OUTPUT_CONFIG_TOKEN%", audio_output_config_token,
-                    "%AUDIO_OUTPUT_NAME%", audio_output_name,
-                    "%PROFILES_NUM%", profiles_num,
-                    "%AUDIO_OUTPUT_TOKEN%", audio_output_token,
-                    "%AUDIO_OUTPUT_LEVEL%", audio_output_level);
-            }
+    fragment = media_profile_fragment(i);
+    if (fragment == NULL) {
+        log_error("Unable to render profile %s", service_ctx.profiles[i].name);
+        send_action_failed_fault("media_service", -3);
+        return -3;
+    }
 
-            size += cat(dest, "media_service_files/GetProfile_footer.xml", 0);
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
+            output_http_headers(size);
         }
 
-    } else {
-        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile token does not exist");
-        return -2;
+        size = cat(dest, "media_service_files/GetProfile_header.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
+        size += cat_string(dest, fragment);
+        size += cat(dest, "media_service_files/GetProfile_footer.xml", 0);
     }
+    free(fragment);
+
+    return size;
 }
 
 int media_create_profile()
@@ -685,255 +360,116 @@ int media_create_profile()
 
 int media_get_video_encoder_configurations()
 {
-    char stmp_w_l[16], stmp_h_l[16];
-    char stmp_w_h[16], stmp_h_h[16];
-    char stmp_fps_l[16], stmp_br_l[16];
-    char stmp_fps_h[16], stmp_br_h[16];
-
-    if (service_ctx.profiles_num == 1) {
-        sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-        sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-        sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-        long size = cat(NULL, "media_service_files/GetVideoEncoderConfigurations_high.xml", 8, "%WIDTH_HIGH%", stmp_w_h, "%HEIGHT_HIGH%", stmp_h_h, "%FRAMERATE_HIGH%", stmp_fps_h, "%BITRATE_HIGH%", stmp_br_h);
-
-        output_http_headers(size);
+    const media_profile_fragments_t *fragments;
+    long size;
+    int c, i;
+    char dest_a[] = "stdout";
+    char *dest;
 
-        return cat("stdout", "media_service_files/GetVideoEncoderConfigurations_high.xml", 8, "%WIDTH_HIGH%", stmp_w_h, "%HEIGHT_HIGH%", stmp_h_h, "%FRAMERATE_HIGH%", stmp_fps_h, "%BITRATE_HIGH%", stmp_br_h);
-
-    } else if (service_ctx.profiles_num == 2) {
-        sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-        sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-        sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-        sprintf(stmp_w_l, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h_l, "%d", service_ctx.profiles[1].height);
-        sprintf(stmp_fps_l, "%d", service_ctx.profiles[1].framerate);
-        sprintf(stmp_br_l, "%d", service_ctx.profiles[1].bitrate);
-        long size = cat(NULL,
-                        "media_service_files/GetVideoEncoderConfigurations_both.xml",
-                        16,
-                        "%WIDTH_HIGH%",
-                        stmp_w_h,
-                        "%HEIGHT_HIGH%",
-                        stmp_h_h,
-                        "%WIDTH_LOW%",
-                        stmp_w_l,
-                        "%HEIGHT_LOW%",
-                        stmp_h_l,
-                        "%FRAMERATE_HIGH%",
-                        stmp_fps_h,
-                        "%BITRATE_HIGH%",
-                        stmp_br_h,
-                        "%FRAMERATE_LOW%",
-                        stmp_fps_l,
-                        "%BITRATE_LOW%",
-                        stmp_br_l);
+    if (service_ctx.profiles_num == 0) {
+        send_fault("media_service",
+                   "Sender",
+                   "ter:InvalidArgVal",
+                   "ter:NoConfig",
+                   "No config",
+                   "No supported video encoder configuration profiles are available");
+        return -1;
+    }
+    if (media_profile_fragments(0) == NULL) {
+        send_action_failed_fault("media_service", -2);
+        return -2;
+    }
 
-        output_http_headers(size);
+    // We need 1st step to evaluate content length
+    for (c = 0; c < 2; c++) {
+        if (c == 0) {
+            dest = NULL;
+        } else {
+            dest = dest_a;
+            output_http_headers(size);
+        }
 
-        return cat("stdout",
-                   "media_service_files/GetVideoEncoderConfigurations_both.xml",
-                   16,
-                   "%WIDTH_HIGH%",
-                   stmp_w_h,
-                   "%HEIGHT_HIGH%",
-                   stmp_h_h,
-                   "%WIDTH_LOW%",
-                   stmp_w_l,
-                   "%HEIGHT_LOW%",
-                   stmp_h_l,
-                   "%FRAMERATE_HIGH%",
-                   stmp_fps_h,
-                   "%BITRATE_HIGH%",
-                   stmp_br_h,
-                   "%FRAMERATE_LOW%",
-                   stmp_fps_l,
-                   "%BITRATE_LOW%",
-                   stmp_br_l);
+        size = cat(dest, "media_service_files/GetVideoEncoderConfigurations_header.xml", 0);
+        for (i = 0; i < service_ctx.profiles_num; i++) {
+            fragments = media_profile_fragments(i);
+            size += cat(dest, "media_service_files/GetVideoEncoderConfigurations_item.xml", 4, "%PROFILE%", service_ctx.profiles[i].name, "%VEC%", fragments->vec);
+        }
+        size += cat(dest, "media_service_files/GetVideoEncoderConfigurations_footer.xml", 0);
     }
 
-    send_fault("media_service",
-               "Sender",
-               "ter:InvalidArgVal",
-               "ter:NoConfig",
-               "No config",
-               "No supported video encoder configuration profiles are available");
-    return -1;
+    return size;
 }
 
 int media_get_video_encoder_configuration()
 {
-    char stmp_w_l[16], stmp_h_l[16];
-    char stmp_w_h[16], stmp_h_h[16];
-    char stmp_fps_l[16], stmp_br_l[16];
-    char stmp_fps_h[16], stmp_br_h[16];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (configuration_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
         return -1;
     }
 
-    memset(token, '\0', sizeof(token));
-    strncpy(token, configuration_token, 9);
-
-    if (strcasecmp(service_ctx.profiles[0].name, token) == 0) {
-        sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-        sprintf(stmp_fps_h, "%d", service_ctx.profiles[0].framerate);
-        sprintf(stmp_br_h, "%d", service_ctx.profiles[0].bitrate);
-        long size = cat(NULL,
-                        "media_service_files/GetVideoEncoderConfiguration.xml",
-                        12,
-                        "%PROFILE%",
-                        token,
-                        "%WIDTH%",
-                        stmp_w_h,
-                        "%HEIGHT%",
-                        stmp_h_h,
-                        "%PROFILE_TYPE%",
-                        "High",
-                        "%FRAMERATE%",
-                        stmp_fps_h,
-                        "%BITRATE%",
-                        stmp_br_h);
-
-        output_http_headers(size);
+    i = media_profile_find_config(configuration_token);
+    if (i < 0) {
+        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
+        return -2;
+    }
 
-        return cat("stdout",
-                   "media_service_files/GetVideoEncoderConfiguration.xml",
-                   12,
-                   "%PROFILE%",
-                   token,
-                   "%WIDTH%",
-                   stmp_w_h,
-                   "%HEIGHT%",
-                   stmp_h_h,
-                   "%PROFILE_TYPE%",
-                   "High",
-                   "%FRAMERATE%",
-                   stmp_fps_h,
-                   "%BITRATE%",
-                   stmp_br_h);
+    fragments = media_profile_fragments(i);
+    if (fragments == NULL) {
+        send_action_failed_fault("media_service", -3);
+        return -3;
+    }
 
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        sprintf(stmp_w_l, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h_l, "%d", service_ctx.profiles[1].height);
-        sprintf(stmp_fps_l, "%d", service_ctx.profiles[1].framerate);
-        sprintf(stmp_br_l, "%d", service_ctx.profiles[1].bitrate);
-        long size = cat(NULL,
-                        "media_service_files/GetVideoEncoderConfiguration.xml",
-                        12,
-                        "%PROFILE%",
-                        token,
-                        "%WIDTH%",
-                        stmp_w_l,
-                        "%HEIGHT%",
-                        stmp_h_l,
-                        "%PROFILE_TYPE%",
-                        "Main",
-                        "%FRAMERATE%",
-                        stmp_fps_l,
-                        "%BITRATE%",
-                        stmp_br_l);
+    long size = cat(NULL, "media_service_files/GetVideoEncoderConfiguration.xml", 4, "%PROFILE%", service_ctx.profiles[i].name, "%VEC%", fragments->vec);
 
-        output_http_headers(size);
+    output_http_headers(size);
 
-        return cat("stdout",
-                   "media_service_files/GetVideoEncoderConfiguration.xml",
-                   12,
-                   "%PROFILE%",
-                   token,
-                   "%WIDTH%",
-                   stmp_w_l,
-                   "%HEIGHT%",
-                   stmp_h_l,
-                   "%PROFILE_TYPE%",
-                   "Main",
-                   "%FRAMERATE%",
-                   stmp_fps_l,
-                   "%BITRATE%",
-                   stmp_br_l);
-    } else {
-        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
-        return -2;
-    }
+    return cat("stdout", "media_service_files/GetVideoEncoderConfiguration.xml", 4, "%PROFILE%", service_ctx.profiles[i].name, "%VEC%", fragments->vec);
 }
 
 int media_get_compatible_video_encoder_configurations()
 {
-    char stmp_w_l[16], stmp_h_l[16];
-    char stmp_w_h[16], stmp_h_h[16];
     const char *profile_token = get_element("ProfileToken", "Body");
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        sprintf(stmp_w_h, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h_h, "%d", service_ctx.profiles[0].height);
-        long size = cat(NULL,
-                        "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
-                        8,
-                        "%PROFILE%",
-                        profile_token,
-                        "%WIDTH%",
-                        stmp_w_h,
-                        "%HEIGHT%",
-                        stmp_h_h,
-                        "%PROFILE_TYPE%",
-                        "High");
-
-        output_http_headers(size);
+    i = media_profile_find(profile_token);
+    if (i < 0) {
+        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
+        return -2;
+    }
 
-        return cat("stdout",
-                   "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
-                   8,
-                   "%PROFILE%",
-                   profile_token,
-                   "%WIDTH%",
-                   stmp_w_h,
-                   "%HEIGHT%",
-                   stmp_h_h,
-                   "%PROFILE_TYPE%",
-                   "High");
+    fragments = media_profile_fragments(i);
+    if (fragments == NULL) {
+        send_action_failed_fault("media_service", -3);
+        return -3;
+    }
 
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        sprintf(stmp_w_l, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h_l, "%d", service_ctx.profiles[1].height);
-        long size = cat(NULL,
-                        "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
-                        8,
-                        "%PROFILE%",
-                        profile_token,
-                        "%WIDTH%",
-                        stmp_w_l,
-                        "%HEIGHT%",
-                        stmp_h_l,
-                        "%PROFILE_TYPE%",
-                        "Main");
+    long size = cat(NULL,
+                    "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
+                    4,
+                    "%PROFILE%",
+                    service_ctx.profiles[i].name,
+                    "%VEC%",
+                    fragments->vec);
 
-        output_http_headers(size);
+    output_http_headers(size);
 
-        return cat("stdout",
-                   "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
-                   8,
-                   "%PROFILE%",
-                   profile_token,
-                   "%WIDTH%",
-                   stmp_w_l,
-                   "%HEIGHT%",
-                   stmp_h_l,
-                   "%PROFILE_TYPE%",
-                   "Main");
-    } else {
-        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -2;
-    }
+    return cat("stdout",
+               "media_service_files/GetCompatibleVideoEncoderConfigurations.xml",
+               4,
+               "%PROFILE%",
+               service_ctx.profiles[i].name,
+               "%VEC%",
+               fragments->vec);
 }
 
 int media_get_video_encoder_configuration_options()
@@ -941,42 +477,29 @@ int media_get_video_encoder_configuration_options()
     char stmp_w[16], stmp_h[16];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
+    int i;
 
-    memset(token, '\0', sizeof(token));
     if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
+        // Profile_x from token Profile_x_VideoEncoderToken
+        i = media_profile_find_config(configuration_token);
     } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
+        i = media_profile_find(profile_token);
     } else {
-        strncpy(token, service_ctx.profiles[0].name, 9);
+        i = (service_ctx.profiles_num > 0) ? 0 : -1;
     }
 
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        sprintf(stmp_w, "%d", service_ctx.profiles[0].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[0].height);
-        long size
-            = cat(NULL, "media_service_files/GetVideoEncoderConfigurationOptions.xml", 6, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h, "%PROFILE%", "High");
-
-        output_http_headers(size);
-
-        return cat("stdout",
-                   "media_service_files/GetVideoEncoderConfigurationOptions.xml",
-                   6,
-                   "%WIDTH%",
-                   stmp_w,
-                   "%HEIGHT%",
-                   stmp_h,
-                   "%PROFILE%",
-                   "High");
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        sprintf(stmp_w, "%d", service_ctx.profiles[1].width);
-        sprintf(stmp_h, "%d", service_ctx.profiles[1].height);
-        long size
-            = cat(NULL, "media_service_files/GetVideoEncoderConfigurationOptions.xml", 6, "%WIDTH%", stmp_w, "%HEIGHT%", stmp_h, "%PROFILE%", "Main");
+    if (i >= 0) {
+        sprintf(stmp_w, "%d", service_ctx.profiles[i].width);
+        sprintf(stmp_h, "%d", service_ctx.profiles[i].height);
+        long size = cat(NULL,
+                        "media_service_files/GetVideoEncoderConfigurationOptions.xml",
+                        6,
+                        "%WIDTH%",
+                        stmp_w,
+                        "%HEIGHT%",
+                        stmp_h,
+                        "%PROFILE%",
+                        media_profile_h264(i));
 
         output_http_headers(size);
 
@@ -988,7 +511,7 @@ int media_get_video_encoder_configuration_options()
                    "%HEIGHT%",
                    stmp_h,
                    "%PROFILE%",
-                   "Main");
+                   media_profile_h264(i));
 
     } else {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
@@ -1001,14 +524,14 @@ int media_get_guaranteed_number_of_video_encoder_instances()
     char stmp[8];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
 
-    if ((service_ctx.profiles_num >= 0) && (service_ctx.profiles_num <= 2)) {
+    if ((service_ctx.profiles_num >= 0) && (service_ctx.profiles_num <= MAX_PROFILES)) {
         sprintf(stmp, "%d", service_ctx.profiles_num);
     } else {
         send_action_failed_fault("media_service", -1);
         return -1;
     }
 
-    if (strncasecmp("VideoSourceConfigToken", configuration_token, 22) == 0) {
+    if ((configuration_token != NULL) && (strncasecmp("VideoSourceConfigToken", configuration_token, 22) == 0)) {
         long size = cat(NULL, "media_service_files/GetGuaranteedNumberOfVideoEncoderInstances.xml", 4, "%TOTAL_NUMBER%", stmp, "%NUMBER_H264%", stmp);
 
         output_http_headers(size);
@@ -1023,23 +546,18 @@ int media_get_guaranteed_number_of_video_encoder_instances()
 
 int media_get_snapshot_uri()
 {
-    char address[16];
-    char netmask[16];
-    char *s;
-    char line[MAX_LEN];
     const char *profile_token = get_element("ProfileToken", "Body");
-
-    memset(line, '\0', sizeof(line));
-
-    get_ip_address(address, netmask, service_ctx.ifs);
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        if (service_ctx.profiles[0].snapurl == NULL) {
+    i = media_profile_find(profile_token);
+    if (i >= 0) {
+        if (service_ctx.profiles[i].snapurl == NULL) {
             send_fault(
                 "media_service",
                 "Receiver",
@@ -1050,67 +568,38 @@ int media_get_snapshot_uri()
             return -2;
         }
 
-        // Construct snapshot URL with token authentication
-        construct_uri_with_token(line, MAX_LEN, service_ctx.profiles[0].snapurl, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
-
-        output_http_headers(size);
-
-        return cat("stdout", "media_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].snapurl == NULL) {
-            send_fault(
-                "media_service",
-                "Receiver",
-                "ter:Action",
-                "ter:IncompleteConfiguration",
-                "Incomplete configuration",
-                "The specified media profile does not contain either a reference to a video encoder configuration or a reference to a video source configuration");
-            return -3;
+        fragments = media_profile_fragments(i);
+        if (fragments == NULL) {
+            send_action_failed_fault("media_service", -4);
+            return -4;
         }
 
-        // Construct snapshot URL with token authentication
-        construct_uri_with_token(line, MAX_LEN, service_ctx.profiles[1].snapurl, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
+        long size = cat(NULL, "media_service_files/GetSnapshotUri.xml", 2, "%URI%", fragments->snapshot_uri);
 
         output_http_headers(size);
 
-        return cat("stdout", "media_service_files/GetSnapshotUri.xml", 2, "%URI%", line);
+        return cat("stdout", "media_service_files/GetSnapshotUri.xml", 2, "%URI%", fragments->snapshot_uri);
 
     } else {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -4;
+        return -3;
     }
 }
 
 int media_get_stream_uri()
 {
-    char address[16];
-    char netmask[16];
-    char *s;
-    char line[MAX_LEN];
     const char *profile_token = get_element("ProfileToken", "Body");
-
-    memset(line, '\0', sizeof(line));
-
-    get_ip_address(address, netmask, service_ctx.ifs);
+    const media_profile_fragments_t *fragments;
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        if (service_ctx.profiles[0].url == NULL) {
+    i = media_profile_find(profile_token);
+    if (i >= 0) {
+        if (service_ctx.profiles[i].url == NULL) {
             send_fault("media_service",
                        "Receiver",
                        "ter:Action",
@@ -1120,51 +609,27 @@ int media_get_stream_uri()
             return -2;
         }
 
-        // Construct RTSP URL
-        construct_uri(line, MAX_LEN, service_ctx.profiles[0].url, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media_service_files/GetStreamUri.xml", 2, "%URI%", line);
-
-        output_http_headers(size);
-
-        return cat("stdout", "media_service_files/GetStreamUri.xml", 2, "%URI%", line);
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].url == NULL) {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:Action",
-                       "ter:IncompleteConfiguration",
-                       "Incomplete configuration",
-                       "The specified media profile does contain either unused sources or encoder configurations without a corresponding source");
-            return -3;
+        fragments = media_profile_fragments(i);
+        if (fragments == NULL) {
+            send_action_failed_fault("media_service", -4);
+            return -4;
         }
 
-        // Construct RTSP URL
-        construct_uri(line, MAX_LEN, service_ctx.profiles[1].url, address);
-
-        // Escape html chars
-        html_escape(line, MAX_LEN);
-
-        long size = cat(NULL, "media_service_files/GetStreamUri.xml", 2, "%URI%", line);
+        long size = cat(NULL, "media_service_files/GetStreamUri.xml", 2, "%URI%", fragments->stream_uri);
 
         output_http_headers(size);
 
-        return cat("stdout", "media_service_files/GetStreamUri.xml", 2, "%URI%", line);
+        return cat("stdout", "media_service_files/GetStreamUri.xml", 2, "%URI%", fragments->stream_uri);
 
     } else {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
-        return -4;
+        return -3;
     }
 }
 
 int media_get_audio_sources()
 {
-    if ((service_ctx.profiles_num > 0 && service_ctx.profiles[0].audio_encoder != AUDIO_NONE)
-        || (service_ctx.profiles_num > 1 && service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
+    if (media_audio_encoder_count() > 0) {
         long size = cat(NULL, "media_service_files/GetAudioSources.xml", 0);
 
         output_http_headers(size);
@@ -1183,27 +648,11 @@ int media_get_audio_sources()
 
 int media_get_audio_source_configurations()
 {
-    char s_profiles_num[2];
-    int profiles_num;
-
-    profiles_num = service_ctx.profiles_num;
-
-    if (profiles_num == 1) {
-        if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-            profiles_num--;
-        }
-    } else if (profiles_num == 2) {
-        if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-            profiles_num--;
-        }
-        if (service_ctx.profiles[1].audio_encoder == AUDIO_NONE) {
-            profiles_num--;
-        }
-    }
+    char s_profiles_num[8];
 
     sprintf(s_profiles_num, "%d", service_ctx.profiles_num);
 
-    if (profiles_num > 0) {
+    if (media_audio_encoder_count() > 0) {
         long size = cat(NULL, "media_service_files/GetAudioSourceConfigurations.xml", 2, "%PROFILES_NUM%", s_profiles_num);
 
         output_http_headers(size);
@@ -1223,8 +672,7 @@ int media_get_audio_source_configurations()
 int media_get_audio_source_configuration()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char s_profiles_num[2];
-    int profiles_num;
+    char s_profiles_num[8];
 
     if (configuration_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
@@ -1232,24 +680,9 @@ int media_get_audio_source_configuration()
     }
 
     if (strncasecmp("AudioSourceConfigToken", configuration_token, 22) == 0) {
-        profiles_num = service_ctx.profiles_num;
-
-        if (profiles_num == 1) {
-            if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-        } else if (profiles_num == 2) {
-            if (service_ctx.profiles[0].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-            if (service_ctx.profiles[1].audio_encoder == AUDIO_NONE) {
-                profiles_num--;
-            }
-        }
-
         sprintf(s_profiles_num, "%d", service_ctx.profiles_num);
 
-        if (profiles_num > 0) {
+        if (media_audio_encoder_count() > 0) {
             long size = cat(NULL, "media_service_files/GetAudioSourceConfiguration.xml", 2, "%PROFILES_NUM%", s_profiles_num);
 
             output_http_headers(size);
@@ -1274,21 +707,8 @@ int media_get_audio_source_configuration_options()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[23];
-
-    memset(token, '\0', sizeof(token));
-    if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else if (configuration_token != NULL) {
-        strncpy(token, configuration_token, 22);
-    } else {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
 
-    if ((service_ctx.profiles_num <= 0)
-        || ((service_ctx.profiles[0].audio_encoder == AUDIO_NONE)
-            && ((service_ctx.profiles_num < 2) || (service_ctx.profiles[1].audio_encoder == AUDIO_NONE)))) {
+    if (media_audio_encoder_count() == 0) {
         send_fault("media_service",
                    "Receiver",
                    "ter:ActionNotSupported",
@@ -1298,16 +718,7 @@ int media_get_audio_source_configuration_options()
         return -1;
     }
 
-    if ((profile_token == NULL) && (configuration_token == NULL)) {
-        long size = cat(NULL, "media_service_files/GetAudioSourceConfigurationOptions.xml", 0);
-
-        output_http_headers(size);
-
-        return cat("stdout", "media_service_files/GetAudioSourceConfigurationOptions.xml", 0);
-    }
-    if ((strcasecmp(service_ctx.profiles[0].name, token) == 0)
-        || ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0))
-        || (strcasecmp("AudioSourceConfigToken", token) == 0)) {
+    if (media_shared_token_valid(profile_token, configuration_token, "AudioSourceConfigToken")) {
         long size = cat(NULL, "media_service_files/GetAudioSourceConfigurationOptions.xml", 0);
 
         output_http_headers(size);
@@ -1320,66 +731,56 @@ int media_get_audio_source_configuration_options()
     }
 }
 
-int media_get_audio_encoder_configuration()
-{
-    char audio_encoder[16];
-    const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
-
-    if (configuration_token == NULL) {
-        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
-        return -1;
-    }
-
-    memset(token, '\0', sizeof(token));
-    strncpy(token, configuration_token, 9);
-
-    if (strcasecmp(service_ctx.profiles[0].name, token) == 0) {
-        if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[0].audio_encoder, 1);
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -2;
-        }
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[1].audio_encoder, 1);
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -3;
-        }
-
-    } else {
+int media_get_audio_encoder_configuration()
+{
+    char audio_encoder[16];
+    const char *configuration_token = get_element("ConfigurationToken", "Body");
+    int i;
+
+    if (configuration_token == NULL) {
+        send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
+        return -1;
+    }
+
+    // Profile_x from token Profile_x_AudioEncoderToken
+    i = media_profile_find_config(configuration_token);
+    if (i < 0) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
         return -4;
     }
+    if (service_ctx.profiles[i].audio_encoder == AUDIO_NONE) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioNotSupported",
+                   "AudioNotSupported",
+                   "The device does not support audio");
+        return -2;
+    }
+    set_audio_codec(audio_encoder, 16, service_ctx.profiles[i].audio_encoder, 1);
 
-    long size = cat(NULL, "media_service_files/GetAudioEncoderConfiguration.xml", 4, "%PROFILE%", token, "%AUDIO_ENCODING%", audio_encoder);
+    long size = cat(NULL,
+                    "media_service_files/GetAudioEncoderConfiguration.xml",
+                    4,
+                    "%PROFILE%",
+                    service_ctx.profiles[i].name,
+                    "%AUDIO_ENCODING%",
+                    audio_encoder);
 
     output_http_headers(size);
 
-    return cat("stdout", "media_service_files/GetAudioEncoderConfiguration.xml", 4, "%PROFILE%", token, "%AUDIO_ENCODING%", audio_encoder);
+    return cat("stdout",
+               "media_service_files/GetAudioEncoderConfiguration.xml",
+               4,
+               "%PROFILE%",
+               service_ctx.profiles[i].name,
+               "%AUDIO_ENCODING%",
+               audio_encoder);
 }
 
 int media_get_audio_encoder_configurations()
 {
-    char audio_encoder_high[16];
-    char audio_encoder_low[16];
-
-    if ((service_ctx.profiles_num <= 0)
-        || ((service_ctx.profiles[0].audio_encoder == AUDIO_NONE)
-            && ((service_ctx.profiles_num < 2) || (service_ctx.profiles[1].audio_encoder == AUDIO_NONE)))) {
+    if (media_audio_encoder_count() == 0) {
         send_fault("media_service",
                    "Receiver",
                    "ter:ActionNotSupported",
@@ -1389,120 +790,7 @@ int media_get_audio_encoder_configurations()
         return -1;
     }
 
-    if (service_ctx.profiles_num == 1) {
-        if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder_high, 16, service_ctx.profiles[0].audio_encoder, 1);
-            long size = cat(NULL,
-                            "media_service_files/GetAudioEncoderConfigurations.xml",
-                            4,
-                            "%PROFILE%",
-                            "Profile_0",
-                            "%AUDIO_ENCODING%",
-                            audio_encoder_high);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       "Profile_0",
-                       "%AUDIO_ENCODING%",
-                       audio_encoder_high);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -2;
-        }
-
-    } else if (service_ctx.profiles_num == 2) {
-        if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
-            set_audio_codec(audio_encoder_high, 16, service_ctx.profiles[0].audio_encoder, 1);
-            set_audio_codec(audio_encoder_low, 16, service_ctx.profiles[1].audio_encoder, 1);
-
-            long size = cat(NULL,
-                            "media_service_files/GetAudioEncoderConfigurations_both.xml",
-                            4,
-                            "%AUDIO_ENCODING_HIGH%",
-                            audio_encoder_high,
-                            "%AUDIO_ENCODING_LOW%",
-                            audio_encoder_low);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetAudioEncoderConfigurations_both.xml",
-                       4,
-                       "%AUDIO_ENCODING_HIGH%",
-                       audio_encoder_high,
-                       "%AUDIO_ENCODING_LOW%",
-                       audio_encoder_low);
-
-        } else if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder_high, 16, service_ctx.profiles[0].audio_encoder, 1);
-
-            long size = cat(NULL,
-                            "media_service_files/GetAudioEncoderConfigurations.xml",
-                            4,
-                            "%PROFILE%",
-                            "Profile_0",
-                            "%AUDIO_ENCODING%",
-                            audio_encoder_high);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       "Profile_0",
-                       "%AUDIO_ENCODING%",
-                       audio_encoder_high);
-
-        } else if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder_low, 16, service_ctx.profiles[1].audio_encoder, 1);
-
-            long size = cat(NULL,
-                            "media_service_files/GetAudioEncoderConfigurations.xml",
-                            4,
-                            "%PROFILE%",
-                            "Profile_1",
-                            "%AUDIO_ENCODING%",
-                            audio_encoder_low);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       "Profile_1",
-                       "%AUDIO_ENCODING%",
-                       audio_encoder_low);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -3;
-        }
-    }
-
-    send_fault("media_service",
-               "Sender",
-               "ter:InvalidArgVal",
-               "ter:NoConfig",
-               "No config",
-               "No supported audio encoder configuration profiles are available");
-    return -4;
+    return media_audio_configurations_send("media_service_files/GetAudioEncoderConfigurations", 0, service_ctx.profiles_num - 1, 0, 1);
 }
 
 int media_get_audio_encoder_configuration_options()
@@ -1510,23 +798,13 @@ int media_get_audio_encoder_configuration_options()
     char audio_encoder[16];
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
+    int i, encoder;
 
     char bitrate[4], samplerate[4];
 
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_AudioEncoderToken
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else {
-        if ((service_ctx.profiles_num > 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[0].name, 9);
-        } else if ((service_ctx.profiles_num == 2) && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE)) {
-            strncpy(token, service_ctx.profiles[1].name, 9);
-        } else {
+    i = media_audio_profile_find(configuration_token, profile_token, 0);
+    if (i < 0) {
+        if ((configuration_token == NULL) && (profile_token == NULL)) {
             send_fault("media_service",
                        "Receiver",
                        "ter:ActionNotSupported",
@@ -1535,55 +813,30 @@ int media_get_audio_encoder_configuration_options()
                        "The device does not support audio");
             return -1;
         }
-    }
-
-    if ((service_ctx.profiles_num > 0) && (strcasecmp(service_ctx.profiles[0].name, token) == 0)) {
-        // G726 is not suppoerted
-        if ((service_ctx.profiles[0].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[0].audio_encoder != G726)) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[0].audio_encoder, 1);
-
-            if (service_ctx.profiles[0].audio_encoder == G711) {
-                sprintf(bitrate, "%d", 64);
-                sprintf(samplerate, "%d", 8);
-            } else if (service_ctx.profiles[0].audio_encoder == AAC) {
-                sprintf(bitrate, "%d", 50);
-                sprintf(samplerate, "%d", 16);
-            }
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -2;
-        }
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        // G726 is not suppoerted
-        if ((service_ctx.profiles[1].audio_encoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_encoder != G726)) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[1].audio_encoder, 1);
-
-            if (service_ctx.profiles[1].audio_encoder == G711) {
-                sprintf(bitrate, "%d", 64);
-                sprintf(samplerate, "%d", 8);
-            } else if (service_ctx.profiles[1].audio_encoder == AAC) {
-                sprintf(bitrate, "%d", 50);
-                sprintf(samplerate, "%d", 16);
-            }
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -3;
-        }
-    } else {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -4;
     }
 
+    // G726 is not suppoerted
+    encoder = service_ctx.profiles[i].audio_encoder;
+    if ((encoder == AUDIO_NONE) || (encoder == G726)) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioNotSupported",
+                   "AudioNotSupported",
+                   "The device does not support audio");
+        return -2;
+    }
+    set_audio_codec(audio_encoder, 16, encoder, 1);
+    if (encoder == G711) {
+        sprintf(bitrate, "%d", 64);
+        sprintf(samplerate, "%d", 8);
+    } else if (encoder == AAC) {
+        sprintf(bitrate, "%d", 50);
+        sprintf(samplerate, "%d", 16);
+    }
+
     long size = cat(NULL,
                     "media_service_files/GetAudioEncoderConfigurationOptions.xml",
                     6,
@@ -1610,135 +863,61 @@ int media_get_audio_encoder_configuration_options()
 int media_get_audio_decoder_configuration()
 {
     const char *configuration_token = get_element("ConfigurationToken", "Body");
-    char token[10];
+    int i;
 
     if (configuration_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
         return -1;
     }
 
-    memset(token, '\0', sizeof(token));
-    strncpy(token, configuration_token, 9);
-
-    if (strcasecmp(service_ctx.profiles[0].name, token) == 0) {
-        if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", token);
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", token);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -2;
-        }
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        if (service_ctx.profiles[1].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", token);
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", token);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -3;
-        }
-
-    } else {
+    // Profile_x from token Profile_x_AudioDecoderToken
+    i = media_profile_find_config(configuration_token);
+    if (i < 0) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoConfig", "No config", "The requested configuration indicated does not exist");
         return -4;
     }
-}
-
-int media_get_audio_decoder_configurations()
-{
-    if (service_ctx.profiles_num == 1) {
-        if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -1;
-        }
-    } else if (service_ctx.profiles_num == 2) {
-        if ((service_ctx.profiles[0].audio_decoder != AUDIO_NONE) && (service_ctx.profiles[1].audio_decoder != AUDIO_NONE)) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfigurations_both.xml", 0);
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetAudioDecoderConfigurations_both.xml", 0);
-
-        } else if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_0");
+    if (service_ctx.profiles[i].audio_decoder == AUDIO_NONE) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioDecodingNotSupported",
+                   "AudioDecodingNotSupported",
+                   "Audio or Audio decoding is not supported by the device");
+        return -2;
+    }
 
-        } else if (service_ctx.profiles[1].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
+    long size = cat(NULL, "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
 
-            output_http_headers(size);
+    output_http_headers(size);
 
-            return cat("stdout", "media_service_files/GetAudioDecoderConfigurations.xml", 2, "%PROFILE%", "Profile_1");
+    return cat("stdout", "media_service_files/GetAudioDecoderConfiguration.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
+}
 
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -2;
-        }
+int media_get_audio_decoder_configurations()
+{
+    if (media_audio_decoder_count() == 0) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioDecodingNotSupported",
+                   "AudioDecodingNotSupported",
+                   "Audio or Audio decoding is not supported by the device");
+        return -1;
     }
+
+    return media_audio_configurations_send("media_service_files/GetAudioDecoderConfigurations", 0, service_ctx.profiles_num - 1, 1, 1);
 }
 
 int media_get_audio_decoder_configuration_options()
 {
-    int decoder_type;
+    int i, decoder_type;
     const char *configuration_token = get_element("ConfigurationToken", "Body");
     const char *profile_token = get_element("ProfileToken", "Body");
-    char token[10];
     char audio_decoder[16];
     char bitrate[4], samplerate[4];
 
-    memset(token, '\0', sizeof(token));
-    if (configuration_token != NULL) {
-        // Extract "Profile_x" from token Profile_x_VideoEncoderConfig
-        strncpy(token, configuration_token, 9);
-    } else if (profile_token != NULL) {
-        // Extract "Profile_x" from token Profile_x
-        strncpy(token, profile_token, 9);
-    } else {
-        strncpy(token, service_ctx.profiles[0].name, 9);
-    }
-
-    if (strcasecmp(service_ctx.profiles[0].name, token) == 0) {
-        decoder_type = service_ctx.profiles[0].audio_decoder;
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, token) == 0)) {
-        decoder_type = service_ctx.profiles[1].audio_decoder;
-    }
+    i = media_audio_profile_find(configuration_token, profile_token, 1);
+    decoder_type = (i >= 0) ? service_ctx.profiles[i].audio_decoder : AUDIO_NONE;
 
     // G726 is not suppoerted
     if ((decoder_type != AUDIO_NONE) && (decoder_type != G726)) {
@@ -1823,7 +1002,7 @@ int media_get_audio_output_configuration()
         return -1;
 
     char profiles_num[8];
-    snprintf(profiles_num, sizeof(profiles_num), "%d", audio_decoder_profile_count());
+    snprintf(profiles_num, sizeof(profiles_num), "%d", media_audio_decoder_count());
     const char *config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token : "";
     const char *name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
     const char *token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
@@ -1867,7 +1046,7 @@ int media_get_audio_output_configurations()
         return -1;
 
     char profiles_num[8];
-    snprintf(profiles_num, sizeof(profiles_num), "%d", audio_decoder_profile_count());
+    snprintf(profiles_num, sizeof(profiles_num), "%d", media_audio_decoder_count());
     const char *config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token : "";
     const char *name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
     const char *token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
@@ -1942,16 +1121,16 @@ int media_get_audio_output_configuration_options()
 int media_get_compatible_audio_source_configurations()
 {
     const char *profile_token = get_element("ProfileToken", "Body");
-    char profiles_num[2];
+    char profiles_num[8];
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (((strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) && (service_ctx.profiles[0].audio_encoder != AUDIO_NONE))
-        || ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)
-            && (service_ctx.profiles[1].audio_encoder != AUDIO_NONE))) {
+    i = media_profile_find(profile_token);
+    if ((i >= 0) && (service_ctx.profiles[i].audio_encoder != AUDIO_NONE)) {
         sprintf(profiles_num, "%d", service_ctx.profiles_num);
 
         long size = cat(NULL, "media_service_files/GetCompatibleAudioSourceConfigurations.xml", 2, "%PROFILES_NUM%", profiles_num);
@@ -1975,125 +1154,78 @@ int media_get_compatible_audio_encoder_configurations()
 {
     char audio_encoder[16];
     const char *profile_token = get_element("ProfileToken", "Body");
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        if (service_ctx.profiles[0].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[0].audio_encoder, 1);
-            long size = cat(NULL,
-                            "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
-                            4,
-                            "%PROFILE%",
-                            profile_token,
-                            "%AUDIO_ENCODING%",
-                            audio_encoder);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       profile_token,
-                       "%AUDIO_ENCODING%",
-                       audio_encoder);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -2;
-        }
-
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].audio_encoder != AUDIO_NONE) {
-            set_audio_codec(audio_encoder, 16, service_ctx.profiles[1].audio_encoder, 1);
-            long size = cat(NULL,
-                            "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
-                            4,
-                            "%PROFILE%",
-                            profile_token,
-                            "%AUDIO_ENCODING%",
-                            audio_encoder);
-
-            output_http_headers(size);
-
-            return cat("stdout",
-                       "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
-                       4,
-                       "%PROFILE%",
-                       profile_token,
-                       "%AUDIO_ENCODING%",
-                       audio_encoder);
-
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioNotSupported",
-                       "AudioNotSupported",
-                       "The device does not support audio");
-            return -3;
-        }
-
-    } else {
+    i = media_profile_find(profile_token);
+    if (i < 0) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -4;
     }
+    if (service_ctx.profiles[i].audio_encoder == AUDIO_NONE) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioNotSupported",
+                   "AudioNotSupported",
+                   "The device does not support audio");
+        return -2;
+    }
+    set_audio_codec(audio_encoder, 16, service_ctx.profiles[i].audio_encoder, 1);
+
+    long size = cat(NULL,
+                    "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
+                    4,
+                    "%PROFILE%",
+                    service_ctx.profiles[i].name,
+                    "%AUDIO_ENCODING%",
+                    audio_encoder);
+
+    output_http_headers(size);
+
+    return cat("stdout",
+               "media_service_files/GetCompatibleAudioEncoderConfigurations.xml",
+               4,
+               "%PROFILE%",
+               service_ctx.profiles[i].name,
+               "%AUDIO_ENCODING%",
+               audio_encoder);
 }
 
 int media_get_compatible_audio_decoder_configurations()
 {
     const char *profile_token = get_element("ProfileToken", "Body");
+    int i;
 
     if (profile_token == NULL) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -1;
     }
 
-    if (strcasecmp(service_ctx.profiles[0].name, profile_token) == 0) {
-        if (service_ctx.profiles[0].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", profile_token);
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", profile_token);
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -2;
-        }
-    } else if ((service_ctx.profiles_num == 2) && (strcasecmp(service_ctx.profiles[1].name, profile_token) == 0)) {
-        if (service_ctx.profiles[1].audio_decoder != AUDIO_NONE) {
-            long size = cat(NULL, "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", profile_token);
-
-            output_http_headers(size);
-
-            return cat("stdout", "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", profile_token);
-        } else {
-            send_fault("media_service",
-                       "Receiver",
-                       "ter:ActionNotSupported",
-                       "ter:AudioDecodingNotSupported",
-                       "AudioDecodingNotSupported",
-                       "Audio or Audio decoding is not supported by the device");
-            return -3;
-        }
-    } else {
+    i = media_profile_find(profile_token);
+    if (i < 0) {
         send_fault("media_service", "Sender", "ter:InvalidArgVal", "ter:NoProfile", "No profile", "The requested profile does not exist");
         return -4;
     }
+    if (service_ctx.profiles[i].audio_decoder == AUDIO_NONE) {
+        send_fault("media_service",
+                   "Receiver",
+                   "ter:ActionNotSupported",
+                   "ter:AudioDecodingNotSupported",
+                   "AudioDecodingNotSupported",
+                   "Audio or Audio decoding is not supported by the device");
+        return -2;
+    }
+
+    long size = cat(NULL, "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
+
+    output_http_headers(size);
+
+    return cat("stdout", "media_service_files/GetCompatibleAudioDecoderConfigurations.xml", 2, "%PROFILE%", service_ctx.profiles[i].name);
 }
 
 int media_get_compatible_audio_output_configurations()
@@ -2103,7 +1235,7 @@ int media_get_compatible_audio_output_configurations()
         return -1;
 
     char profiles_num[8];
-    snprintf(profiles_num, sizeof(profiles_num), "%d", audio_decoder_profile_count());
+    snprintf(profiles_num, sizeof(profiles_num), "%d", media_audio_decoder_count());
     const char *config_token = service_ctx.audio.backchannel.configuration_token ? service_ctx.audio.backchannel.configuration_token : "";
     const char *name = service_ctx.audio.backchannel.name ? service_ctx.audio.backchannel.name : "";
     const char *token = service_ctx.audio.backchannel.token ? service_ctx.audio.backchannel.token : "";
@@ -15,8 +15,15 @@
  */
 
 #include "conf.h"
+#include "event_ingest.h"
 #include "log.h"
 #include "onvif_simple_server.h"
+#include "focus_controller.h"
+#include "prudynt_bridge.h"
+#include "ptz_backend.h"
+#include "ptz_planner.h"
+#include "ptz_tour.h"
+#include "relay_backend.h"
 #include "utils.h"
 
 #include <dirent.h>
@@ -41,6 +48,8 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
 #define DEFAULT_PID_FILE "/var/run/onvif_notify_server.pid"
 #define TEMPLATE_DIR "/var/www/onvif/notify_files"
@@ -54,6 +63,78 @@
 // Timeout for connect/send towards push notification subscribers
 #define NOTIFY_TIMEOUT_MS 5000
 
+// PTZ state sampler: how often command_seq is checked, and how long the fast
+// rate is kept after a motor command (the motors may not report moving yet)
+#define PTZ_STATE_TICK_MS 20
+#define PTZ_STATE_SETTLE_MS 1000
+
+// Pending push notifications per subscriber, sent as one Notify request
+#define NOTIFY_QUEUE_LEN (MAX_EVENTS * 4)
+
+typedef struct {
+    int alarm_index;
+    time_t e_time;
+    char property[16];
+    char value[8];
+    char source_values[MAX_EVENT_SOURCES][EVENT_SOURCE_VALUE_LEN]; // "" = configured value
+} notify_message_t;
+
+/*
+ * Delivery state of a push subscriber (circuit breaker).
+ * A failed Notify moves the subscriber to backing off: its messages stay
+ * queued, collapsed to the latest state per event, and are retried with
+ * exponential backoff from the sync thread. After NOTIFY_SUSPEND_FAILURES
+ * consecutive failures it is suspended and only probed now and then, so an
+ * unreachable consumer never costs a connect timeout on the event path.
+ */
+typedef enum { DELIVERY_HEALTHY, DELIVERY_BACKING_OFF, DELIVERY_SUSPENDED } delivery_state_t;
+
+#define NOTIFY_RETRY_MIN_MS 1000
+#define NOTIFY_RETRY_MAX_MS 30000
+#define NOTIFY_SUSPEND_FAILURES 5
+#define NOTIFY_SUSPEND_PROBE_MS 60000
+
+typedef struct {
+    int sub_id;
+    char reference[CONSUMER_REFERENCE_MAX_SIZE];
+    notify_message_t messages[NOTIFY_QUEUE_LEN];
+    int count;
+    long long due_ms; // monotonic time the pending messages must leave at
+    delivery_state_t state;
+    int failures;
+} notify_queue_t;
+
+/*
+ * Per-event debounce state. Timestamps are CLOCK_MONOTONIC nanoseconds so
+ * sub-second intervals work and a wall clock step (NTP at boot) can't stall
+ * delivery.
+ */
+typedef struct {
+    long long last_emit_ns; // when the state was last delivered, 0 = never
+    int last_emit_is_on;
+    int trailing; // a change was suppressed, send the final state when the window closes
+} event_debounce_t;
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static const char *delivery_state_name(delivery_state_t state)
+{
+    switch (state) {
+    case DELIVERY_BACKING_OFF:
+        return "backing off";
+    case DELIVERY_SUSPENDED:
+        return "suspended";
+    default:
+        return "healthy";
+    }
+}
+
 static int parse_reference_url(const char *reference, char *host, size_t host_len, char *page, size_t page_len, int *port_out)
 {
     const char *scheme_end;
@@ -135,7 +216,10 @@ int debug;
 int exit_main;
 sem_t *sem_shmem;
 subscription_shm_t saved_subscriptions[MAX_SUBSCRIPTIONS];
-static time_t last_emit_time[MAX_EVENTS]; // per-event debounce timestamp (seconds)
+static event_debounce_t debounce[MAX_EVENTS];
+static int socket_driven[MAX_EVENTS]; // event was fed through the socket, don't poll its file
+static notify_queue_t notify_queues[MAX_SUBSCRIPTIONS];
+static pthread_mutex_t notify_queue_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int check_pid(char *file_name)
 {
@@ -239,6 +323,7 @@ void print_subscriptions()
 {
     int i;
     char iso_str[21];
+    long long now_ms = monotonic_ms();
 
     fprintf(stderr, "Subscriptions\n");
     for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
@@ -251,6 +336,15 @@ void print_subscriptions()
             fprintf(stderr, "\t\texpire:           %s\n", iso_str);
             fprintf(stderr, "\t\ttopic_expression: %s\n", subs_evts->subscriptions[i].topic_expression);
             fprintf(stderr, "\t\tpush_need_sync:   %d\n", subs_evts->subscriptions[i].push_need_sync);
+            if (subs_evts->subscriptions[i].used == SUB_PUSH) {
+                // Diagnostic snapshot, read without the queue lock (signal context)
+                notify_queue_t *q = &notify_queues[i];
+                fprintf(stderr, "\t\tdelivery:         %s\n", delivery_state_name(q->state));
+                fprintf(stderr, "\t\tfailures:         %d\n", q->failures);
+                fprintf(stderr, "\t\tpending:          %d\n", q->count);
+                if (q->count > 0 && q->state != DELIVERY_HEALTHY)
+                    fprintf(stderr, "\t\tnext retry in:    %lld ms\n", q->due_ms > now_ms ? q->due_ms - now_ms : 0);
+            }
         } else {
             fprintf(stderr, "\t\tid:             0\n");
             fprintf(stderr, "\t\treference:\n");
@@ -325,7 +419,75 @@ int connect_with_timeout(int sockfd, struct sockaddr *addr, socklen_t addrlen, i
     return 0;
 }
 
-int send_notify(char *reference, int alarm_index, time_t e_time, char *property, char *value)
+// Fill the per-message template parameters for a queued notification
+static void notify_message_params(const notify_message_t *msg, char *utctime, size_t utctime_len, char *sources_xml, size_t sources_len,
+                                  char *data_name, const char **topic)
+{
+    event_t *ev = &service_ctx.events[msg->alarm_index];
+
+    to_iso_date(utctime, utctime_len, msg->e_time);
+    build_event_sources(sources_xml, sources_len, ev, msg->source_values);
+    *topic = ev->topic ? ev->topic : "";
+    if (strstr(*topic, "tns1:Device/Trigger/Relay")) {
+        strcpy(data_name, "LogicalState");
+    } else if (strstr(*topic, "CellMotionDetector/Motion")) {
+        strcpy(data_name, "IsMotion");
+    } else {
+        strcpy(data_name, "State");
+    }
+}
+
+/*
+ * Render the Notify body for a batch of messages.
+ * @param out Destination buffer, or NULL to only compute the size
+ * @return the number of bytes of the body
+ */
+static long render_notify(char *out, const notify_message_t *msgs, int count)
+{
+    char template_file[1024];
+    char utctime[32];
+    char sources_xml[512];
+    char data_name[32];
+    const char *topic;
+    long size, total_size;
+    int i;
+
+    sprintf(template_file, "%s/Notify_1.xml", TEMPLATE_DIR);
+    total_size = cat(out, template_file, 0);
+
+    sprintf(template_file, "%s/Notify_2.xml", TEMPLATE_DIR);
+    for (i = 0; i < count; i++) {
+        notify_message_params(&msgs[i], utctime, sizeof(utctime), sources_xml, sizeof(sources_xml), data_name, &topic);
+        size = cat(out ? out + total_size : NULL,
+                   template_file,
+                   12,
+                   "%TOPIC%",
+                   topic,
+                   "%UTC_TIME%",
+                   utctime,
+                   "%PROPERTY%",
+                   msgs[i].property,
+                   "%SOURCES%",
+                   sources_xml,
+                   "%DATA_NAME%",
+                   data_name,
+                   "%DATA_VALUE%",
+                   msgs[i].value);
+        total_size += size;
+    }
+
+    sprintf(template_file, "%s/Notify_3.xml", TEMPLATE_DIR);
+    total_size += cat(out ? out + total_size : NULL, template_file, 0);
+
+    return total_size;
+}
+
+/*
+ * Send one Notify request carrying all the given NotificationMessages.
+ * ONVIF allows several wsnt:NotificationMessage elements in a single
+ * Notify, so events changing together cost one round-trip per subscriber.
+ */
+int send_notify(char *reference, const notify_message_t *msgs, int count)
 {
     char host[1024];
     int port = 80;
@@ -333,15 +495,14 @@ int send_notify(char *reference, int alarm_index, time_t e_time, char *property,
     char header_fmt[] = "POST %s HTTP/1.1\r\nHost: %s\r\nContent-Type: application/soap+xml\r\nContent-Length: %s\r\nConnection: close\r\n\r\n";
     char *header;
     char *message;
-    int size;
+    long size;
     char size_string[32];
-    char template_file[1024];
     int sockfd;
     struct sockaddr_in remote;
-    char utctime[32];
+    int i;
 
-    // Prepare time string
-    to_iso_date(utctime, sizeof(utctime), e_time);
+    if (count <= 0)
+        return 0;
 
     // Prepare IP address
     if (strncmp("https", reference, 5) == 0)
@@ -358,7 +519,12 @@ int send_notify(char *reference, int alarm_index, time_t e_time, char *property,
     remote.sin_port = htons(port);
 
     log_debug("Sending notify message to %s - host %s - port %d - page %s", reference, host, port, page);
-    log_debug("topic %s - UTC time %s - value %s", service_ctx.events[alarm_index].topic, utctime, value);
+    for (i = 0; i < count; i++) {
+        log_debug("topic %s - property %s - value %s",
+                  service_ctx.events[msgs[i].alarm_index].topic,
+                  msgs[i].property,
+                  msgs[i].value);
+    }
 
     /* create the socket */
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -380,35 +546,9 @@ int send_notify(char *reference, int alarm_index, time_t e_time, char *property,
     setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
 
     // Get size of message content
-    log_info("Sending Notify message.");
-    sprintf(template_file, "%s/Notify.xml", TEMPLATE_DIR);
-    char sources_xml[512];
-    build_event_sources(sources_xml, sizeof(sources_xml), &service_ctx.events[alarm_index]);
-    char data_name[32];
-    const char *topic = service_ctx.events[alarm_index].topic ? service_ctx.events[alarm_index].topic : "";
-    if (strstr(topic, "tns1:Device/Trigger/Relay")) {
-        strcpy(data_name, "LogicalState");
-    } else if (strstr(topic, "CellMotionDetector/Motion")) {
-        strcpy(data_name, "IsMotion");
-    } else {
-        strcpy(data_name, "State");
-    }
-    size = cat(NULL,
-               template_file,
-               12,
-               "%TOPIC%",
-               topic,
-               "%UTC_TIME%",
-               utctime,
-               "%PROPERTY%",
-               property,
-               "%SOURCES%",
-               sources_xml,
-               "%DATA_NAME%",
-               data_name,
-               "%DATA_VALUE%",
-               value);
-    int size_len = snprintf(size_string, sizeof(size_string), "%d", size);
+    log_info("Sending Notify message (%d notification%s).", count, count == 1 ? "" : "s");
+    size = render_notify(NULL, msgs, count);
+    int size_len = snprintf(size_string, sizeof(size_string), "%ld", size);
     if (size_len < 0 || size_len >= (int) sizeof(size_string)) {
         log_error("Notify payload size too large");
         close(sockfd);
@@ -444,21 +584,7 @@ int send_notify(char *reference, int alarm_index, time_t e_time, char *property,
     }
 
     strcpy(message, header);
-    cat(&message[strlen(header)],
-        template_file,
-        12,
-        "%TOPIC%",
-        topic,
-        "%UTC_TIME%",
-        utctime,
-        "%PROPERTY%",
-        property,
-        "%SOURCES%",
-        sources_xml,
-        "%DATA_NAME%",
-        data_name,
-        "%DATA_VALUE%",
-        value);
+    render_notify(&message[strlen(header)], msgs, count);
 
     if (sendto(sockfd, message, strlen(message), 0, (struct sockaddr *) &remote, sizeof(remote)) < 0) {
         log_error("Error sending Notify message.\n");
@@ -479,6 +605,208 @@ int send_notify(char *reference, int alarm_index, time_t e_time, char *property,
     return 0;
 }
 
+// Drop pending messages and delivery history of a subscription slot
+void notify_queue_reset(int sub_index)
+{
+    pthread_mutex_lock(&notify_queue_lock);
+    memset(&notify_queues[sub_index], '\0', sizeof(notify_queue_t));
+    pthread_mutex_unlock(&notify_queue_lock);
+}
+
+/*
+ * Keep only the latest message per event (queue lock held).
+ * A subscriber that cannot be reached only needs the current state when it
+ * comes back, not every transition it missed, and this bounds the queue.
+ */
+static void notify_queue_collapse(notify_queue_t *q, const notify_message_t *msg)
+{
+    int i;
+
+    for (i = 0; i < q->count; i++) {
+        if (q->messages[i].alarm_index == msg->alarm_index) {
+            q->messages[i] = *msg;
+            return;
+        }
+    }
+    if (q->count < NOTIFY_QUEUE_LEN)
+        q->messages[q->count++] = *msg;
+}
+
+/*
+ * Send a batch taken out of a queue and update the delivery state.
+ * On failure the batch goes back to the queue, merged with anything queued
+ * meanwhile, and the next attempt is scheduled with exponential backoff.
+ */
+int deliver_notify(int sub_index, notify_queue_t *batch)
+{
+    notify_queue_t *q;
+    notify_queue_t newer;
+    long long delay;
+    int ret, i;
+
+    ret = send_notify(batch->reference, batch->messages, batch->count);
+
+    pthread_mutex_lock(&notify_queue_lock);
+    q = &notify_queues[sub_index];
+    if (q->sub_id != batch->sub_id) {
+        // Subscription went away while we were sending
+        pthread_mutex_unlock(&notify_queue_lock);
+        return ret;
+    }
+
+    if (ret == 0) {
+        if (q->state != DELIVERY_HEALTHY)
+            log_info("Subscriber %s is reachable again after %d failures", q->reference, q->failures);
+        q->state = DELIVERY_HEALTHY;
+        q->failures = 0;
+        if (q->count > 0)
+            q->due_ms = monotonic_ms() + service_ctx.events_notify_batch_ms;
+    } else {
+        q->failures++;
+        newer = *q;
+        q->count = 0;
+        for (i = 0; i < batch->count; i++)
+            notify_queue_collapse(q, &batch->messages[i]);
+        for (i = 0; i < newer.count; i++)
+            notify_queue_collapse(q, &newer.messages[i]);
+
+        if (q->failures >= NOTIFY_SUSPEND_FAILURES) {
+            if (q->state != DELIVERY_SUSPENDED)
+                log_warn("Suspending delivery to %s after %d failures", q->reference, q->failures);
+            q->state = DELIVERY_SUSPENDED;
+            delay = NOTIFY_SUSPEND_PROBE_MS;
+        } else {
+            q->state = DELIVERY_BACKING_OFF;
+            delay = (long long) NOTIFY_RETRY_MIN_MS << (q->failures - 1);
+            if (delay > NOTIFY_RETRY_MAX_MS)
+                delay = NOTIFY_RETRY_MAX_MS;
+            log_warn("Delivery to %s failed (%d), retrying in %lld ms", q->reference, q->failures, delay);
+        }
+        q->due_ms = monotonic_ms() + delay;
+    }
+    pthread_mutex_unlock(&notify_queue_lock);
+
+    return ret;
+}
+
+/*
+ * Queue a notification for a push subscriber.
+ *
+ * Messages are held for events_notify_batch_ms so that events changing
+ * together (motion plus a relay, two topics on the same input file, a
+ * SetSynchronizationPoint burst) leave in a single Notify request.
+ * Caller holds the shared memory semaphore: nothing is sent from here, a full
+ * queue is only marked due and goes out with the caller's next flush.
+ */
+void queue_notify(int sub_index, int alarm_index, time_t e_time, const char *property, const char *value,
+                  const char (*source_values)[EVENT_SOURCE_VALUE_LEN])
+{
+    notify_queue_t *q;
+    notify_message_t msg;
+
+    if (sub_index < 0 || sub_index >= MAX_SUBSCRIPTIONS)
+        return;
+
+    msg.alarm_index = alarm_index;
+    msg.e_time = e_time;
+    snprintf(msg.property, sizeof(msg.property), "%s", property);
+    snprintf(msg.value, sizeof(msg.value), "%s", value);
+    if (source_values)
+        memcpy(msg.source_values, source_values, sizeof(msg.source_values));
+    else
+        memset(msg.source_values, '\0', sizeof(msg.source_values));
+
+    pthread_mutex_lock(&notify_queue_lock);
+    q = &notify_queues[sub_index];
+    if (q->sub_id != subs_evts->subscriptions[sub_index].id) {
+        // Slot taken over by a new subscription: forget the old consumer
+        memset(q, '\0', sizeof(notify_queue_t));
+        q->sub_id = subs_evts->subscriptions[sub_index].id;
+    }
+    if (q->count == 0) {
+        strncpy(q->reference, subs_evts->subscriptions[sub_index].reference, sizeof(q->reference) - 1);
+        q->reference[sizeof(q->reference) - 1] = '\0';
+    }
+
+    if (q->state != DELIVERY_HEALTHY) {
+        // Retry schedule is owned by the sync thread, just update the state
+        notify_queue_collapse(q, &msg);
+    } else {
+        if (q->count == NOTIFY_QUEUE_LEN) {
+            // Queue is full: the semaphore is held, so don't send from here.
+            // Drop the oldest message and let the caller's flush send the rest.
+            log_warn("Notify queue of subscription %d is full, dropping the oldest message", sub_index);
+            memmove(&q->messages[0], &q->messages[1], sizeof(notify_message_t) * (NOTIFY_QUEUE_LEN - 1));
+            q->count--;
+            q->due_ms = 0;
+        } else if (q->count == 0) {
+            q->due_ms = monotonic_ms() + service_ctx.events_notify_batch_ms;
+        }
+        q->messages[q->count++] = msg;
+    }
+    pthread_mutex_unlock(&notify_queue_lock);
+}
+
+/*
+ * Send whatever is pending for one subscriber.
+ * @param retries 0 to send only to healthy subscribers whose window closed
+ *                (event path), 1 to retry backing off/suspended subscribers
+ *                whose backoff elapsed (sync thread)
+ * @param force Send healthy queues even if the window is still open
+ */
+void flush_notify_queue(int sub_index, int retries, int force)
+{
+    notify_queue_t pending;
+    notify_queue_t *q;
+    long long now_ms = monotonic_ms();
+
+    pthread_mutex_lock(&notify_queue_lock);
+    q = &notify_queues[sub_index];
+    if ((q->count == 0) || ((q->state != DELIVERY_HEALTHY) != retries) || (!force && now_ms < q->due_ms)) {
+        pthread_mutex_unlock(&notify_queue_lock);
+        return;
+    }
+    pending = *q;
+    q->count = 0;
+    pthread_mutex_unlock(&notify_queue_lock);
+
+    deliver_notify(sub_index, &pending);
+}
+
+// Send everything that is due
+void flush_notify_queues(int retries)
+{
+    int i;
+
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        flush_notify_queue(i, retries, 0);
+}
+
+/*
+ * Milliseconds until the first coalescing window of a healthy subscriber
+ * closes, suitable as a poll() timeout: -1 when nothing is pending, 0 when
+ * something is due.
+ */
+int notify_flush_timeout_ms()
+{
+    long long due = 0, left;
+    int i;
+
+    pthread_mutex_lock(&notify_queue_lock);
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
+        if (notify_queues[i].count > 0 && notify_queues[i].state == DELIVERY_HEALTHY) {
+            if (due == 0 || notify_queues[i].due_ms < due)
+                due = notify_queues[i].due_ms;
+        }
+    }
+    pthread_mutex_unlock(&notify_queue_lock);
+
+    if (due == 0)
+        return -1;
+    left = due - monotonic_ms();
+    return left > 0 ? (int) left : 0;
+}
+
 void sync_events(int sub_index)
 {
     int i;
@@ -488,8 +816,8 @@ void sync_events(int sub_index)
     log_info("Synchronization requested");
 
     for (i = 0; i < service_ctx.events_num; i++) {
-        if (is_topic_in_expression(subs_evts->subscriptions[sub_index].topic_expression, service_ctx.events[i].topic)) {
-            if (access(service_ctx.events[i].input_file, F_OK) == 0)
+        if (subs_evts->subscriptions[sub_index].topic_mask & (1U << i)) {
+            if (subs_evts->events[i].is_on == ALARM_ON)
                 strcpy(value, "true");
             else
                 strcpy(value, "false");
@@ -501,7 +829,7 @@ void sync_events(int sub_index)
                 if (now > subs_evts->subscriptions[sub_index].expire)
                     continue;
 
-                send_notify(subs_evts->subscriptions[sub_index].reference, i, now, "Initialized", value);
+                queue_notify(sub_index, i, now, "Initialized", value, subs_evts->events[i].source_values);
             }
             log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[sub_index].topic_expression);
         }
@@ -554,6 +882,7 @@ void check_subscriptions_status()
         }
         if ((saved_subscriptions[i].used != SUB_UNUSED) && (subs_evts->subscriptions[i].used != saved_subscriptions[i].used)) {
             log_info("Subscription %d destroyed", i);
+            notify_queue_reset(i);
         }
     }
     memcpy(saved_subscriptions, subs_evts->subscriptions, sizeof(subscription_shm_t) * MAX_SUBSCRIPTIONS);
@@ -561,18 +890,24 @@ void check_subscriptions_status()
 
 void *sync_events_thread(void *arg)
 {
-    int i;
+    int i, need_sync;
 
     while (!exit_main) {
         // Sync all events
         for (i = 0; i < MAX_SUBSCRIPTIONS; i++) {
             sem_memory_wait();
-            if (subs_evts->subscriptions[i].push_need_sync == 1) {
+            need_sync = (subs_evts->subscriptions[i].push_need_sync == 1);
+            if (need_sync) {
                 subs_evts->subscriptions[i].push_need_sync = 0;
                 sync_events(i);
             }
             sem_memory_post();
+            // The whole Initialized burst goes out as one Notify
+            if (need_sync)
+                flush_notify_queue(i, 0, 1);
         }
+        // Retry subscribers that are backing off or suspended
+        flush_notify_queues(1);
         // Clean expired_subscriptions
         sem_memory_wait();
         clean_expired_subscriptions();
@@ -582,6 +917,394 @@ void *sync_events_thread(void *arg)
     }
 }
 
+// Stop the axes whose ContinuousMove Timeout has elapsed
+static void ptz_stop_expired(long long now)
+{
+    char sys_command[MAX_LEN];
+    int pantilt, zoom;
+
+    sem_memory_wait();
+    pantilt = (subs_evts->ptz.stop_pantilt_ms != 0) && (now >= subs_evts->ptz.stop_pantilt_ms);
+    zoom = (subs_evts->ptz.stop_zoom_ms != 0) && (now >= subs_evts->ptz.stop_zoom_ms);
+    if (pantilt)
+        subs_evts->ptz.stop_pantilt_ms = 0;
+    if (zoom)
+        subs_evts->ptz.stop_zoom_ms = 0;
+    sem_memory_post();
+
+    if ((!pantilt && !zoom) || (service_ctx.ptz_node.move_stop == NULL))
+        return;
+
+    snprintf(sys_command, sizeof(sys_command), service_ctx.ptz_node.move_stop, (pantilt && zoom) ? "all" : (pantilt ? "pantilt" : "zoom"));
+    log_info("ContinuousMove timeout elapsed: %s", sys_command);
+    ptz_backend_run(sys_command);
+
+    sem_memory_wait();
+    subs_evts->ptz.command_seq++;
+    subs_evts->ptz.sample_ms = 0;
+    sem_memory_post();
+}
+
+// Apply the latest ContinuousMove/Stop commands, at most every move_min_interval_ms
+static void ptz_apply_pending(long long now)
+{
+    static long long last_apply_ms;
+    char pantilt[PTZ_COMMAND_LEN], zoom[PTZ_COMMAND_LEN];
+
+    if ((last_apply_ms != 0) && (now - last_apply_ms < service_ctx.ptz_node.move_min_interval_ms))
+        return;
+
+    sem_memory_wait();
+    strcpy(pantilt, subs_evts->ptz.pending_pantilt);
+    strcpy(zoom, subs_evts->ptz.pending_zoom);
+    subs_evts->ptz.pending_pantilt[0] = '\0';
+    subs_evts->ptz.pending_zoom[0] = '\0';
+    sem_memory_post();
+
+    if ((pantilt[0] == '\0') && (zoom[0] == '\0'))
+        return;
+
+    if (pantilt[0] != '\0') {
+        log_debug("PTZ: Executing %s", pantilt);
+        ptz_backend_run(pantilt);
+    }
+    if (zoom[0] != '\0') {
+        log_debug("PTZ: Executing %s", zoom);
+        ptz_backend_run(zoom);
+    }
+    last_apply_ms = now;
+
+    sem_memory_wait();
+    subs_evts->ptz.command_seq++;
+    subs_evts->ptz.sample_ms = 0;
+    sem_memory_post();
+}
+
+/*
+ * Resident side of the PTZ service.
+ * Keeps subs_evts->ptz fresh so GetStatus doesn't have to ask the motors:
+ * samples every ptz.status_poll_ms while moving or right after a motor
+ * command, every ptz.status_idle_poll_ms otherwise. Applies the ContinuousMove
+ * and Stop mailboxes, stops the motors when a ContinuousMove Timeout
+ * elapses, runs preset tours and steps AbsoluteMove/RelativeMove trajectories.
+ */
+void *ptz_state_thread(void *arg)
+{
+    int sample = (service_ctx.ptz_node.get_position != NULL) && (service_ctx.ptz_node.status_cache_ms > 0);
+
+    double x, y, z;
+    int moving = 0, status;
+    uint32_t seq, seen_seq = 0;
+    long long now, next_ms = 0, fast_until = 0;
+    int stale;
+
+    (void) arg;
+
+    while (!exit_main) {
+        sem_memory_wait();
+        subs_evts->ptz.worker_ms = monotonic_ms();
+        seq = subs_evts->ptz.command_seq;
+        stale = (subs_evts->ptz.sample_ms == 0);
+        sem_memory_post();
+
+        now = monotonic_ms();
+        ptz_apply_pending(now);
+        ptz_stop_expired(now);
+        ptz_tour_tick(subs_evts, now, sample);
+        ptz_plan_tick(subs_evts, now);
+        if (!sample) {
+            usleep(PTZ_STATE_TICK_MS * 1000);
+            continue;
+        }
+        if (seq != seen_seq) {
+            seen_seq = seq;
+            fast_until = now + PTZ_STATE_SETTLE_MS;
+            next_ms = now;
+        }
+        if (stale || (now >= next_ms)) {
+            z = 1.0;
+            status = ptz_backend_get_status(&x, &y, &z, &moving);
+
+            sem_memory_wait();
+            subs_evts->ptz.x = x;
+            subs_evts->ptz.y = y;
+            subs_evts->ptz.z = z;
+            subs_evts->ptz.moving = moving;
+            subs_evts->ptz.status = status;
+            subs_evts->ptz.sample_ms = monotonic_ms();
+            sem_memory_post();
+
+            if (moving || (now < fast_until))
+                next_ms = now + service_ctx.ptz_node.status_poll_ms;
+            else
+                next_ms = now + service_ctx.ptz_node.status_idle_poll_ms;
+        }
+        usleep(PTZ_STATE_TICK_MS * 1000);
+    }
+
+    return NULL;
+}
+
+// Resident side of the imaging focus moves, see focus_controller.c
+void *focus_thread(void *arg)
+{
+    (void) arg;
+
+    while (!exit_main) {
+        focus_tick(subs_evts, monotonic_ms());
+        usleep(PTZ_STATE_TICK_MS * 1000);
+    }
+
+    return NULL;
+}
+
+// Resident side of SetImagingSettings, see prudynt_bridge.c
+void *imaging_writer_thread(void *arg)
+{
+    (void) arg;
+
+    while (!exit_main) {
+        prudynt_writer_tick(subs_evts, monotonic_ms());
+        usleep(PTZ_STATE_TICK_MS * 1000);
+    }
+    prudynt_writer_close();
+
+    return NULL;
+}
+
+/*
+ * Return the monostable relays that are due to idle and arm timer_fd for
+ * the next release. Every activation reaches the main loop as an event
+ * record or an input file change, and the loop calls this after each wake
+ * up. A re-triggered relay only moves its release later: the timer then
+ * fires early and is re-armed here.
+ */
+static void relay_timer_update(int timer_fd)
+{
+    struct itimerspec its;
+    long long next;
+
+    next = relay_backend_expire(subs_evts, monotonic_ms());
+    memset(&its, '\0', sizeof(its));
+    if (next > 0) {
+        its.it_value.tv_sec = next / 1000;
+        its.it_value.tv_nsec = (next % 1000) * 1000000L;
+    }
+    // Zero disarms the timer
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int event_min_interval_ms(int i)
+{
+    if (service_ctx.events[i].min_interval_ms >= 0)
+        return service_ctx.events[i].min_interval_ms;
+    return service_ctx.events_min_interval_ms;
+}
+
+/*
+ * Fan out the current state of event i to the matching subscriptions.
+ * Must be called with the shared memory semaphore held.
+ */
+static void dispatch_event(int i)
+{
+    time_t now = time(NULL);
+    int j, sub_count = 0;
+    const char *value = (subs_evts->events[i].is_on == ALARM_ON) ? "true" : "false";
+
+    for (j = 0; j < MAX_SUBSCRIPTIONS; j++) {
+        if ((subs_evts->subscriptions[j].used != SUB_PULL) && (subs_evts->subscriptions[j].used != SUB_PUSH))
+            continue;
+        // Check if subscription is expired
+        if (now > subs_evts->subscriptions[j].expire)
+            continue;
+        if (!(subs_evts->subscriptions[j].topic_mask & (1U << i)))
+            continue;
+        sub_count++;
+        if (subs_evts->subscriptions[j].used == SUB_PULL) {
+            subs_evts->events[i].pull_notify |= (1 << j);
+            log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[j].topic_expression);
+        } else {
+            queue_notify(j, i, subs_evts->events[i].e_time, "Changed", value, subs_evts->events[i].source_values);
+        }
+    }
+
+    debounce[i].last_emit_ns = monotonic_ns();
+    debounce[i].last_emit_is_on = subs_evts->events[i].is_on;
+    debounce[i].trailing = 0;
+    log_debug("%d notification subscriptions for %s file", sub_count, service_ctx.events[i].input_file);
+}
+
+/*
+ * Record a new state for event i and notify the subscribers.
+ * source_values (may be NULL) replace the configured Source values until the
+ * next state change.
+ * Inside the event's min interval only the state is recorded; the final
+ * value goes out when the window closes (trailing edge), so a detector
+ * flapping faster than the interval can't swallow the last transition.
+ */
+void signal_event(int i, int is_on, time_t e_time, const char (*source_values)[EVENT_SOURCE_VALUE_LEN])
+{
+    long long interval_ns = (long long) event_min_interval_ms(i) * 1000000LL;
+
+    sem_memory_wait();
+    subs_evts->events[i].e_time = e_time;
+    subs_evts->events[i].is_on = is_on;
+    if (source_values)
+        memcpy(subs_evts->events[i].source_values, source_values, sizeof(subs_evts->events[i].source_values));
+    else
+        memset(subs_evts->events[i].source_values, '\0', sizeof(subs_evts->events[i].source_values));
+    if ((interval_ns <= 0) || (debounce[i].last_emit_ns == 0) || (monotonic_ns() - debounce[i].last_emit_ns >= interval_ns)) {
+        dispatch_event(i);
+    } else {
+        debounce[i].trailing = 1;
+        log_debug("Debounced event %d (min_interval_ms=%d)", i, event_min_interval_ms(i));
+    }
+    sem_memory_post();
+}
+
+// Deliver the final state of debounced events whose window has closed
+void flush_debounced_events()
+{
+    long long now_ns = monotonic_ns();
+    int i;
+
+    for (i = 0; i < service_ctx.events_num; i++) {
+        if (!debounce[i].trailing)
+            continue;
+        if (now_ns - debounce[i].last_emit_ns < (long long) event_min_interval_ms(i) * 1000000LL)
+            continue;
+
+        sem_memory_wait();
+        if (subs_evts->events[i].is_on != debounce[i].last_emit_is_on) {
+            log_debug("Trailing edge for event %d", i);
+            dispatch_event(i);
+        } else {
+            // The event flapped back to the state subscribers already have
+            debounce[i].trailing = 0;
+        }
+        sem_memory_post();
+    }
+}
+
+// Milliseconds until the next trailing edge is due, -1 if none is pending
+int debounce_timeout_ms()
+{
+    long long now_ns = monotonic_ns();
+    long long left_ns, min_ns = -1;
+    int i;
+
+    for (i = 0; i < service_ctx.events_num; i++) {
+        if (!debounce[i].trailing)
+            continue;
+        left_ns = debounce[i].last_emit_ns + (long long) event_min_interval_ms(i) * 1000000LL - now_ns;
+        if (left_ns < 0)
+            left_ns = 0;
+        if ((min_ns < 0) || (left_ns < min_ns))
+            min_ns = left_ns;
+    }
+    if (min_ns < 0)
+        return -1;
+
+    // Round up so poll() doesn't wake just before the window closes
+    return (int) ((min_ns + 999999LL) / 1000000LL);
+}
+
+static int min_timeout_ms(int a, int b)
+{
+    if (a < 0)
+        return b;
+    if (b < 0)
+        return a;
+    return (a < b) ? a : b;
+}
+
+/*
+ * Open the datagram socket producers send event_ingest_record_t records to.
+ * @return the socket, -1 on error (the file interface keeps working)
+ */
+int open_event_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("Event socket path too long: %s", path);
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        log_error("Unable to create event socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    // Stale socket from a previous run (the pid file guarantees we're alone)
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        log_error("Unable to bind event socket %s: %s", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+    chmod(path, 0660);
+
+    return sock;
+}
+
+// Replace characters that would break the XML the source values end up in
+static void sanitize_source_value(char *value)
+{
+    for (; *value != '\0'; value++) {
+        if ((*value == '<') || (*value == '>') || (*value == '&') || (*value == '"') || (*value == '\''))
+            *value = '_';
+    }
+}
+
+int handle_socket_events(int sock)
+{
+    event_ingest_record_t rec;
+    char source_values[MAX_EVENT_SOURCES][EVENT_SOURCE_VALUE_LEN];
+    ssize_t len;
+    time_t e_time;
+    int i, n;
+
+    for (;;) {
+        len = recv(sock, &rec, sizeof(rec), 0);
+        if (len == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+                break;
+            log_error("Error reading from event socket: %s", strerror(errno));
+            return -1;
+        }
+
+        if ((size_t) len < EVENT_INGEST_RECORD_SIZE(0) || rec.magic != EVENT_INGEST_MAGIC || rec.version != EVENT_INGEST_VERSION) {
+            log_warn("Discarding malformed event record (%d bytes)", (int) len);
+            continue;
+        }
+        if (rec.event_id >= service_ctx.events_num || rec.value > 1 || rec.sources_num > EVENT_INGEST_SOURCES
+            || (size_t) len < EVENT_INGEST_RECORD_SIZE(rec.sources_num)) {
+            log_warn("Discarding invalid event record for event %d", rec.event_id);
+            continue;
+        }
+
+        memset(source_values, '\0', sizeof(source_values));
+        n = (rec.sources_num < MAX_EVENT_SOURCES) ? rec.sources_num : MAX_EVENT_SOURCES;
+        for (i = 0; i < n; i++) {
+            snprintf(source_values[i], sizeof(source_values[i]), "%.*s", EVENT_INGEST_VALUE_LEN, rec.source_values[i]);
+            sanitize_source_value(source_values[i]);
+        }
+
+        e_time = (rec.timestamp_ms > 0) ? (time_t) (rec.timestamp_ms / 1000) : time(NULL);
+        log_debug("Event %d set to %d from socket", rec.event_id, rec.value);
+        socket_driven[rec.event_id] = 1;
+        signal_event(rec.event_id, rec.value ? ALARM_ON : ALARM_OFF, e_time, (n > 0) ? source_values : NULL);
+    }
+
+    return 0;
+}
+
 int handle_inotify_events(int fd, char *dir)
 {
     /* Some systems cannot read integer variables if they are not
@@ -593,10 +1316,8 @@ int handle_inotify_events(int fd, char *dir)
     char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
     const struct inotify_event *event;
     ssize_t len;
-    int i, j;
-    int sub_count;
-    char input_file[1024], value[8];
-    time_t now;
+    int i, is_on;
+    char input_file[1024];
     char *ptr;
 
     /* Loop while events can be read from inotify file descriptor. */
@@ -626,69 +1347,25 @@ int handle_inotify_events(int fd, char *dir)
                     continue;
                 }
                 if (event->mask & IN_CREATE) {
-                    strcpy(value, "true");
+                    is_on = ALARM_ON;
                     log_debug("File %s created", input_file);
                 } else if (event->mask & IN_DELETE) {
-                    strcpy(value, "false");
+                    is_on = ALARM_OFF;
                     log_debug("File %s deleted", input_file);
-                } else if (event->mask & IN_MODIFY) {
+                } else {
                     /* Treat modify as a presence/changed signal (e.g. truncate/touch) */
                     if (access(input_file, F_OK) == 0) {
-                        strcpy(value, "true");
+                        is_on = ALARM_ON;
                         log_debug("File %s modified (exists)", input_file);
                     } else {
-                        strcpy(value, "false");
+                        is_on = ALARM_OFF;
                         log_debug("File %s modified (not found)", input_file);
                     }
                 }
 
                 for (i = 0; i < service_ctx.events_num; i++) {
-                    if (strcmp(service_ctx.events[i].input_file, input_file) == 0) {
-                        now = time(NULL);
-                        sub_count = 0;
-                        sem_memory_wait();
-                        subs_evts->events[i].e_time = now;
-                        if (event->mask & IN_CREATE) {
-                            subs_evts->events[i].is_on = 1;
-                        } else if (event->mask & IN_DELETE) {
-                            subs_evts->events[i].is_on = 0;
-                        }
-
-                        int allow = 1;
-                        if (service_ctx.events_min_interval_ms > 0) {
-                            long diff_ms = (long) (now - last_emit_time[i]) * 1000L;
-                            if (diff_ms < service_ctx.events_min_interval_ms) {
-                                allow = 0; // Suppress notification due to debounce
-                            } else {
-                                last_emit_time[i] = now;
-                            }
-                        }
-
-                        if (allow) {
-                            for (j = 0; j < MAX_SUBSCRIPTIONS; j++) {
-                                if (subs_evts->subscriptions[j].used == SUB_PULL) {
-                                    // Check if subscription is expired
-                                    if (now > subs_evts->subscriptions[j].expire)
-                                        continue;
-                                    if (is_topic_in_expression(subs_evts->subscriptions[j].topic_expression, service_ctx.events[i].topic)) {
-                                        sub_count++;
-                                        subs_evts->events[i].pull_notify |= (1 << j);
-                                        log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[j].topic_expression);
-                                    }
-                                } else if (subs_evts->subscriptions[j].used == SUB_PUSH) {
-                                    // Check if subscription is expired
-                                    if (now > subs_evts->subscriptions[j].expire)
-                                        continue;
-                                    sub_count++;
-                                    send_notify(subs_evts->subscriptions[j].reference, i, subs_evts->events[i].e_time, "Changed", value);
-                                }
-                            }
-                        } else {
-                            log_debug("Debounced event %d (min_interval_ms=%d)", i, service_ctx.events_min_interval_ms);
-                        }
-                        sem_memory_post();
-                        log_debug("%d notification subscriptions for %s file", sub_count, service_ctx.events[i].input_file);
-                    }
+                    if (strcmp(service_ctx.events[i].input_file, input_file) == 0)
+                        signal_event(i, is_on, time(NULL), NULL);
                 }
             }
         }
@@ -713,20 +1390,20 @@ int main(int argc, char **argv)
 {
     int errno;
     char *endptr;
-    int c, i, j, ret, itmp;
+    int c, i, ret, itmp;
     char pid_file[1024];
     int debug_cli_set = 0;
 
     int fd = -1;
+    int sock = -1;
+    int timer_fd = -1;
     int wd, poll_num;
     nfds_t nfds;
-    struct pollfd fds[1];
+    struct pollfd fds[3];
+    uint64_t expirations;
 
     int acc;
 
-    time_t now;
-    int sub_count;
-
     conf_file = (char *) malloc((strlen(DEFAULT_JSON_CONF_FILE) + 1) * sizeof(char));
     strcpy(conf_file, DEFAULT_JSON_CONF_FILE);
 
@@ -891,10 +1568,30 @@ int main(int argc, char **argv)
     memset(subs_evts, '\0', sizeof(shm_t));
     sem_memory_post();
 
-    // Log events
+    // Log events and start from the current state of their files
     for (i = 0; i < service_ctx.events_num; i++) {
         log_debug("%d: %s", i, service_ctx.events[i].input_file);
+        if ((service_ctx.events[i].input_file != NULL) && (access(service_ctx.events[i].input_file, F_OK) == 0))
+            subs_evts->events[i].is_on = ALARM_ON;
+    }
+
+    // Event producers that don't go through the file system
+    sock = open_event_socket(EVENT_INGEST_SOCKET);
+    if (sock != -1)
+        log_info("Listening for event records on %s", EVENT_INGEST_SOCKET);
+    fds[1].fd = sock; // Negative fd: ignored by poll()
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    // Returns monostable relays to idle
+    if (service_ctx.relay_outputs_num > 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd == -1)
+            log_error("Unable to create the relay timer: %s", strerror(errno));
     }
+    fds[2].fd = timer_fd;
+    fds[2].events = POLLIN;
+    fds[2].revents = 0;
 
     // Create the file descriptor for accessing the inotify API
     fd = inotify_init1(IN_NONBLOCK);
@@ -923,7 +1620,7 @@ int main(int argc, char **argv)
         }
 
         // Prepare for polling
-        nfds = 1;
+        nfds = 3;
         fds[0].fd = fd; // Inotify input
         fds[0].events = POLLIN;
     }
@@ -933,12 +1630,34 @@ int main(int argc, char **argv)
     pthread_create(&sync_events_pthread, NULL, sync_events_thread, NULL);
     pthread_detach(sync_events_pthread);
 
+    // Create thread to sample the PTZ state and enforce ContinuousMove timeouts
+    if (service_ctx.ptz_node.enable) {
+        pthread_t ptz_state_pthread;
+        pthread_create(&ptz_state_pthread, NULL, ptz_state_thread, NULL);
+        pthread_detach(ptz_state_pthread);
+    }
+
+    // Create thread to run the focus moves of the imaging service
+    if (focus_controller_needed()) {
+        pthread_t focus_pthread;
+        pthread_create(&focus_pthread, NULL, focus_thread, NULL);
+        pthread_detach(focus_pthread);
+    }
+
+    // Create thread to write the imaging settings to prudynt
+    if (service_ctx.imaging_num > 0) {
+        pthread_t imaging_writer_pthread;
+        pthread_create(&imaging_writer_pthread, NULL, imaging_writer_thread, NULL);
+        pthread_detach(imaging_writer_pthread);
+    }
+
     // Wait for events
     log_info("Listening for events.");
     while (!exit_main) {
         // Check if new events are fired
         if (fd != -1) {
-            poll_num = poll(fds, nfds, -1);
+            // Wake up when a debounce or push coalescing window closes
+            poll_num = poll(fds, nfds, min_timeout_ms(debounce_timeout_ms(), notify_flush_timeout_ms()));
             if (poll_num == -1) {
                 if (errno == EINTR)
                     continue;
@@ -951,111 +1670,75 @@ int main(int argc, char **argv)
                     // Inotify events are available
                     handle_inotify_events(fd, INOTIFY_DIR);
                 }
+                if (fds[1].revents & POLLIN) {
+                    // Event records are available
+                    handle_socket_events(sock);
+                }
+                if (fds[2].revents & POLLIN) {
+                    // A monostable relay is due
+                    read(timer_fd, &expirations, sizeof(expirations));
+                }
             }
+            if (timer_fd != -1)
+                relay_timer_update(timer_fd);
+
+            flush_debounced_events();
+            if (notify_flush_timeout_ms() == 0)
+                flush_notify_queues(0);
         } else { // Inotify interface is not available
             for (i = 0; i < service_ctx.events_num; i++) {
+                // Events fed through the socket don't have a file to look at
+                if (socket_driven[i])
+                    continue;
                 acc = access(service_ctx.events[i].input_file, F_OK);
 
                 if ((subs_evts->events[i].is_on != ALARM_ON) && (acc == 0)) {
-                    now = time(NULL);
-                    sub_count = 0;
                     log_info("File %s created", service_ctx.events[i].input_file);
-
-                    sem_memory_wait();
-                    subs_evts->events[i].e_time = now;
-                    subs_evts->events[i].is_on = ALARM_ON;
-
-                    int allow = 1;
-                    if (service_ctx.events_min_interval_ms > 0) {
-                        long diff_ms = (long) (now - last_emit_time[i]) * 1000L;
-                        if (diff_ms < service_ctx.events_min_interval_ms) {
-                            allow = 0;
-                        } else {
-                            last_emit_time[i] = now;
-                        }
-                    }
-
-                    if (allow) {
-                        for (j = 0; j < MAX_SUBSCRIPTIONS; j++) {
-                            if (subs_evts->subscriptions[j].used == SUB_PULL) {
-                                // Check if subscription is expired
-                                if (now > subs_evts->subscriptions[j].expire)
-                                    continue;
-                                if (is_topic_in_expression(subs_evts->subscriptions[j].topic_expression, service_ctx.events[i].topic)) {
-                                    sub_count++;
-                                    subs_evts->events[i].pull_notify |= (1 << j);
-                                    log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[j].topic_expression);
-                                }
-                            } else if (subs_evts->subscriptions[j].used == SUB_PUSH) {
-                                // Check if subscription is expired
-                                if (now > subs_evts->subscriptions[j].expire)
-                                    continue;
-                                sub_count++;
-                                send_notify(subs_evts->subscriptions[j].reference, i, subs_evts->events[i].e_time, "Changed", "true");
-                            }
-                        }
-                    } else {
-                        log_debug("Debounced event %d (min_interval_ms=%d)", i, service_ctx.events_min_interval_ms);
-                    }
-                    sem_memory_post();
-                    log_debug("%d notification subscriptions for %s file", sub_count, service_ctx.events[i].input_file);
-
+                    signal_event(i, ALARM_ON, time(NULL), NULL);
                 } else if ((subs_evts->events[i].is_on != ALARM_OFF) && (acc != 0)) {
-                    now = time(NULL);
-                    sub_count = 0;
                     log_info("File %s deleted", service_ctx.events[i].input_file);
-
-                    sem_memory_wait();
-                    subs_evts->events[i].e_time = now;
-                    subs_evts->events[i].is_on = ALARM_OFF;
-
-                    int allow = 1;
-                    if (service_ctx.events_min_interval_ms > 0) {
-                        long diff_ms = (long) (now - last_emit_time[i]) * 1000L;
-                        if (diff_ms < service_ctx.events_min_interval_ms) {
-                            allow = 0;
-                        } else {
-                            last_emit_time[i] = now;
-                        }
-                    }
-
-                    if (allow) {
-                        for (j = 0; j < MAX_SUBSCRIPTIONS; j++) {
-                            if (subs_evts->subscriptions[j].used == SUB_PULL) {
-                                // Check if subscription is expired
-                                if (now > subs_evts->subscriptions[j].expire)
-                                    continue;
-                                if (is_topic_in_expression(subs_evts->subscriptions[j].topic_expression, service_ctx.events[i].topic)) {
-                                    sub_count++;
-                                    subs_evts->events[i].pull_notify |= (1 << j);
-                                    log_debug("Event %d matches topic expression %s", i, subs_evts->subscriptions[j].topic_expression);
-                                }
-                            } else if (subs_evts->subscriptions[j].used == SUB_PUSH) {
-                                // Check if subscription is expired
-                                if (now > subs_evts->subscriptions[j].expire)
-                                    continue;
-                                sub_count++;
-                                send_notify(subs_evts->subscriptions[j].reference, i, subs_evts->events[i].e_time, "Changed", "false");
-                            }
-                        }
-                    } else {
-                        log_debug("Debounced event %d (min_interval_ms=%d)", i, service_ctx.events_min_interval_ms);
-                    }
-                    sem_memory_post();
-                    log_debug("%d notification subscriptions for %s file", sub_count, service_ctx.events[i].input_file);
+                    signal_event(i, ALARM_OFF, time(NULL), NULL);
                 }
             }
 
-            usleep(100000);
+            flush_debounced_events();
+            if (notify_flush_timeout_ms() == 0)
+                flush_notify_queues(0);
+
+            if ((sock != -1) || (timer_fd != -1)) {
+                // Keep the socket and the relay timer responsive between two file checks
+                if (poll(&fds[1], 2, 100) > 0) {
+                    if (fds[1].revents & POLLIN)
+                        handle_socket_events(sock);
+                    if (fds[2].revents & POLLIN)
+                        read(timer_fd, &expirations, sizeof(expirations));
+                }
+                if (timer_fd != -1)
+                    relay_timer_update(timer_fd);
+            } else {
+                usleep(100000);
+            }
         }
     }
 
     log_info("Listening for events stopped.");
 
+    // Don't lose notifications still waiting in the coalescing window
+    for (i = 0; i < MAX_SUBSCRIPTIONS; i++)
+        flush_notify_queue(i, 0, 1);
+
     // Close inotify file descriptor
     if (fd != -1)
         close(fd);
 
+    if (sock != -1) {
+        close(sock);
+        unlink(EVENT_INGEST_SOCKET);
+    }
+
+    if (timer_fd != -1)
+        close(timer_fd);
+
     destroy_shared_memory(subs_evts, 1);
 
     release_pid_file(pid_file);
@@ -24,6 +24,8 @@
 #define DAEMON_NO_UMASK0 010        /* Don't do a umask(0) */
 #define DAEMON_MAX_CLOSE 8192       /* Max file descriptors to close if sysconf(_SC_OPEN_MAX) is indeterminate */
 
+#define MAX_PROFILES 4 // Main stream, sub stream and up to two more (e.g. a JPEG stream)
+
 typedef struct {
     int enable;
     const char *username;
@@ -38,6 +40,7 @@ typedef enum { VIDEO_NONE, JPEG, MPEG4, H264, H265 } stream_type;
 typedef enum { AUDIO_NONE, G711, G726, AAC } audio_type;
 
 typedef enum { IDLE_STATE_CLOSE, IDLE_STATE_OPEN } idle_state;
+typedef enum { RELAY_MODE_BISTABLE, RELAY_MODE_MONOSTABLE } relay_mode;
 
 typedef struct {
     char *name;
@@ -57,8 +60,21 @@ typedef struct {
     int idle_state;
     char *close;
     char *open;
+    int gpio_line;       // sysfs GPIO number, -1 = switch with the close/open commands
+    int gpio_active_low; // The relay closes on a low level
+    int event_id;        // Index of its tns1:Device/Trigger/Relay event, -1 = none
+    int mode;            // relay_mode
+    int delay_ms;        // Monostable: back to idle this long after the last activation
 } relay_output_t;
 
+// Per-axis (x, y, z) conversion: out = clamp(in * scale + offset, min, max)
+typedef struct {
+    double scale[3];
+    double offset[3];
+    double min[3];
+    double max[3];
+} ptz_transform_t;
+
 typedef struct {
     int enable;
     double min_step_x;
@@ -91,6 +107,17 @@ typedef struct {
     char *jump_to_abs;
     char *jump_to_rel;
     char *get_presets;
+    char *backend_socket; // Motors daemon unix socket; NULL runs the commands above through the shell
+    int status_cache_ms;     // GetStatus uses the shared sample when younger than this; 0 always asks the motors
+    int status_poll_ms;      // Sampling period while moving or right after a command
+    int status_idle_poll_ms; // Sampling period while idle
+    int move_min_interval_ms; // Max rate of ContinuousMove/Stop commands sent to the motors
+    int set_preset_timeout_ms; // Max wait for a new preset to show up in get_presets
+    int planner_step_ms;       // AbsoluteMove/RelativeMove trajectory step, 0 = send the target to the motors
+    int planner_accel_ms;      // Time to reach full speed
+    double planner_max_speed_x; // Machine units per second at Speed 1.0
+    double planner_max_speed_y;
+    double planner_max_speed_z;
     // Optional extensions
     int max_preset_tours;    // 0 means not supported
     char *start_tracking;    // Command to start tracking (for MoveAndStartTracking)
@@ -104,6 +131,12 @@ typedef struct {
     int eflip_supported;
     int eflip_mode_on;
     int zoom_enable;       // -1 = auto, 0 = no zoom, 1 = zoom
+    // Built from the ranges above when the configuration is loaded
+    ptz_transform_t to_machine_generic;     // PositionGenericSpace -> machine units
+    ptz_transform_t to_machine_spherical;   // SphericalPositionSpace -> machine units
+    ptz_transform_t to_machine_translation; // TranslationGenericSpace and velocities -> machine deltas
+    ptz_transform_t to_machine_fov;         // TranslationSpaceFov -> machine deltas
+    ptz_transform_t to_onvif;               // Machine units -> reported position
 } ptz_node_t;
 
 // An event notification carries one or more Source items (the ONVIF catalog
@@ -122,6 +155,7 @@ typedef struct {
     event_source_t sources[MAX_EVENT_SOURCES];
     int sources_num;
     char *input_file;
+    int min_interval_ms; // Per-event debounce override; -1 uses events_min_interval_ms
 } event_t;
 
 typedef struct {
@@ -215,6 +249,7 @@ typedef struct {
     int supported;
     char *command;
     imaging_float_value_t speed;
+    int timeout_ms; // Stop the move after this, 0 = until Stop
 } imaging_focus_continuous_move_t;
 
 typedef struct {
@@ -247,6 +282,11 @@ typedef struct {
     imaging_float_value_t response_time;
 } imaging_ircut_auto_adjustment_t;
 
+typedef struct {
+    int pins[2];  // Filter drive GPIOs (on, off), -1 = not used
+    int pulse_ms; // Release both pins after this, 0 = hold the level
+} imaging_ircut_gpio_t;
+
 typedef struct {
     char *video_source_token;
     ircut_mode_t ircut_mode;
@@ -256,6 +296,7 @@ typedef struct {
     char *cmd_ircut_on;
     char *cmd_ircut_off;
     char *cmd_ircut_auto;
+    imaging_ircut_gpio_t ircut_gpio;
 
     imaging_mode_level_t backlight;
     imaging_float_value_t brightness;
@@ -316,6 +357,7 @@ typedef struct {
     int events_enable;
     int events_num;
     int events_min_interval_ms; // Global debounce for events; 0 disables
+    int events_notify_batch_ms; // Push Notify coalescing window; 0 sends per inotify read
     int loglevel;               // Controlled by 'log_level' config; 0=FATAL..5=TRACE, default 0
 
     // Raw XML logging configuration
@@ -324,6 +366,8 @@ typedef struct {
 
     imaging_entry_t *imaging;
     int imaging_num;
+
+    unsigned long long conf_generation; // Identity of the configuration file that was loaded
 } service_context_t;
 
 // Expose global context
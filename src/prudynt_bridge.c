@@ -1,21 +1,40 @@
 #include "prudynt_bridge.h"
 
 #include "log.h"
+#include "prudynt_shm.h"
+#include "utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <json_config.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#define PRUDYNT_STATE_PATH "/run/prudynt/imaging.json"
+#define PRUDYNT_STATE_DIR "/run/prudynt"
+#define PRUDYNT_STATE_NAME "imaging.json"
+#define PRUDYNT_STATE_PATH PRUDYNT_STATE_DIR "/" PRUDYNT_STATE_NAME
 #define PRUDYNT_FIFO_PATH "/run/prudynt/imagingctl"
 #define PRUDYNT_WAIT_INTERVAL_MS 100
 #define PRUDYNT_DEFAULT_TIMEOUT_MS 1200
 #define PRUDYNT_APPLY_TOLERANCE 0.02f
+#define PRUDYNT_SHM_POLL_MS 5
+#define PRUDYNT_SHM_READ_TRIES 100
+#define PRUDYNT_WRITER_ALIVE_MS 1000 // The imaging writer of onvif_notify_server ticks every few ms
+
+static const prudynt_shm_t *prudynt_shm = NULL;
+static int fifo_fd = -1;        // Kept open by the imaging writer
+static uint32_t writer_seq = 0; // Last imaging_set_seq taken by the imaging writer
+static int writer_failing = 0;  // The last line of the imaging writer was not sent
 
 static void reset_state(prudynt_imaging_state_t *state)
 {
@@ -65,6 +84,114 @@ static float field_normalized_value(const prudynt_field_state_t *field)
     return (field->value - field->min) / span;
 }
 
+/*
+ * Map the state published by prudynt, once per process. Returns NULL when
+ * prudynt doesn't publish it (older versions): the JSON file is used then.
+ */
+static const prudynt_shm_t *shm_map()
+{
+    struct stat st;
+    void *area;
+    int fd;
+
+    if (prudynt_shm != NULL)
+        return prudynt_shm;
+
+    fd = shm_open(PRUDYNT_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(prudynt_shm_t)) {
+        close(fd);
+        return NULL;
+    }
+    area = mmap(NULL, sizeof(prudynt_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (area == MAP_FAILED)
+        return NULL;
+
+    const prudynt_shm_t *shm = (const prudynt_shm_t *) area;
+    if (shm->magic != PRUDYNT_SHM_MAGIC || shm->version != PRUDYNT_SHM_VERSION || shm->size != sizeof(prudynt_shm_t)) {
+        log_debug("prudynt_bridge: ignoring %s with unknown layout", PRUDYNT_SHM_NAME);
+        munmap(area, sizeof(prudynt_shm_t));
+        return NULL;
+    }
+
+    prudynt_shm = shm;
+    return prudynt_shm;
+}
+
+static uint32_t shm_seq(const prudynt_shm_t *shm)
+{
+    return __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+}
+
+static void shm_field(const prudynt_shm_field_t *in, prudynt_field_state_t *out)
+{
+    if (!in->present || in->max <= in->min)
+        return;
+
+    out->present = 1;
+    out->value = in->value;
+    out->min = in->min;
+    out->max = in->max;
+}
+
+// Consistent copy of the shared state, -1 if the writer kept it busy
+static int shm_read_state(const prudynt_shm_t *shm, prudynt_imaging_state_t *state)
+{
+    prudynt_shm_field_t fields[PRUDYNT_SHM_FIELDS];
+    uint32_t seq;
+    int i;
+
+    for (i = 0; i < PRUDYNT_SHM_READ_TRIES; i++) {
+        seq = shm_seq(shm);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(fields, shm->fields, sizeof(fields));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+    if (i == PRUDYNT_SHM_READ_TRIES)
+        return -1;
+
+    shm_field(&fields[PRUDYNT_SHM_BRIGHTNESS], &state->brightness);
+    shm_field(&fields[PRUDYNT_SHM_CONTRAST], &state->contrast);
+    shm_field(&fields[PRUDYNT_SHM_SATURATION], &state->saturation);
+    shm_field(&fields[PRUDYNT_SHM_SHARPNESS], &state->sharpness);
+    shm_field(&fields[PRUDYNT_SHM_BACKLIGHT], &state->backlight);
+    shm_field(&fields[PRUDYNT_SHM_WIDE_DYNAMIC_RANGE], &state->wide_dynamic_range);
+    shm_field(&fields[PRUDYNT_SHM_TONE], &state->tone);
+    shm_field(&fields[PRUDYNT_SHM_DEFOG], &state->defog);
+    shm_field(&fields[PRUDYNT_SHM_NOISE_REDUCTION], &state->noise_reduction);
+    return 0;
+}
+
+/*
+ * Changes whenever the imaging state changes: the sequence number of the
+ * shared state, else the identity of the state file. 0 while the state is
+ * being updated, so nothing should be cached from it.
+ */
+unsigned long long prudynt_imaging_generation()
+{
+    const prudynt_shm_t *shm = shm_map();
+
+    if (shm) {
+        uint32_t seq = shm_seq(shm);
+        return (seq & 1) ? 0 : (1ULL << 63) | seq;
+    }
+    // No state file: the configuration alone
+    return file_generation(PRUDYNT_STATE_PATH) | 1;
+}
+
+static int state_has_fields(const prudynt_imaging_state_t *state)
+{
+    return state->brightness.present || state->contrast.present || state->saturation.present || state->sharpness.present || state->backlight.present
+           || state->wide_dynamic_range.present || state->tone.present || state->defog.present || state->noise_reduction.present;
+}
+
 int prudynt_load_imaging_state(prudynt_imaging_state_t *state)
 {
     if (!state)
@@ -72,6 +199,11 @@ int prudynt_load_imaging_state(prudynt_imaging_state_t *state)
 
     reset_state(state);
 
+    const prudynt_shm_t *shm = shm_map();
+    if (shm && shm_read_state(shm, state) == 0)
+        return state_has_fields(state) ? 0 : -1;
+    reset_state(state);
+
     JsonValue *doc = load_config(PRUDYNT_STATE_PATH);
     if (!doc)
         return -1;
@@ -91,11 +223,7 @@ int prudynt_load_imaging_state(prudynt_imaging_state_t *state)
 
     free_json_value(doc);
 
-    if (!state->brightness.present && !state->contrast.present && !state->saturation.present && !state->sharpness.present && !state->backlight.present
-        && !state->wide_dynamic_range.present && !state->tone.present && !state->defog.present && !state->noise_reduction.present)
-        return -1;
-
-    return 0;
+    return state_has_fields(state) ? 0 : -1;
 }
 
 static prudynt_field_state_t *lookup_field(prudynt_imaging_state_t *state, const char *key)
@@ -125,9 +253,10 @@ static prudynt_field_state_t *lookup_field(prudynt_imaging_state_t *state, const
     return NULL;
 }
 
+// payload is one complete line, at most PIPE_BUF bytes: written atomically
 static int write_fifo_command(const char *payload, size_t len)
 {
-    int fd = open(PRUDYNT_FIFO_PATH, O_WRONLY | O_NONBLOCK);
+    int fd = open(PRUDYNT_FIFO_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
     if (fd < 0) {
         log_error("prudynt_bridge: unable to open %s: %s", PRUDYNT_FIFO_PATH, strerror(errno));
         return -1;
@@ -142,60 +271,351 @@ static int write_fifo_command(const char *payload, size_t len)
     return 0;
 }
 
-int prudynt_apply_imaging_changes(const prudynt_command_t *commands, size_t command_count, int timeout_ms)
+static int fifo_open()
 {
-    if (!commands || command_count == 0)
+    if (fifo_fd >= 0)
         return 0;
 
-    char buffer[256];
-    int written = snprintf(buffer, sizeof(buffer), "SET");
-    if (written < 0 || written >= (int) sizeof(buffer))
+    fifo_fd = open(PRUDYNT_FIFO_PATH, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fifo_fd < 0) {
+        log_error("prudynt_bridge: unable to open %s: %s", PRUDYNT_FIFO_PATH, strerror(errno));
         return -1;
+    }
+    // A restarted prudynt must show up as EPIPE, not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+    return 0;
+}
 
-    for (size_t i = 0; i < command_count; ++i) {
-        float clamped = commands[i].value;
-        if (clamped < 0.0f)
-            clamped = 0.0f;
-        else if (clamped > 1.0f)
-            clamped = 1.0f;
-        int rc = snprintf(buffer + written, sizeof(buffer) - (size_t) written, " %s=%.4f", commands[i].key, clamped);
-        if (rc < 0)
+static void fifo_close()
+{
+    if (fifo_fd >= 0) {
+        close(fifo_fd);
+        fifo_fd = -1;
+    }
+}
+
+// As write_fifo_command(), on the descriptor kept by the imaging writer
+static int fifo_write(const char *payload, size_t len)
+{
+    ssize_t rc = -1;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+        if (fifo_open() != 0)
             return -1;
-        written += rc;
-        if (written >= (int) sizeof(buffer))
+        rc = write(fifo_fd, payload, len);
+        if (rc >= 0 || errno != EPIPE)
+            break;
+        // prudynt reopened its end since the last line
+        fifo_close();
+    }
+    if (rc != (ssize_t) len) {
+        log_error("prudynt_bridge: short write to %s", PRUDYNT_FIFO_PATH);
+        fifo_close();
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Every SET sent by any process bumps a counter in the shared memory of
+ * onvif_notify_server and records it for each field it sets. prudynt reads
+ * the FIFO in order, so a caller whose values were all overwritten by later
+ * SETs stops waiting for them instead of running into the timeout.
+ */
+
+// SET keys in the order of imaging_key_seq and of the imaging writer mailbox (PRUDYNT_SHM_*)
+static const char *const set_keys[PRUDYNT_SHM_FIELDS] = {
+    "brightness", "contrast", "saturation", "sharpness", "backlight", "wide_dynamic_range", "tone", "defog", "noise_reduction"};
+
+// Index of a field in imaging_key_seq, -1 if unknown
+static int key_index(const char *key)
+{
+    for (int i = 0; (i < PRUDYNT_SHM_FIELDS) && (i < IMAGING_SET_KEYS); i++) {
+        if (strcmp(set_keys[i], key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * 1 when SETs sent after own_set covered every command key, -1 when the
+ * imaging writer could not send own_set, 0 otherwise
+ */
+static int set_settled(shm_t *shm, const prudynt_command_t *commands, size_t command_count, uint32_t own_set)
+{
+    int settled = 1;
+
+    sem_memory_wait();
+    if ((int32_t) (own_set - shm->imaging_set.failed_first) >= 0 && (int32_t) (shm->imaging_set.failed_last - own_set) >= 0) {
+        settled = -1;
+    } else {
+        for (size_t i = 0; i < command_count; ++i) {
+            int index = key_index(commands[i].key);
+            if (index < 0 || (int32_t) (shm->imaging_key_seq[index] - own_set) <= 0) {
+                settled = 0;
+                break;
+            }
+        }
+    }
+    sem_memory_post();
+    return settled;
+}
+
+static float clamp_unit(float value)
+{
+    if (value < 0.0f)
+        return 0.0f;
+    if (value > 1.0f)
+        return 1.0f;
+    return value;
+}
+
+// 0 when the state file reports every command value, -1 otherwise
+static int check_applied(const prudynt_command_t *commands, size_t command_count)
+{
+    prudynt_imaging_state_t state;
+
+    if (prudynt_load_imaging_state(&state) != 0)
+        return -1;
+
+    for (size_t i = 0; i < command_count; ++i) {
+        prudynt_field_state_t *field = lookup_field(&state, commands[i].key);
+        float normalized = field_normalized_value(field);
+        if (normalized < 0.0f || fabsf(normalized - clamp_unit(commands[i].value)) > PRUDYNT_APPLY_TOLERANCE)
             return -1;
     }
-    if (written + 1 >= (int) sizeof(buffer))
+    return 0;
+}
+
+/*
+ * Watch the state directory: prudynt may rewrite the file in place or
+ * rename a new one over it. Returns -1 if inotify is not available.
+ */
+static int state_watch_open()
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (inotify_add_watch(fd, PRUDYNT_STATE_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        log_debug("prudynt_bridge: unable to watch %s: %s", PRUDYNT_STATE_DIR, strerror(errno));
+        close(fd);
         return -1;
+    }
+    return fd;
+}
+
+/*
+ * Wait up to timeout_ms for the state file to be written.
+ * Returns 1 if it was, 0 on timeout, -1 on error.
+ */
+static int state_watch_wait(int fd, int timeout_ms)
+{
+    char buf[1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd pfd;
+    ssize_t len;
+    char *ptr;
+    int changed = 0;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) < 0)
+        return errno == EINTR ? 0 : -1;
+
+    for (;;) {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event *) ptr;
+            if (event->len && strcmp(event->name, PRUDYNT_STATE_NAME) == 0)
+                changed = 1;
+        }
+    }
+    return changed;
+}
+
+// All the keys go in one SET line, which fits in PIPE_BUF. Returns its length, -1 on error
+static int format_set_line(char *buffer, size_t size, const prudynt_command_t *commands, size_t command_count)
+{
+    int written = snprintf(buffer, size, "SET");
+
+    for (size_t i = 0; i < command_count && written < (int) size; ++i)
+        written += snprintf(buffer + written, size - written, " %s=%.4f", commands[i].key, clamp_unit(commands[i].value));
+    if (written >= (int) size) {
+        log_error("prudynt_bridge: too many imaging settings for one command");
+        return -1;
+    }
     buffer[written++] = '\n';
+    return written;
+}
+
+/*
+ * Hand the SET to the imaging writer of onvif_notify_server when it runs,
+ * else write it here, and record it, under the lock of the shared memory so
+ * that the sequence numbers follow the order of the lines in the FIFO.
+ * own_set gets the sequence number of this SET.
+ */
+static int send_set(shm_t *shm, const prudynt_command_t *commands, size_t command_count, uint32_t *own_set)
+{
+    char buffer[PIPE_BUF];
+    int len, index, ret = 0;
 
-    if (write_fifo_command(buffer, (size_t) written) != 0)
+    *own_set = 0;
+    len = format_set_line(buffer, sizeof(buffer), commands, command_count);
+    if (len < 0)
         return -1;
+    if (shm == NULL)
+        return write_fifo_command(buffer, (size_t) len);
+
+    sem_memory_wait();
+    if (monotonic_ms() - shm->imaging_set.worker_ms <= PRUDYNT_WRITER_ALIVE_MS) {
+        // Merged with the values other requests posted since the last line
+        for (size_t i = 0; i < command_count; ++i) {
+            index = key_index(commands[i].key);
+            if (index >= 0) {
+                shm->imaging_set.pending[index] = 1;
+                shm->imaging_set.value[index] = clamp_unit(commands[i].value);
+            }
+        }
+    } else {
+        ret = write_fifo_command(buffer, (size_t) len);
+    }
+    if (ret == 0) {
+        *own_set = ++shm->imaging_set_seq;
+        for (size_t i = 0; i < command_count; ++i) {
+            index = key_index(commands[i].key);
+            if (index >= 0)
+                shm->imaging_key_seq[index] = *own_set;
+        }
+    }
+    sem_memory_post();
+    return ret;
+}
+
+int prudynt_apply_imaging_changes(const prudynt_command_t *commands, size_t command_count, int timeout_ms)
+{
+    if (!commands || command_count == 0)
+        return 0;
+
+    // Watch before sending the command so that the acknowledgement can't be
+    // missed: the sequence number of the shared state, else the state file
+    const prudynt_shm_t *shm = shm_map();
+    uint32_t seq = shm ? shm_seq(shm) : 0;
+    int watch_fd = shm ? -1 : state_watch_open();
+    shm_t *sets = shared_memory_attach();
+    uint32_t own_set;
+
+    if (send_set(sets, commands, command_count, &own_set) != 0) {
+        if (watch_fd >= 0)
+            close(watch_fd);
+        return -1;
+    }
 
     int wait_limit = timeout_ms > 0 ? timeout_ms : PRUDYNT_DEFAULT_TIMEOUT_MS;
-    int elapsed = 0;
-
-    while (elapsed <= wait_limit) {
-        prudynt_imaging_state_t state;
-        if (prudynt_load_imaging_state(&state) == 0) {
-            int satisfied = 1;
-            for (size_t i = 0; i < command_count && satisfied; ++i) {
-                float clamped = commands[i].value;
-                if (clamped < 0.0f)
-                    clamped = 0.0f;
-                else if (clamped > 1.0f)
-                    clamped = 1.0f;
-                prudynt_field_state_t *field = lookup_field(&state, commands[i].key);
-                float normalized = field_normalized_value(field);
-                if (normalized < 0.0f || fabsf(normalized - clamped) > PRUDYNT_APPLY_TOLERANCE)
-                    satisfied = 0;
+    long long deadline = monotonic_ms() + wait_limit;
+    long long next_check = 0;
+    int ret = -1;
+
+    // The state is read again only after prudynt has updated it
+    int changed = 1;
+    for (;;) {
+        if (changed && check_applied(commands, command_count) == 0) {
+            ret = 0;
+            break;
+        }
+        // A posted SET may fail in the writer without any state change
+        if ((changed || monotonic_ms() >= next_check) && sets) {
+            int settled = set_settled(sets, commands, command_count, own_set);
+            if (settled > 0) {
+                log_debug("prudynt_bridge: imaging settings superseded by a later SET");
+                ret = 0;
+                break;
+            }
+            if (settled < 0)
+                break;
+            next_check = monotonic_ms() + PRUDYNT_WAIT_INTERVAL_MS;
+        }
+        long long remaining = deadline - monotonic_ms();
+        if (remaining <= 0)
+            break;
+        if (shm) {
+            usleep((remaining < PRUDYNT_SHM_POLL_MS ? remaining : PRUDYNT_SHM_POLL_MS) * 1000);
+            uint32_t now_seq = shm_seq(shm);
+            changed = now_seq != seq;
+            seq = now_seq;
+        } else if (watch_fd >= 0) {
+            changed = state_watch_wait(watch_fd, (int) (remaining < PRUDYNT_WAIT_INTERVAL_MS ? remaining : PRUDYNT_WAIT_INTERVAL_MS));
+            if (changed < 0) {
+                // Fall back to polling
+                close(watch_fd);
+                watch_fd = -1;
+                changed = 1;
             }
-            if (satisfied)
-                return 0;
+        } else {
+            usleep((remaining < PRUDYNT_WAIT_INTERVAL_MS ? remaining : PRUDYNT_WAIT_INTERVAL_MS) * 1000);
+            changed = 1;
         }
-        usleep(PRUDYNT_WAIT_INTERVAL_MS * 1000);
-        elapsed += PRUDYNT_WAIT_INTERVAL_MS;
     }
 
-    return -1;
+    if (watch_fd >= 0)
+        close(watch_fd);
+    return ret;
+}
+
+/*
+ * Imaging writer, run by onvif_notify_server.
+ * SetImagingSettings posts its values in shm->imaging_set while the writer
+ * ticks, and does not wait for the previous request's line to be written:
+ * the writer sends everything posted since its last tick as one SET line,
+ * latest value per field, on a FIFO descriptor that stays open across
+ * requests. A slider sending a stream of updates thus costs one write per
+ * tick instead of an open/write/close per request.
+ */
+void prudynt_writer_tick(shm_t *shm, long long now)
+{
+    prudynt_command_t commands[IMAGING_SET_KEYS];
+    char buffer[PIPE_BUF];
+    size_t count = 0;
+    uint32_t first = writer_seq + 1;
+    int i, len;
+
+    sem_memory_wait();
+    shm->imaging_set.worker_ms = now;
+    for (i = 0; (i < IMAGING_SET_KEYS) && (i < PRUDYNT_SHM_FIELDS); i++) {
+        if (shm->imaging_set.pending[i]) {
+            commands[count].key = set_keys[i];
+            commands[count].value = shm->imaging_set.value[i];
+            shm->imaging_set.pending[i] = 0;
+            count++;
+        }
+    }
+    writer_seq = shm->imaging_set_seq;
+    sem_memory_post();
+
+    if (count == 0)
+        return;
+    if (count > 1)
+        log_debug("prudynt_bridge: %d imaging settings in one SET", (int) count);
+
+    len = format_set_line(buffer, sizeof(buffer), commands, count);
+    if (len >= 0 && fifo_write(buffer, (size_t) len) == 0) {
+        writer_failing = 0;
+        return;
+    }
+    // Let the requests waiting for these values fail now. The range grows
+    // while lines keep failing, so a later failed SET doesn't hide them.
+    sem_memory_wait();
+    if (!writer_failing)
+        shm->imaging_set.failed_first = first;
+    shm->imaging_set.failed_last = writer_seq;
+    sem_memory_post();
+    writer_failing = 1;
+}
+
+void prudynt_writer_close()
+{
+    fifo_close();
 }
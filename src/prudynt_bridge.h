@@ -1,5 +1,7 @@
 #pragma once
 
+#include "utils.h"
+
 #include <stddef.h>
 
 typedef struct {
@@ -27,4 +29,7 @@ typedef struct {
 } prudynt_command_t;
 
 int prudynt_load_imaging_state(prudynt_imaging_state_t *state);
+unsigned long long prudynt_imaging_generation();
 int prudynt_apply_imaging_changes(const prudynt_command_t *commands, size_t command_count, int timeout_ms);
+void prudynt_writer_tick(shm_t *shm, long long now);
+void prudynt_writer_close();
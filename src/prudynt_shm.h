@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Imaging state published by prudynt in shared memory.
+ *
+ * prudynt creates PRUDYNT_SHM_NAME (/dev/shm/prudynt_imaging) and keeps it
+ * up to date; onvif_simple_server maps it read-only instead of parsing
+ * /run/prudynt/imaging.json. When the object is missing or its header does
+ * not match, the JSON file is used.
+ *
+ * The fields are protected by a sequence lock. The writer increments seq
+ * (making it odd), updates fields, then increments seq again (making it even)
+ * with release ordering. A reader copies the fields between two reads of an
+ * even and unchanged seq. seq also tells readers that the state changed:
+ * the writer starts it from an even value derived from its start time, so
+ * that a restart doesn't repeat the values of the previous run.
+ */
+
+#include <stdint.h>
+
+#define PRUDYNT_SHM_NAME "/prudynt_imaging"
+
+#define PRUDYNT_SHM_MAGIC 0x474d4950 // "PIMG"
+#define PRUDYNT_SHM_VERSION 1
+
+enum {
+    PRUDYNT_SHM_BRIGHTNESS,
+    PRUDYNT_SHM_CONTRAST,
+    PRUDYNT_SHM_SATURATION,
+    PRUDYNT_SHM_SHARPNESS,
+    PRUDYNT_SHM_BACKLIGHT,
+    PRUDYNT_SHM_WIDE_DYNAMIC_RANGE,
+    PRUDYNT_SHM_TONE,
+    PRUDYNT_SHM_DEFOG,
+    PRUDYNT_SHM_NOISE_REDUCTION,
+    PRUDYNT_SHM_FIELDS
+};
+
+typedef struct {
+    uint32_t present; // 0 = not supported by the sensor
+    float value;      // Raw value, same scale as imaging.json
+    float min;
+    float max;
+} prudynt_shm_field_t;
+
+typedef struct {
+    uint32_t magic;   // PRUDYNT_SHM_MAGIC
+    uint16_t version; // PRUDYNT_SHM_VERSION
+    uint16_t size;    // sizeof(prudynt_shm_t)
+    uint32_t seq;     // Odd while the writer updates fields
+    uint32_t reserved;
+    prudynt_shm_field_t fields[PRUDYNT_SHM_FIELDS];
+} prudynt_shm_t;
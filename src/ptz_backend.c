@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ptz_backend.h"
+
+#include "log.h"
+#include "onvif_simple_server.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+extern service_context_t service_ctx;
+
+/*
+ * Motor backend.
+ * Every motor operation is one of the ptz command templates, expanded. When
+ * ptz.backend_socket is set, the command line is sent to a motors daemon over a
+ * unix stream socket that stays open for the rest of the request. The daemon
+ * replies with the command's output followed by a line holding a single ".".
+ * Without a daemon, or while it fails, commands run through the shell as
+ * before. A failed daemon is connected again with exponential backoff, so a
+ * motors daemon that restarts is picked up by onvif_notify_server.
+ */
+#define PTZ_BACKEND_TIMEOUT_MS 2000
+#define PTZ_BACKEND_RETRY_MIN_MS 1000
+#define PTZ_BACKEND_RETRY_MAX_MS 30000
+
+// onvif_notify_server drives the motors and the focus from two threads
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+static int backend_fd = -1;
+static int backend_failures;
+static long long backend_retry_ms; // No connection attempt before this time (monotonic_ms)
+static char backend_buf[1024];
+static size_t backend_buf_len;
+
+static void ptz_backend_close()
+{
+    if (backend_fd != -1)
+        close(backend_fd);
+    backend_fd = -1;
+    backend_buf_len = 0;
+}
+
+// Drop the connection and schedule the next attempt
+static void ptz_backend_fail()
+{
+    long long delay;
+
+    ptz_backend_close();
+    backend_failures++;
+    delay = (long long) PTZ_BACKEND_RETRY_MIN_MS << ((backend_failures < 16) ? backend_failures - 1 : 15);
+    if (delay > PTZ_BACKEND_RETRY_MAX_MS)
+        delay = PTZ_BACKEND_RETRY_MAX_MS;
+    backend_retry_ms = monotonic_ms() + delay;
+}
+
+static int ptz_backend_connect()
+{
+    struct sockaddr_un addr;
+    const char *path = service_ctx.ptz_node.backend_socket;
+
+    if (backend_fd != -1)
+        return 0;
+    if ((path == NULL) || (path[0] == '\0'))
+        return -1;
+    if ((backend_failures > 0) && (monotonic_ms() < backend_retry_ms))
+        return -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("PTZ backend socket path too long: %s", path);
+        ptz_backend_fail();
+        return -1;
+    }
+    memset(&addr, '\0', sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    backend_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (backend_fd == -1) {
+        ptz_backend_fail();
+        return -1;
+    }
+    if (connect(backend_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (backend_failures == 0) {
+            log_warn("PTZ backend %s unavailable, using command templates: %s", path, strerror(errno));
+        } else {
+            log_debug("PTZ backend %s still unavailable: %s", path, strerror(errno));
+        }
+        ptz_backend_fail();
+        return -1;
+    }
+    if (backend_failures > 0)
+        log_info("PTZ backend %s is available again after %d failures", path, backend_failures);
+    backend_failures = 0;
+    log_debug("Connected to PTZ backend %s", path);
+
+    return 0;
+}
+
+// Read one reply line (without the newline) from the daemon
+static int ptz_backend_read_line(char *line, size_t line_len)
+{
+    struct pollfd pfd;
+    char *nl;
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        nl = memchr(backend_buf, '\n', backend_buf_len);
+        if (nl != NULL) {
+            len = nl - backend_buf;
+            n = (len < line_len - 1) ? len : line_len - 1;
+            memcpy(line, backend_buf, n);
+            line[n] = '\0';
+            backend_buf_len -= len + 1;
+            memmove(backend_buf, nl + 1, backend_buf_len);
+            return 0;
+        }
+        if (backend_buf_len == sizeof(backend_buf))
+            return -1;
+
+        pfd.fd = backend_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, PTZ_BACKEND_TIMEOUT_MS) <= 0)
+            return -1;
+        n = read(backend_fd, backend_buf + backend_buf_len, sizeof(backend_buf) - backend_buf_len);
+        if (n <= 0)
+            return -1;
+        backend_buf_len += n;
+    }
+}
+
+static int ptz_backend_send(const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(backend_fd, data, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Run a command through the daemon; out (may be NULL) receives its output,
+ * whole lines only: the lines that don't fit are dropped.
+ * @return 0 on success, 1 if lines were dropped, -1 if the command was not
+ *         sent, -2 if it was sent but the reply was lost
+ */
+static int ptz_backend_exchange_locked(const char *command, char *out, size_t out_len)
+{
+    char line[1024];
+    size_t used = 0, len;
+    int truncated = 0;
+
+    if (strchr(command, '\n') != NULL)
+        return -1;
+    if (ptz_backend_connect() != 0)
+        return -1;
+
+    if ((ptz_backend_send(command, strlen(command)) != 0) || (ptz_backend_send("\n", 1) != 0)) {
+        log_warn("PTZ backend connection lost, using command templates");
+        ptz_backend_fail();
+        return -1;
+    }
+
+    if (out != NULL)
+        out[0] = '\0';
+    for (;;) {
+        if (ptz_backend_read_line(line, sizeof(line)) != 0) {
+            log_warn("No reply from PTZ backend to \"%s\", using command templates", command);
+            ptz_backend_fail();
+            return -2;
+        }
+        if (strcmp(line, ".") == 0)
+            return truncated;
+        if (out != NULL) {
+            len = strlen(line);
+            if (!truncated && (used + len + 1 < out_len)) {
+                memcpy(out + used, line, len);
+                out[used + len] = '\n';
+                used += len + 1;
+                out[used] = '\0';
+            } else {
+                truncated = 1;
+            }
+        }
+    }
+}
+
+static int ptz_backend_exchange(const char *command, char *out, size_t out_len)
+{
+    int ret;
+
+    pthread_mutex_lock(&backend_lock);
+    ret = ptz_backend_exchange_locked(command, out, out_len);
+    pthread_mutex_unlock(&backend_lock);
+
+    return ret;
+}
+
+/*
+ * Run a motor command
+ * @return 0 if the daemon replied or the command exited with status 0, -1 if
+ *         there is no such acknowledgement (failure, or a lost reply)
+ */
+int ptz_backend_run(const char *command)
+{
+    int ret = ptz_backend_exchange(command, NULL, 0);
+
+    // A command with a lost reply has reached the daemon: don't move twice
+    if (ret == -1)
+        return run_command_silent(command);
+    return (ret == 0) ? 0 : -1;
+}
+
+/*
+ * Run a motor command and collect its output. Output longer than out_len is
+ * cut after the last line that fits, so a caller never parses half a line.
+ */
+int ptz_backend_query(const char *command, char *out, size_t out_len)
+{
+    FILE *fp;
+    char *nl;
+    size_t n;
+    int ret;
+
+    ret = ptz_backend_exchange(command, out, out_len);
+    if (ret < 0) {
+        fp = popen(command, "r");
+        if (fp == NULL)
+            return -1;
+        n = fread(out, 1, out_len - 1, fp);
+        out[n] = '\0';
+        ret = (n == out_len - 1) && (fgetc(fp) != EOF);
+        pclose(fp);
+        if (ret) {
+            nl = strrchr(out, '\n');
+            if (nl != NULL) {
+                nl[1] = '\0';
+            } else {
+                out[0] = '\0';
+            }
+        }
+    }
+    if (ret)
+        log_warn("Output of \"%s\" is longer than %d bytes, the last lines are dropped", command, (int) out_len - 1);
+
+    return 0;
+}
+
+// Read the position in machine units (get_position prints x,y[,z])
+int ptz_backend_get_position(double *x, double *y, double *z)
+{
+    char out[256];
+
+    if (service_ctx.ptz_node.get_position == NULL)
+        return -6;
+    if (ptz_backend_query(service_ctx.ptz_node.get_position, out, sizeof(out)) != 0)
+        return -3;
+    if (out[0] == '\0')
+        return -4;
+    if (sscanf(out, "%lf,%lf,%lf", x, y, z) < 2)
+        return -5;
+
+    return 0;
+}
+
+// Read the moving flag (is_moving prints 1 or 0); idle when unknown
+int ptz_backend_is_moving(int *moving)
+{
+    char out[256];
+
+    *moving = 0;
+    if (service_ctx.ptz_node.is_moving == NULL)
+        return 0;
+    if (ptz_backend_query(service_ctx.ptz_node.is_moving, out, sizeof(out)) != 0)
+        return -7;
+    if (out[0] == '\0')
+        return -8;
+    if (sscanf(out, "%d", moving) < 1)
+        return -9;
+
+    return 0;
+}
+
+/*
+ * Read position and moving flag the way GetStatus reports them.
+ * @return 0 on success, the error of the failing read otherwise
+ */
+int ptz_backend_get_status(double *x, double *y, double *z, int *moving)
+{
+    int ret, ret_moving;
+
+    ret = ptz_backend_get_position(x, y, z);
+    ret_moving = ptz_backend_is_moving(moving);
+    if (ret_moving != 0)
+        ret = ret_moving;
+
+    return ret;
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PTZ_BACKEND_H
+#define PTZ_BACKEND_H
+
+#include <stddef.h>
+
+#define PTZ_BACKEND_OUTPUT_LEN 8192
+
+int ptz_backend_run(const char *command);
+int ptz_backend_query(const char *command, char *out, size_t out_len);
+int ptz_backend_get_position(double *x, double *y, double *z);
+int ptz_backend_is_moving(int *moving);
+int ptz_backend_get_status(double *x, double *y, double *z, int *moving);
+
+#endif // PTZ_BACKEND_H
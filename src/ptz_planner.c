@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ptz_planner.h"
+
+#include "log.h"
+#include "onvif_simple_server.h"
+#include "ptz_backend.h"
+
+#include <math.h>
+#include <stdio.h>
+
+extern service_context_t service_ctx;
+
+/*
+ * Trajectory planner for AbsoluteMove/RelativeMove.
+ * Instead of sending the target to the motors in one jump, the move follows
+ * a trapezoidal velocity profile: accelerate for ramp_ms, cruise at the
+ * requested Speed (a fraction of ptz.planner_max_speed_*), decelerate for
+ * ramp_ms. All axes share the same profile, scaled to their distance, so
+ * they start and arrive together. The PTZ thread of onvif_notify_server
+ * sends the planned position with jump_to_abs every ptz.planner_step_ms, and
+ * GetStatus reports the planned position while the move runs.
+ */
+
+// Duration of one axis moving distance d at speed v, reaching v in ramp_ms
+static double axis_duration_ms(double d, double v, double ramp_ms)
+{
+    if ((d == 0.0) || (v <= 0.0))
+        return 0.0;
+    if (d >= v * ramp_ms / 1000.0)
+        return d / v * 1000.0 + ramp_ms;
+    // Too short to reach v: triangular profile
+    return 2.0 * sqrt(d * ramp_ms * 1000.0 / v);
+}
+
+/*
+ * Start a move from from to to (machine units). An axis without a max speed
+ * follows the others.
+ * @return 0 if the move is planned, -1 if no moving axis has a max speed
+ */
+int ptz_plan_start(ptz_plan_shm_t *plan, const double from[3], const double to[3], double pt_speed, double zoom_speed, long long now)
+{
+    double max_speed[3] = {service_ctx.ptz_node.planner_max_speed_x, service_ctx.ptz_node.planner_max_speed_y, service_ctx.ptz_node.planner_max_speed_z};
+    double speed[3] = {pt_speed, pt_speed, zoom_speed};
+    double ramp_ms = service_ctx.ptz_node.planner_accel_ms;
+    double t, duration = 0.0;
+    int i, timed = 0;
+
+    for (i = 0; i < 3; i++) {
+        if ((to[i] != from[i]) && (max_speed[i] > 0.0))
+            timed = 1;
+    }
+    if (!timed)
+        return -1;
+
+    for (i = 0; i < 3; i++) {
+        plan->from[i] = from[i];
+        plan->to[i] = to[i];
+        // No Speed or 0: the default is full speed
+        if ((speed[i] <= 0.0) || (speed[i] > 1.0))
+            speed[i] = 1.0;
+        t = axis_duration_ms(fabs(to[i] - from[i]), speed[i] * max_speed[i], ramp_ms);
+        if (t > duration)
+            duration = t;
+    }
+
+    plan->duration_ms = (int) ceil(duration);
+    // A short move spends half its time accelerating, half decelerating
+    plan->ramp_ms = (ramp_ms * 2.0 > duration) ? plan->duration_ms / 2 : (int) ramp_ms;
+    plan->start_ms = now;
+    plan->next_step_ms = now;
+    plan->active = 1;
+
+    return 0;
+}
+
+/*
+ * Planned position at time now.
+ * @return 1 while the move runs, 0 once the target is reached
+ */
+int ptz_plan_position(const ptz_plan_shm_t *plan, long long now, double pos[3])
+{
+    double t = (double) (now - plan->start_ms);
+    double total = plan->duration_ms, ramp = plan->ramp_ms;
+    double peak, s;
+    int i;
+
+    if (t >= total) {
+        s = 1.0;
+    } else if (t <= 0.0) {
+        s = 0.0;
+    } else {
+        // Normalized profile: s goes from 0 to 1, peak is the cruise velocity
+        peak = 1.0 / (total - ramp);
+        if (ramp <= 0.0)
+            s = t / total;
+        else if (t < ramp)
+            s = 0.5 * peak * t * t / ramp;
+        else if (t <= total - ramp)
+            s = peak * (t - ramp / 2.0);
+        else
+            s = 1.0 - 0.5 * peak * (total - t) * (total - t) / ramp;
+    }
+
+    for (i = 0; i < 3; i++)
+        pos[i] = plan->from[i] + (plan->to[i] - plan->from[i]) * s;
+
+    return (t < total) ? 1 : 0;
+}
+
+// Send the next step of the active move (PTZ thread of onvif_notify_server)
+void ptz_plan_tick(shm_t *shm, long long now)
+{
+    ptz_plan_shm_t *plan = &shm->ptz.plan;
+    char sys_command[MAX_LEN];
+    double pos[3];
+    int running;
+
+    sem_memory_wait();
+    if (!plan->active || (now < plan->next_step_ms)) {
+        sem_memory_post();
+        return;
+    }
+    running = ptz_plan_position(plan, now, pos);
+    if (running)
+        plan->next_step_ms = now + service_ctx.ptz_node.planner_step_ms;
+    else
+        plan->active = 0;
+    sem_memory_post();
+
+    if (service_ctx.ptz_node.jump_to_abs == NULL)
+        return;
+    snprintf(sys_command, sizeof(sys_command), service_ctx.ptz_node.jump_to_abs, pos[0], pos[1], pos[2]);
+    log_debug("PTZ planner: executing %s", sys_command);
+    ptz_backend_run(sys_command);
+
+    sem_memory_wait();
+    shm->ptz.command_seq++;
+    shm->ptz.sample_ms = 0;
+    sem_memory_post();
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PTZ_PLANNER_H
+#define PTZ_PLANNER_H
+
+#include "utils.h"
+
+int ptz_plan_start(ptz_plan_shm_t *plan, const double from[3], const double to[3], double pt_speed, double zoom_speed, long long now);
+int ptz_plan_position(const ptz_plan_shm_t *plan, long long now, double pos[3]);
+void ptz_plan_tick(shm_t *shm, long long now);
+
+#endif // PTZ_PLANNER_H
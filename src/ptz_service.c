@@ -21,8 +21,12 @@
 #include "log.h"
 #include "mxml_wrapper.h"
 #include "onvif_simple_server.h"
+#include "ptz_backend.h"
+#include "ptz_planner.h"
 #include "utils.h"
 
+#include <json_config.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -57,6 +61,13 @@ int ptz_supports_zoom()
     return 0;
 }
 
+#define PTZ_DEFAULT_TIMEOUT_MS 5000 // DefaultPTZTimeout of the configuration templates
+#define PTZ_MAX_TIMEOUT_MS 100000   // PTZTimeout Max of GetConfigurationOptions
+#define PTZ_WORKER_ALIVE_MS 1000    // The PTZ thread of onvif_notify_server ticks every few ms
+
+#define PRESETS_CATALOG_FILE "/run/onvif_presets"
+#define PRESETS_INDEX_MAX 1024 // Higher preset numbers are looked up with a linear scan
+
 #define PTZ_URI_PANTILT_ABS_SPHERICAL "http://www.onvif.org/ver10/tptz/PanTiltSpaces/SphericalPositionSpace"
 #define PTZ_URI_PANTILT_ABS_GENERIC "http://www.onvif.org/ver10/tptz/PanTiltSpaces/PositionGenericSpace"
 #define PTZ_URI_ZOOM_ABS_GENERIC "http://www.onvif.org/ver10/tptz/ZoomSpaces/PositionGenericSpace"
@@ -75,61 +86,28 @@ static double clamp_double(double value, double min_v, double max_v)
     return value;
 }
 
-static double ptz_onvif_to_machine_units(
-    double value, double steps_min, double steps_max, double onvif_min, double onvif_max, bool invert, bool relative)
+#define PTZ_AXIS_X 0x01
+#define PTZ_AXIS_Y 0x02
+#define PTZ_AXIS_Z 0x04
+
+static double ptz_transform_axis(const ptz_transform_t *t, int i, double value)
 {
-    if (onvif_max <= onvif_min)
-        return steps_min;
-    double span_onvif = onvif_max - onvif_min;
-    double span_steps = steps_max - steps_min;
-    double scaled;
-    if (relative) {
-        if (invert) {
-            value = -value;
-        }
-        scaled = value * span_steps / span_onvif;
-        scaled = clamp_double(scaled, -span_steps, span_steps);
-    } else {
-        if (invert) {
-            value = onvif_max - (value - onvif_min);
-        }
-        scaled = (value - onvif_min) * span_steps / span_onvif + steps_min;
-        scaled = clamp_double(scaled, steps_min, steps_max);
-    }
-    return scaled;
+    return clamp_double(value * t->scale[i] + t->offset[i], t->min[i], t->max[i]);
 }
 
-static double ptz_machine_to_onvif_units(
-    double value, double steps_min, double steps_max, double onvif_min, double onvif_max, bool invert, bool relative)
+/*
+ * Convert the axes of v selected by mask (PTZ_AXIS_*) in place with one of
+ * the transforms precomputed in service_ctx.ptz_node when the configuration
+ * was loaded.
+ */
+static void ptz_transform(const ptz_transform_t *t, double v[3], int mask)
 {
-    if (steps_max <= steps_min)
-        return onvif_min;
-    double span_onvif = onvif_max - onvif_min;
-    double span_steps = steps_max - steps_min;
-    double scaled;
+    int i;
 
-    if (relative) {
-        scaled = value * span_onvif / span_steps;
-        scaled = clamp_double(scaled, -span_onvif, span_onvif);
-        if (invert) {
-            scaled = -scaled;
-        }
-    } else {
-        scaled = (value - steps_min) * span_onvif / span_steps + onvif_min;
-        scaled = clamp_double(scaled, onvif_min, onvif_max);
-        if (invert) {
-            scaled = onvif_max - (scaled - onvif_min);
-        }
+    for (i = 0; i < 3; i++) {
+        if (mask & (1 << i))
+            v[i] = ptz_transform_axis(t, i, v[i]);
     }
-    return scaled;
-}
-
-static double ptz_fov_to_machine_units(
-    double value, double steps_min, double steps_max, double onvif_min, double onvif_max, double fov_span, bool invert)
-{
-    double scaled;
-    scaled = value * fov_span / 2.0;
-    return ptz_onvif_to_machine_units(scaled, steps_min, steps_max, onvif_min, onvif_max, invert, true);
 }
 
 static void ptz_apply_reverse(double *onvif_pan, double *onvif_tilt)
@@ -149,61 +127,406 @@ static int ptz_space_matches(const char *space_attr, const char *expected_uri)
     return strcmp(space_attr, expected_uri) == 0;
 }
 
-int init_presets()
+/*
+ * PTZ state cache in the shared memory of onvif_notify_server.
+ * The daemon samples the motors (see ptz_state_thread) and every motor
+ * command bumps command_seq, so GetStatus is a memory read while an NVR polls
+ * it during a move.
+ */
+
+// @return 0 if a sample fresher than ptz.status_cache_ms was found
+static int ptz_state_read(double *x, double *y, double *z, int *moving, int *status)
 {
-    FILE *fp;
-    char out[MAX_LEN];
-    int i, num;
-    double x, y, z;
-    char name[MAX_LEN];
-    char *p;
+    shm_t *shm;
+    int ret = -1;
 
-    presets.count = 0;
-    presets.items = (preset_t *) malloc(sizeof(preset_t));
+    if (service_ctx.ptz_node.status_cache_ms <= 0)
+        return -1;
+    shm = shared_memory_attach();
+    if (shm == NULL)
+        return -1;
 
-    // Run command that returns to stdout the list of the presets in the form number=name,pan,tilt,zoom (zoom is optional)
-    if (service_ctx.ptz_node.get_presets == NULL) {
+    sem_memory_wait();
+    if ((shm->ptz.sample_ms != 0) && (monotonic_ms() - shm->ptz.sample_ms <= service_ctx.ptz_node.status_cache_ms)) {
+        *x = shm->ptz.x;
+        *y = shm->ptz.y;
+        *z = shm->ptz.z;
+        *moving = shm->ptz.moving;
+        *status = shm->ptz.status;
+        ret = 0;
+    }
+    sem_memory_post();
+
+    return ret;
+}
+
+// Share a state read directly from the motors with the next requests
+static void ptz_state_store(double x, double y, double z, int moving, int status)
+{
+    shm_t *shm = shared_memory_attach();
+
+    if (shm == NULL)
+        return;
+
+    sem_memory_wait();
+    shm->ptz.x = x;
+    shm->ptz.y = y;
+    shm->ptz.z = z;
+    shm->ptz.moving = moving;
+    shm->ptz.status = status;
+    shm->ptz.sample_ms = monotonic_ms();
+    sem_memory_post();
+}
+
+/*
+ * Run a motor command and tell the sampler the state is about to change.
+ * Pending ContinuousMove/Stop commands are dropped: this one supersedes them.
+ * @return 0 if the command was acknowledged, see ptz_backend_run()
+ */
+static int ptz_run(const char *command)
+{
+    shm_t *shm = shared_memory_attach();
+    int ret;
+
+    if (shm != NULL) {
+        sem_memory_wait();
+        shm->ptz.pending_pantilt[0] = '\0';
+        shm->ptz.pending_zoom[0] = '\0';
+        shm->ptz.plan.active = 0;
+        sem_memory_post();
+    }
+
+    ret = ptz_backend_run(command);
+
+    if (shm == NULL)
+        return ret;
+    sem_memory_wait();
+    shm->ptz.command_seq++;
+    shm->ptz.sample_ms = 0;
+    sem_memory_post();
+
+    return ret;
+}
+
+static int ptz_post_slot(char *slot, const char *command)
+{
+    if (command == NULL)
+        return 0;
+    if (strlen(command) >= PTZ_COMMAND_LEN)
         return -1;
+    strcpy(slot, command);
+    return 0;
+}
+
+/*
+ * Hand ContinuousMove/Stop commands to the PTZ thread of onvif_notify_server.
+ * Each axis has a latest-wins mailbox: a command still pending when the next
+ * request arrives is replaced, and the thread applies at most one batch per
+ * ptz.move_min_interval_ms, so joystick bursts don't queue up behind the
+ * motors. NULL leaves an axis mailbox alone, "" empties it. Without the
+ * daemon the commands run right away.
+ */
+static void ptz_post(const char *pantilt_command, const char *zoom_command)
+{
+    shm_t *shm = shared_memory_attach();
+    int posted = 0;
+
+    if (shm != NULL) {
+        sem_memory_wait();
+        if ((monotonic_ms() - shm->ptz.worker_ms <= PTZ_WORKER_ALIVE_MS)
+            && (ptz_post_slot(shm->ptz.pending_pantilt, pantilt_command) == 0)
+            && (ptz_post_slot(shm->ptz.pending_zoom, zoom_command) == 0)) {
+            shm->ptz.plan.active = 0;
+            posted = 1;
+        }
+        sem_memory_post();
     }
-    fp = popen(service_ctx.ptz_node.get_presets, "r");
+    if (posted)
+        return;
+
+    if ((pantilt_command != NULL) && (pantilt_command[0] != '\0'))
+        ptz_run(pantilt_command);
+    if ((zoom_command != NULL) && (zoom_command[0] != '\0'))
+        ptz_run(zoom_command);
+}
+
+static double ptz_clamp(double v, double a, double b)
+{
+    double lo = (a < b) ? a : b;
+    double hi = (a < b) ? b : a;
+
+    return (v < lo) ? lo : ((v > hi) ? hi : v);
+}
+
+/*
+ * Hand an AbsoluteMove/RelativeMove to the trajectory planner (see
+ * ptz_planner.c). target holds machine units, or deltas when relative; axes
+ * that are not present stay where they are.
+ * @return 0 if the planner runs the move, -1 to send it to the motors directly
+ */
+static int ptz_plan_move(const double target[3], int pantilt, int zoom, int relative, double pt_speed, double zoom_speed)
+{
+    shm_t *shm = shared_memory_attach();
+    double from[3], to[3];
+    int moving, status, have_position, duration_ms, i;
+    long long now;
+
+    if ((service_ctx.ptz_node.planner_step_ms <= 0) || (service_ctx.ptz_node.jump_to_abs == NULL) || (shm == NULL))
+        return -1;
+
+    // Start from where the running move is now, or from the motors
+    sem_memory_wait();
+    have_position = shm->ptz.plan.active;
+    if (have_position)
+        ptz_plan_position(&shm->ptz.plan, monotonic_ms(), from);
+    sem_memory_post();
+    if (!have_position) {
+        from[2] = 1.0;
+        if (ptz_state_read(&from[0], &from[1], &from[2], &moving, &status) != 0) {
+            status = ptz_backend_get_status(&from[0], &from[1], &from[2], &moving);
+            ptz_state_store(from[0], from[1], from[2], moving, status);
+        }
+        if (status != 0)
+            return -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (((i < 2) && pantilt) || ((i == 2) && zoom))
+            to[i] = relative ? from[i] + target[i] : target[i];
+        else
+            to[i] = from[i];
+    }
+    to[0] = ptz_clamp(to[0], service_ctx.ptz_node.min_step_x, service_ctx.ptz_node.max_step_x);
+    to[1] = ptz_clamp(to[1], service_ctx.ptz_node.min_step_y, service_ctx.ptz_node.max_step_y);
+    to[2] = ptz_clamp(to[2], service_ctx.ptz_node.min_step_z, service_ctx.ptz_node.max_step_z);
+
+    sem_memory_wait();
+    now = monotonic_ms();
+    if (now - shm->ptz.worker_ms > PTZ_WORKER_ALIVE_MS) {
+        sem_memory_post();
+        return -1;
+    }
+    // Without a max speed on the moving axes the move can't be timed
+    if (ptz_plan_start(&shm->ptz.plan, from, to, pt_speed, zoom_speed, now) != 0) {
+        sem_memory_post();
+        return -1;
+    }
+    shm->ptz.pending_pantilt[0] = '\0';
+    shm->ptz.pending_zoom[0] = '\0';
+    duration_ms = shm->ptz.plan.duration_ms;
+    sem_memory_post();
+
+    log_debug("PTZ planner: %.2f,%.2f,%.2f -> %.2f,%.2f,%.2f in %d ms", from[0], from[1], from[2], to[0], to[1], to[2], duration_ms);
+
+    return 0;
+}
+
+// Planned position while a trajectory runs. @return 0 if there is one
+static int ptz_plan_read(double *x, double *y, double *z, int *moving)
+{
+    shm_t *shm = shared_memory_attach();
+    double pos[3];
+    int ret = -1;
+
+    if ((shm == NULL) || (service_ctx.ptz_node.planner_step_ms <= 0))
+        return -1;
+
+    sem_memory_wait();
+    if (shm->ptz.plan.active) {
+        *moving = ptz_plan_position(&shm->ptz.plan, monotonic_ms(), pos);
+        *x = pos[0];
+        *y = pos[1];
+        *z = pos[2];
+        ret = 0;
+    }
+    sem_memory_post();
+
+    return ret;
+}
+
+/*
+ * Schedule the automatic stop onvif_notify_server performs when a
+ * ContinuousMove Timeout elapses. Per axis: > 0 stops it after that many ms,
+ * 0 cancels the pending stop, -1 leaves it as it is.
+ */
+static void ptz_schedule_stop(int pantilt_ms, int zoom_ms)
+{
+    shm_t *shm = shared_memory_attach();
+    long long now = monotonic_ms();
+
+    if (shm == NULL) {
+        if ((pantilt_ms > 0) || (zoom_ms > 0))
+            log_debug("PTZ: onvif_notify_server not running, Timeout not enforced");
+        return;
+    }
+
+    sem_memory_wait();
+    if (pantilt_ms >= 0)
+        shm->ptz.stop_pantilt_ms = (pantilt_ms > 0) ? now + pantilt_ms : 0;
+    if (zoom_ms >= 0)
+        shm->ptz.stop_zoom_ms = (zoom_ms > 0) ? now + zoom_ms : 0;
+    sem_memory_post();
+}
+
+/*
+ * Preset catalog.
+ * The get_presets output is kept in PRESETS_CATALOG_FILE so GetPresets,
+ * GotoPreset and SetPreset don't run the backend on every request. Its first
+ * line holds the generation it was read at: SetPreset/RemovePreset bump the
+ * generation in shared memory and remove the file, so a catalog read while a
+ * preset was changing is never used.
+ */
+static unsigned int presets_generation()
+{
+    shm_t *shm = shared_memory_attach();
+    unsigned int generation;
+
+    if (shm == NULL)
+        return 0;
+    sem_memory_wait();
+    generation = shm->ptz.presets_generation;
+    sem_memory_post();
+
+    return generation;
+}
+
+// @return 0 if output holds a catalog of the current generation
+static int presets_catalog_load(unsigned int generation, char *output, size_t output_len)
+{
+    FILE *fp;
+    unsigned int file_generation;
+    size_t n;
+
+    fp = fopen(PRESETS_CATALOG_FILE, "r");
+    if (fp == NULL)
+        return -1;
+    if ((fscanf(fp, "#generation %u\n", &file_generation) != 1) || (file_generation != generation)) {
+        fclose(fp);
+        return -1;
+    }
+    n = fread(output, 1, output_len - 1, fp);
+    output[n] = '\0';
+    fclose(fp);
+
+    return 0;
+}
+
+static void presets_catalog_save(unsigned int generation, const char *output)
+{
+    char tmp_file[] = PRESETS_CATALOG_FILE ".XXXXXX";
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(tmp_file);
+    if (fd == -1)
+        return;
+    fp = fdopen(fd, "w");
     if (fp == NULL) {
-        return -2;
-    } else {
-        while (fgets(out, sizeof(out), fp)) {
-            p = out;
-            name[0] = '\0';
-            x = -1.0;
-            y = -1.0;
-            z = 1.0;
-            while ((p = strchr(p, ',')) != NULL) {
-                *p++ = ' ';
-            }
-            if (sscanf(out, "%d=%s %lf %lf %lf", &num, name, &x, &y, &z) == 0) {
-                pclose(fp);
-                return -3;
-            } else {
-                if (strlen(name) != 0) {
-                    presets.count++;
-                    presets.items = (preset_t *) realloc(presets.items, sizeof(preset_t) * presets.count);
-                    presets.items[presets.count - 1].name = (char *) malloc(strlen(name) + 1);
-                    strcpy(presets.items[presets.count - 1].name, name);
-                    presets.items[presets.count - 1].number = num;
-                    presets.items[presets.count - 1].x = x;
-                    presets.items[presets.count - 1].y = y;
-                    presets.items[presets.count - 1].z = z;
+        close(fd);
+        unlink(tmp_file);
+        return;
+    }
+    fprintf(fp, "#generation %u\n%s", generation, output);
+    if (fclose(fp) != 0) {
+        unlink(tmp_file);
+        return;
+    }
+    // Atomic replace: readers see the old catalog or the new one
+    if (rename(tmp_file, PRESETS_CATALOG_FILE) != 0)
+        unlink(tmp_file);
+}
+
+// Retire the catalog after the backend presets changed
+static void presets_invalidate()
+{
+    shm_t *shm = shared_memory_attach();
+
+    if (shm != NULL) {
+        sem_memory_wait();
+        shm->ptz.presets_generation++;
+        sem_memory_post();
+    }
+    unlink(PRESETS_CATALOG_FILE);
+}
+
+/*
+ * Wait until get_presets lists the preset just stored (number -1 = any
+ * number), instead of sleeping a fixed time. Only used when set_preset gave
+ * no acknowledgement (see ptz_backend_run()). A backend that stores the preset
+ * before set_preset returns is seen by the first query; slower ones are
+ * polled with a growing interval up to ptz.set_preset_timeout_ms.
+ * When an existing preset is overwritten, previous holds its old entry: the
+ * same number and name are listed before the new position is stored, so the
+ * wait goes on until the listed position differs from the old one, unless
+ * the camera is still at the old position and the listing can't change.
+ * @return 0 when the preset is listed, -1 on timeout
+ */
+static int presets_wait_stored(int number, const char *name, const preset_t *previous)
+{
+    char output[PTZ_BACKEND_OUTPUT_LEN];
+    char line_name[MAX_LEN];
+    char *out, *saveptr, *p;
+    long long deadline;
+    int num, delay_ms = 10;
+    double x, y, z;
+
+    z = 1.0;
+    if ((previous != NULL) && (ptz_backend_get_position(&x, &y, &z) == 0) && (x == previous->x) && (y == previous->y) && (z == previous->z)) {
+        // Overwritten with the same position: only the name may change
+        previous = NULL;
+    }
+
+    deadline = monotonic_ms() + service_ctx.ptz_node.set_preset_timeout_ms;
+    for (;;) {
+        if (ptz_backend_query(service_ctx.ptz_node.get_presets, output, sizeof(output)) == 0) {
+            for (out = strtok_r(output, "\n", &saveptr); out != NULL; out = strtok_r(NULL, "\n", &saveptr)) {
+                // As init_presets(): a name longer than MAX_LEN is not a preset
+                if (strlen(out) >= MAX_LEN)
+                    continue;
+                for (p = out; (p = strchr(p, ',')) != NULL;)
+                    *p++ = ' ';
+                x = -1.0;
+                y = -1.0;
+                z = 1.0;
+                if ((sscanf(out, "%d=%1023s %lf %lf %lf", &num, line_name, &x, &y, &z) >= 2) && ((number < 0) || (num == number))
+                    && (strcasecmp(line_name, name) == 0)) {
+                    if ((previous == NULL) || (strcasecmp(previous->name, name) != 0) || (x != previous->x) || (y != previous->y)
+                        || (z != previous->z)) {
+                        return 0;
+                    }
                 }
             }
         }
-        pclose(fp);
+        if (monotonic_ms() + delay_ms > deadline)
+            break;
+        usleep(delay_ms * 1000);
+        if (delay_ms < 100)
+            delay_ms *= 2;
+    }
+    if (previous != NULL) {
+        log_debug("Preset %s position unchanged after %d ms", name, service_ctx.ptz_node.set_preset_timeout_ms);
+    } else {
+        log_warn("Preset %s not listed by get_presets after %d ms", name, service_ctx.ptz_node.set_preset_timeout_ms);
     }
 
-    for (i = 0; i < presets.count; i++) {
-        if (presets.items[i].name != NULL) {
-            log_debug("Preset %d - %d - %s - %f - %f", i, presets.items[i].number, presets.items[i].name, presets.items[i].x, presets.items[i].y);
+    return -1;
+}
+
+// Lookup of a preset by number (the number of its token), O(1) with the index
+static preset_t *preset_by_number(int number)
+{
+    int i;
+
+    if (presets.index == NULL) {
+        for (i = 0; i < presets.count; i++) {
+            if (presets.items[i].number == number)
+                return &presets.items[i];
         }
+        return NULL;
     }
-
-    return 0;
+    if ((number < 0) || (number >= presets.index_len) || (presets.index[number] < 0))
+        return NULL;
+    return &presets.items[presets.index[number]];
 }
 
 void destroy_presets()
@@ -214,14 +537,124 @@ void destroy_presets()
         free(presets.items[i].name);
     }
     free(presets.items);
+    free(presets.index);
+    presets.count = 0;
+    presets.items = NULL;
+    presets.index = NULL;
+    presets.index_len = 0;
+}
+
+int init_presets()
+{
+    char output[PTZ_BACKEND_OUTPUT_LEN];
+    char *out, *saveptr;
+    unsigned int generation;
+    int i, num, lines;
+    double x, y, z;
+    char name[MAX_LEN];
+    char *p;
+
+    presets.count = 0;
+    presets.items = NULL;
+    presets.index = NULL;
+    presets.index_len = 0;
+
+    // Run command that returns to stdout the list of the presets in the form number=name,pan,tilt,zoom (zoom is optional)
+    if (service_ctx.ptz_node.get_presets == NULL) {
+        return -1;
+    }
+    generation = presets_generation();
+    if (presets_catalog_load(generation, output, sizeof(output)) != 0) {
+        if (ptz_backend_query(service_ctx.ptz_node.get_presets, output, sizeof(output)) != 0) {
+            return -2;
+        }
+        presets_catalog_save(generation, output);
+    }
+
+    lines = 1;
+    for (p = output; *p != '\0'; p++) {
+        if (*p == '\n')
+            lines++;
+    }
+    presets.items = (preset_t *) malloc(sizeof(preset_t) * lines);
+    if (presets.items == NULL) {
+        log_error("Failed to allocate memory for %d presets", lines);
+        return -4;
+    }
+
+    for (out = strtok_r(output, "\n", &saveptr); out != NULL; out = strtok_r(NULL, "\n", &saveptr)) {
+        // Lines were read with fgets(MAX_LEN) before: longer ones don't fit name
+        if (strlen(out) >= MAX_LEN) {
+            log_warn("Skipping get_presets line longer than %d bytes", MAX_LEN - 1);
+            continue;
+        }
+        p = out;
+        name[0] = '\0';
+        x = -1.0;
+        y = -1.0;
+        z = 1.0;
+        while ((p = strchr(p, ',')) != NULL) {
+            *p++ = ' ';
+        }
+        if (sscanf(out, "%d=%1023s %lf %lf %lf", &num, name, &x, &y, &z) == 0) {
+            destroy_presets();
+            return -3;
+        } else {
+            if (strlen(name) != 0) {
+                presets.items[presets.count].name = strdup(name);
+                if (presets.items[presets.count].name == NULL) {
+                    log_error("Failed to allocate memory for preset %s", name);
+                    destroy_presets();
+                    return -4;
+                }
+                presets.items[presets.count].number = num;
+                presets.items[presets.count].x = x;
+                presets.items[presets.count].y = y;
+                presets.items[presets.count].z = z;
+                presets.count++;
+                if (num >= presets.index_len)
+                    presets.index_len = num + 1;
+            }
+        }
+    }
+
+    // Without the index (sparse numbers or no memory), preset_by_number() scans the list
+    if ((presets.index_len > 0) && (presets.index_len <= PRESETS_INDEX_MAX)) {
+        presets.index = (int *) malloc(sizeof(int) * presets.index_len);
+    }
+    if (presets.index != NULL) {
+        for (i = 0; i < presets.index_len; i++)
+            presets.index[i] = -1;
+    } else {
+        presets.index_len = 0;
+    }
+    for (i = 0; i < presets.count; i++) {
+        if ((presets.index != NULL) && (presets.items[i].number >= 0))
+            presets.index[presets.items[i].number] = i;
+        log_debug("Preset %d - %d - %s - %f - %f", i, presets.items[i].number, presets.items[i].name, presets.items[i].x, presets.items[i].y);
+    }
+
+    return 0;
 }
 
 // ---- Preset Tours storage ----
 
+typedef struct {
+    int preset;        // Preset number
+    double pt_speed;   // Speed/PanTilt, < 0 = move_preset at the motors' speed
+    double zoom_speed; // Speed/Zoom, < 0 = not set
+    int stay_ms;       // StayTime
+} tour_spot_t;
+
 typedef struct {
     char token[64];
     char name[64];
     char status[16]; // Idle/Touring/Paused
+    int recurring_time;        // Laps, 0 = until stopped
+    int recurring_duration_ms; // 0 = no limit
+    int backward;              // Direction
+    int spots_num;
+    tour_spot_t spots[PTZ_TOUR_MAX_SPOTS];
 } preset_tour_t;
 
 static preset_tour_t *g_tours = NULL;
@@ -233,181 +666,415 @@ static const char *preset_tours_file_path()
     return DEFAULT_CONF_DIR "/preset_tours.json";
 }
 
+// String member "key" of a tour entry, or its legacy TitleCase spelling
+static const char *tour_json_string(JsonValue *node, const char *key, const char *legacy_key)
+{
+    JsonValue *item = get_object_item(node, key);
+
+    if (item == NULL)
+        item = get_object_item(node, legacy_key);
+    if (item && item->type == JSON_STRING)
+        return item->value.string;
+    return NULL;
+}
+
+static double tour_json_number(JsonValue *node, const char *key, double def)
+{
+    JsonValue *item = get_object_item(node, key);
+
+    if (item && item->type == JSON_NUMBER)
+        return item->value.number.real;
+    return def;
+}
+
+static void tour_load_entry(preset_tour_t *tour, JsonValue *entry)
+{
+    JsonValue *spots, *node;
+    const char *value;
+    tour_spot_t *spot;
+    int i, n;
+
+    memset(tour, 0, sizeof(preset_tour_t));
+    value = tour_json_string(entry, "token", "Token");
+    if (value)
+        strncpy(tour->token, value, sizeof(tour->token) - 1);
+    value = tour_json_string(entry, "name", "Name");
+    if (value)
+        strncpy(tour->name, value, sizeof(tour->name) - 1);
+    value = tour_json_string(entry, "status", "Status");
+    strncpy(tour->status, (value && value[0]) ? value : "Idle", sizeof(tour->status) - 1);
+    tour->recurring_time = (int) tour_json_number(entry, "recurring_time", 0);
+    tour->recurring_duration_ms = (int) tour_json_number(entry, "recurring_duration_ms", 0);
+    tour->backward = (int) tour_json_number(entry, "backward", 0);
+
+    spots = get_object_item(entry, "spots");
+    if (!spots || spots->type != JSON_ARRAY)
+        return;
+    n = get_array_size(spots);
+    for (i = 0; (i < n) && (tour->spots_num < PTZ_TOUR_MAX_SPOTS); i++) {
+        node = get_array_item(spots, i);
+        if (!node || node->type != JSON_OBJECT)
+            continue;
+        spot = &tour->spots[tour->spots_num++];
+        spot->preset = (int) tour_json_number(node, "preset", -1);
+        spot->pt_speed = tour_json_number(node, "pt_speed", -1.0);
+        spot->zoom_speed = tour_json_number(node, "zoom_speed", -1.0);
+        spot->stay_ms = (int) tour_json_number(node, "stay_ms", 0);
+    }
+}
+
+/*
+ * Index of the tours by token: open addressing, at most half full, so a
+ * lookup doesn't scan every tour. Rebuilt whenever tours are added or
+ * removed.
+ */
+static int *g_tours_index = NULL;
+static unsigned int g_tours_index_size = 0;
+
+static unsigned int tour_token_hash(const char *token)
+{
+    unsigned int h = 2166136261U; // FNV-1a
+
+    for (; *token != '\0'; token++) {
+        h ^= (unsigned char) *token;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void tours_reindex()
+{
+    unsigned int size = 16, slot;
+    int i;
+
+    while (size < (unsigned int) g_tours_count * 2)
+        size *= 2;
+    if (size != g_tours_index_size) {
+        free(g_tours_index);
+        g_tours_index = (int *) malloc(sizeof(int) * size);
+        g_tours_index_size = (g_tours_index != NULL) ? size : 0;
+    }
+    for (slot = 0; slot < g_tours_index_size; slot++)
+        g_tours_index[slot] = -1;
+    for (i = 0; (i < g_tours_count) && (g_tours_index_size > 0); i++) {
+        slot = tour_token_hash(g_tours[i].token) & (g_tours_index_size - 1);
+        while (g_tours_index[slot] != -1)
+            slot = (slot + 1) & (g_tours_index_size - 1);
+        g_tours_index[slot] = i;
+    }
+}
+
 static void tours_ensure_loaded()
 {
+    JsonValue *doc, *list;
+    int i, n;
+
     if (g_tours_loaded)
         return;
     g_tours_loaded = 1;
-    FILE *f = fopen(preset_tours_file_path(), "r");
-    if (!f)
-        return;
-    fseek(f, 0, SEEK_END);
-    long len = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    if (len <= 0 || len > 1 << 20) {
-        fclose(f);
-        return;
-    }
-    char *buf = (char *) malloc(len + 1);
-    if (!buf) {
-        fclose(f);
+
+    doc = load_config(preset_tours_file_path());
+    if (doc == NULL) {
+        tours_reindex();
         return;
     }
-    fread(buf, 1, len, f);
-    buf[len] = '\0';
-    fclose(f);
-
-    // Pass 1: TitleCase keys (Token/Name/Status)
-    int before = g_tours_count;
-    char *p = buf;
-    while ((p = strstr(p, "\"Token\"")) != NULL) {
-        char token[64] = {0}, name[64] = {0}, status[16] = {0};
-        char *colon = strchr(p, ':');
-        if (!colon)
-            break;
-        char *valq1 = strchr(colon, '"');
-        if (!valq1)
-            break;
-        char *valq2 = strchr(valq1 + 1, '"');
-        if (!valq2)
-            break;
-        size_t tlen = (size_t) (valq2 - (valq1 + 1));
-        if (tlen >= sizeof(token))
-            tlen = sizeof(token) - 1;
-        strncpy(token, valq1 + 1, tlen);
-        token[tlen] = '\0';
-        // Name (optional)
-        char *np = strstr(p, "\"Name\"");
-        if (np) {
-            char *ncolon = strchr(np, ':');
-            char *nq1 = ncolon ? strchr(ncolon, '"') : NULL;
-            char *nq2 = nq1 ? strchr(nq1 + 1, '"') : NULL;
-            if (nq1 && nq2) {
-                size_t nlen = (size_t) (nq2 - (nq1 + 1));
-                if (nlen >= sizeof(name))
-                    nlen = sizeof(name) - 1;
-                strncpy(name, nq1 + 1, nlen);
-                name[nlen] = '\0';
-            }
-        }
-        // Status (optional)
-        char *sp = strstr(p, "\"Status\"");
-        if (sp) {
-            char *scolon = strchr(sp, ':');
-            char *sq1 = scolon ? strchr(scolon, '"') : NULL;
-            char *sq2 = sq1 ? strchr(sq1 + 1, '"') : NULL;
-            if (sq1 && sq2) {
-                size_t slen = (size_t) (sq2 - (sq1 + 1));
-                if (slen >= sizeof(status))
-                    slen = sizeof(status) - 1;
-                strncpy(status, sq1 + 1, slen);
-                status[slen] = '\0';
-            }
-        }
-        if (token[0]) {
-            g_tours = (preset_tour_t *) realloc(g_tours, sizeof(preset_tour_t) * (g_tours_count + 1));
-            memset(&g_tours[g_tours_count], 0, sizeof(preset_tour_t));
-            strncpy(g_tours[g_tours_count].token, token, sizeof(g_tours[g_tours_count].token) - 1);
-            if (name[0])
-                strncpy(g_tours[g_tours_count].name, name, sizeof(g_tours[g_tours_count].name) - 1);
-            strncpy(g_tours[g_tours_count].status, status[0] ? status : "Idle", sizeof(g_tours[g_tours_count].status) - 1);
-            g_tours_count++;
-        }
-        p = valq2 + 1;
-    }
-
-    // Pass 2: lowercase keys (token/name/status) only if nothing loaded in pass 1
-    if (g_tours_count == before) {
-        p = buf;
-        while ((p = strstr(p, "\"token\"")) != NULL) {
-            char token[64] = {0}, name[64] = {0}, status[16] = {0};
-            char *colon = strchr(p, ':');
-            if (!colon)
-                break;
-            char *valq1 = strchr(colon, '"');
-            if (!valq1)
-                break;
-            char *valq2 = strchr(valq1 + 1, '"');
-            if (!valq2)
-                break;
-            size_t tlen = (size_t) (valq2 - (valq1 + 1));
-            if (tlen >= sizeof(token))
-                tlen = sizeof(token) - 1;
-            strncpy(token, valq1 + 1, tlen);
-            token[tlen] = '\0';
-            // name (optional)
-            char *np = strstr(p, "\"name\"");
-            if (np) {
-                char *ncolon = strchr(np, ':');
-                char *nq1 = ncolon ? strchr(ncolon, '"') : NULL;
-                char *nq2 = nq1 ? strchr(nq1 + 1, '"') : NULL;
-                if (nq1 && nq2) {
-                    size_t nlen = (size_t) (nq2 - (nq1 + 1));
-                    if (nlen >= sizeof(name))
-                        nlen = sizeof(name) - 1;
-                    strncpy(name, nq1 + 1, nlen);
-                    name[nlen] = '\0';
-                }
-            }
-            // status (optional)
-            char *sp = strstr(p, "\"status\"");
-            if (sp) {
-                char *scolon = strchr(sp, ':');
-                char *sq1 = scolon ? strchr(scolon, '"') : NULL;
-                char *sq2 = sq1 ? strchr(sq1 + 1, '"') : NULL;
-                if (sq1 && sq2) {
-                    size_t slen = (size_t) (sq2 - (sq1 + 1));
-                    if (slen >= sizeof(status))
-                        slen = sizeof(status) - 1;
-                    strncpy(status, sq1 + 1, slen);
-                    status[slen] = '\0';
-                }
-            }
-            if (token[0]) {
-                g_tours = (preset_tour_t *) realloc(g_tours, sizeof(preset_tour_t) * (g_tours_count + 1));
-                memset(&g_tours[g_tours_count], 0, sizeof(preset_tour_t));
-                strncpy(g_tours[g_tours_count].token, token, sizeof(g_tours[g_tours_count].token) - 1);
-                if (name[0])
-                    strncpy(g_tours[g_tours_count].name, name, sizeof(g_tours[g_tours_count].name) - 1);
-                strncpy(g_tours[g_tours_count].status, status[0] ? status : "Idle", sizeof(g_tours[g_tours_count].status) - 1);
+    list = get_object_item(doc, "preset_tours");
+    if (list && list->type == JSON_ARRAY) {
+        n = get_array_size(list);
+        if (n > 0)
+            g_tours = (preset_tour_t *) malloc(sizeof(preset_tour_t) * n);
+        for (i = 0; (i < n) && (g_tours != NULL); i++) {
+            JsonValue *entry = get_array_item(list, i);
+            if (!entry || entry->type != JSON_OBJECT)
+                continue;
+            tour_load_entry(&g_tours[g_tours_count], entry);
+            if (g_tours[g_tours_count].token[0])
                 g_tours_count++;
-            }
-            p = valq2 + 1;
         }
     }
+    free_json_value(doc);
+    tours_reindex();
+}
 
-    free(buf);
+static void tours_fprint_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if ((*s == '"') || (*s == '\\'))
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20)
+            fprintf(f, "\\u%04x", (unsigned char) *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
 }
 
+/*
+ * Write the tours to a temporary file and rename it over the old one, so a
+ * power cut leaves either the previous or the new file, never half of one.
+ */
 static void tours_save()
 {
+    char tmp_file[] = DEFAULT_CONF_DIR "/preset_tours.json.XXXXXX";
+    FILE *f;
+    int fd, ok;
+
     // Ensure directory exists
     mkdir(DEFAULT_CONF_DIR, 0755);
-    FILE *f = fopen(preset_tours_file_path(), "w");
-    if (!f)
+    fd = mkstemp(tmp_file);
+    if (fd == -1) {
+        log_error("Unable to create %s", tmp_file);
+        return;
+    }
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp_file);
         return;
+    }
     fprintf(f, "{\n  \"preset_tours\": [\n");
     for (int i = 0; i < g_tours_count; i++) {
+        fprintf(f, "    { \"token\": ");
+        tours_fprint_string(f, g_tours[i].token);
+        fprintf(f, ", \"name\": ");
+        tours_fprint_string(f, g_tours[i].name);
+        fprintf(f, ", \"status\": ");
+        tours_fprint_string(f, g_tours[i].status[0] ? g_tours[i].status : "Idle");
         fprintf(f,
-                "    { \"token\": \"%s\", \"name\": \"%s\", \"status\": \"%s\" }%s\n",
-                g_tours[i].token,
-                g_tours[i].name,
-                g_tours[i].status[0] ? g_tours[i].status : "Idle",
-                (i == g_tours_count - 1) ? "" : ",");
+                ",\n      \"recurring_time\": %d, \"recurring_duration_ms\": %d, \"backward\": %d,\n"
+                "      \"spots\": [",
+                g_tours[i].recurring_time,
+                g_tours[i].recurring_duration_ms,
+                g_tours[i].backward);
+        for (int j = 0; j < g_tours[i].spots_num; j++) {
+            fprintf(f,
+                    "%s\n        { \"preset\": %d, \"pt_speed\": %g, \"zoom_speed\": %g, \"stay_ms\": %d }",
+                    (j == 0) ? "" : ",",
+                    g_tours[i].spots[j].preset,
+                    g_tours[i].spots[j].pt_speed,
+                    g_tours[i].spots[j].zoom_speed,
+                    g_tours[i].spots[j].stay_ms);
+        }
+        fprintf(f, "%s] }%s\n", (g_tours[i].spots_num > 0) ? "\n      " : "", (i == g_tours_count - 1) ? "" : ",");
     }
     fprintf(f, "  ]\n}\n");
-    fclose(f);
+
+    ok = (fflush(f) == 0) && (fsync(fd) == 0);
+    if ((fclose(f) != 0) || !ok || (rename(tmp_file, preset_tours_file_path()) != 0)) {
+        log_error("Unable to write %s", preset_tours_file_path());
+        unlink(tmp_file);
+    }
 }
 
 static int tour_index_by_token(const char *token)
 {
-    for (int i = 0; i < g_tours_count; i++) {
-        if (strcmp(g_tours[i].token, token) == 0)
-            return i;
+    unsigned int slot;
+
+    if (g_tours_index_size == 0)
+        return -1;
+    slot = tour_token_hash(token) & (g_tours_index_size - 1);
+    while (g_tours_index[slot] != -1) {
+        if (strcmp(g_tours[g_tours_index[slot]].token, token) == 0)
+            return g_tours_index[slot];
+        slot = (slot + 1) & (g_tours_index_size - 1);
     }
     return -1;
 }
 
+/*
+ * Preset tours with spots run inside onvif_notify_server (see ptz_tour.c):
+ * Start loads the tour into shared memory with the motor command of every
+ * spot, Pause/Stop change its state, and the status comes back from there.
+ * Tours without spots, or without the daemon, still go to the
+ * preset_tour_start/stop/pause commands.
+ */
+static int tour_spot_command(const tour_spot_t *spot, char *command, size_t len)
+{
+    preset_t *preset = preset_by_number(spot->preset);
+    int n;
+
+    if (preset == NULL)
+        return -1;
+    // init_presets() leaves -1 when get_presets gives no position
+    if ((service_ctx.ptz_node.jump_to_abs_speed != NULL) && ((spot->pt_speed >= 0.0) || (spot->zoom_speed >= 0.0)) && (preset->x >= 0.0)
+        && (preset->y >= 0.0)) {
+        n = snprintf(command,
+                     len,
+                     service_ctx.ptz_node.jump_to_abs_speed,
+                     preset->x,
+                     preset->y,
+                     preset->z,
+                     (spot->pt_speed >= 0.0) ? spot->pt_speed : 0.0,
+                     (spot->zoom_speed >= 0.0) ? spot->zoom_speed : 0.0);
+    } else if (service_ctx.ptz_node.move_preset != NULL) {
+        n = snprintf(command, len, service_ctx.ptz_node.move_preset, spot->preset);
+    } else {
+        return -1;
+    }
+
+    return ((n < 0) || ((size_t) n >= len)) ? -1 : 0;
+}
+
+// @return 0 on success, -1 if onvif_notify_server doesn't run, -2 if a spot can't be reached
+static int tour_operate(const preset_tour_t *tour, const char *operation)
+{
+    shm_t *shm = shared_memory_attach();
+    ptz_tour_shm_t *run;
+    ptz_tour_spot_t spots[PTZ_TOUR_MAX_SPOTS];
+    long long now;
+    int i, ret = 0;
+
+    if (shm == NULL)
+        return -1;
+
+    if (strcasecmp(operation, "Start") == 0) {
+        init_presets();
+        for (i = 0; i < tour->spots_num; i++) {
+            if (tour_spot_command(&tour->spots[i], spots[i].command, sizeof(spots[i].command)) != 0) {
+                log_error("Preset tour %s: preset %d of spot %d is not available", tour->token, tour->spots[i].preset, i);
+                ret = -2;
+                break;
+            }
+            spots[i].stay_ms = tour->spots[i].stay_ms;
+        }
+        destroy_presets();
+        if (ret != 0)
+            return ret;
+    }
+
+    sem_memory_wait();
+    now = monotonic_ms();
+    run = &shm->ptz.tour;
+    if (now - shm->ptz.worker_ms > PTZ_WORKER_ALIVE_MS) {
+        ret = -1;
+    } else if (strcasecmp(operation, "Start") == 0) {
+        if ((run->state == PTZ_TOUR_PAUSED) && (strcmp(run->token, tour->token) == 0)) {
+            // Resume: the paused time doesn't count
+            run->next_ms += now - run->paused_ms;
+            if (run->end_ms != 0)
+                run->end_ms += now - run->paused_ms;
+        } else {
+            memset(run, '\0', sizeof(ptz_tour_shm_t));
+            strcpy(run->token, tour->token);
+            run->spots_num = tour->spots_num;
+            memcpy(run->spots, spots, sizeof(ptz_tour_spot_t) * tour->spots_num);
+            run->laps = tour->recurring_time;
+            run->backward = tour->backward;
+            run->end_ms = (tour->recurring_duration_ms > 0) ? now + tour->recurring_duration_ms : 0;
+            run->spot = -1;
+        }
+        run->state = PTZ_TOUR_TOURING;
+    } else if (strcmp(run->token, tour->token) == 0) {
+        if (strcasecmp(operation, "Stop") == 0) {
+            run->state = PTZ_TOUR_IDLE;
+        } else if (run->state == PTZ_TOUR_TOURING) {
+            run->state = PTZ_TOUR_PAUSED;
+            run->paused_ms = now;
+        }
+    }
+    sem_memory_post();
+
+    return ret;
+}
+
+static int xml_element_is(mxml_node_t *node, const char *name)
+{
+    const char *element_name, *colon;
+
+    if (mxmlGetType(node) != MXML_TYPE_ELEMENT)
+        return 0;
+    element_name = mxmlGetElement(node);
+    if (element_name == NULL)
+        return 0;
+    colon = strchr(element_name, ':');
+    return strcmp(colon ? colon + 1 : element_name, name) == 0;
+}
+
+/*
+ * Read StartingCondition and TourSpot of a tt:PresetTour.
+ * @return 0 on success, -1 if a spot is not valid
+ */
+static int tour_parse_request(preset_tour_t *tour, mxml_node_t *tour_node)
+{
+    mxml_node_t *starting, *child, *detail, *speed, *axis;
+    const char *value;
+    tour_spot_t *spot;
+    int stay_ms;
+
+    starting = get_element_in_element_ptr("StartingCondition", tour_node);
+    if (starting != NULL) {
+        value = get_element_in_element("RecurringTime", starting);
+        tour->recurring_time = (value != NULL) ? atoi(value) : 0;
+        if (tour->recurring_time < 0)
+            tour->recurring_time = 0;
+        value = get_element_in_element("RecurringDuration", starting);
+        tour->recurring_duration_ms = (value != NULL) ? duration2ms(value) : 0;
+        if (tour->recurring_duration_ms < 0)
+            return -1;
+        value = get_element_in_element("Direction", starting);
+        tour->backward = (value != NULL) && (strcmp(value, "Backward") == 0);
+    }
+
+    tour->spots_num = 0;
+    for (child = mxmlGetFirstChild(tour_node); child != NULL; child = mxmlGetNextSibling(child)) {
+        if (!xml_element_is(child, "TourSpot"))
+            continue;
+        if (tour->spots_num == PTZ_TOUR_MAX_SPOTS)
+            return -1;
+        spot = &tour->spots[tour->spots_num];
+        detail = get_element_in_element_ptr("PresetDetail", child);
+        value = (detail != NULL) ? get_element_in_element("PresetToken", detail) : NULL;
+        if ((value == NULL) || (sscanf(value, "PresetToken_%d", &spot->preset) != 1))
+            return -1;
+
+        spot->pt_speed = -1.0;
+        spot->zoom_speed = -1.0;
+        speed = get_element_in_element_ptr("Speed", child);
+        if (speed != NULL) {
+            axis = get_element_in_element_ptr("PanTilt", speed);
+            if ((axis != NULL) && ((value = get_attribute(axis, "x")) != NULL))
+                spot->pt_speed = fabs(atof(value));
+            axis = get_element_in_element_ptr("Zoom", speed);
+            if ((axis != NULL) && ((value = get_attribute(axis, "x")) != NULL))
+                spot->zoom_speed = fabs(atof(value));
+        }
+
+        value = get_element_in_element("StayTime", child);
+        stay_ms = (value != NULL) ? duration2ms(value) : 0;
+        if (stay_ms < 0)
+            return -1;
+        spot->stay_ms = stay_ms;
+        tour->spots_num++;
+    }
+
+    return 0;
+}
+
+static const char *tour_status(const preset_tour_t *tour)
+{
+    shm_t *shm = shared_memory_attach();
+    const char *status = tour->status[0] ? tour->status : "Idle";
+
+    if ((shm == NULL) || (tour->spots_num == 0))
+        return status;
+
+    sem_memory_wait();
+    if (monotonic_ms() - shm->ptz.worker_ms <= PTZ_WORKER_ALIVE_MS) {
+        status = "Idle";
+        if (strcmp(shm->ptz.tour.token, tour->token) == 0) {
+            if (shm->ptz.tour.state == PTZ_TOUR_TOURING)
+                status = "Touring";
+            else if (shm->ptz.tour.state == PTZ_TOUR_PAUSED)
+                status = "Paused";
+        }
+    }
+    sem_memory_post();
+
+    return status;
+}
+
 int ptz_get_service_capabilities()
 {
     char eflip_supported[8];
@@ -889,29 +1556,13 @@ int ptz_get_presets()
         for (i = 0; i < presets.count; i++) {
             sprintf(token, "PresetToken_%d", presets.items[i].number);
             // Convert from machine units to ONVIF units
-            double pan_onvif = ptz_machine_to_onvif_units(presets.items[i].x,
-                                                          service_ctx.ptz_node.min_step_x,
-                                                          service_ctx.ptz_node.max_step_x,
-                                                          service_ctx.ptz_node.pan_min,
-                                                          service_ctx.ptz_node.pan_max,
-                                                          service_ctx.ptz_node.pan_inverted,
-                                                          false);
-            double tilt_onvif = ptz_machine_to_onvif_units(presets.items[i].y,
-                                                           service_ctx.ptz_node.min_step_y,
-                                                           service_ctx.ptz_node.max_step_y,
-                                                           service_ctx.ptz_node.tilt_min,
-                                                           service_ctx.ptz_node.tilt_max,
-                                                           service_ctx.ptz_node.tilt_inverted,
-                                                           false);
+            double v[3] = {presets.items[i].x, presets.items[i].y, presets.items[i].z};
+            ptz_transform(&service_ctx.ptz_node.to_onvif, v, PTZ_AXIS_X | PTZ_AXIS_Y | PTZ_AXIS_Z);
+            double pan_onvif = v[0];
+            double tilt_onvif = v[1];
+            double zoom_onvif = v[2];
             // Apply reverse after conversion to ONVIF space
             ptz_apply_reverse(&pan_onvif, &tilt_onvif);
-            double zoom_onvif = ptz_machine_to_onvif_units(presets.items[i].z,
-                                                           service_ctx.ptz_node.min_step_z,
-                                                           service_ctx.ptz_node.max_step_z,
-                                                           0.0,
-                                                           1.0,
-                                                           false,
-                                                           false);
             snprintf(sx, sizeof(sx), "%.4f", pan_onvif);
             snprintf(sy, sizeof(sy), "%.4f", tilt_onvif);
             snprintf(sz, sizeof(sz), "%.4f", zoom_onvif);
@@ -947,7 +1598,7 @@ int ptz_get_presets()
 int ptz_goto_preset()
 {
     const char *preset_token;
-    int i, preset_number, count, found;
+    int preset_number, count, found;
     char sys_command[MAX_LEN];
     mxml_node_t *node;
 
@@ -978,7 +1629,8 @@ int ptz_goto_preset()
             send_action_failed_fault("ptz_service", -3);
             return -3;
         }
-        run_command_silent(service_ctx.ptz_node.goto_home_position);
+        ptz_schedule_stop(0, 0);
+        ptz_run(service_ctx.ptz_node.goto_home_position);
         long size = cat(NULL, "ptz_service_files/GotoPreset.xml", 0);
         output_http_headers(size);
         return cat("stdout", "ptz_service_files/GotoPreset.xml", 0);
@@ -990,13 +1642,7 @@ int ptz_goto_preset()
 
     init_presets();
     count = presets.count;
-    found = 0;
-    for (i = 0; i < presets.count; i++) {
-        if (presets.items[i].number == preset_number) {
-            found = 1;
-            break;
-        }
-    }
+    found = (preset_by_number(preset_number) != NULL);
     destroy_presets();
 
     if (found == 0) {
@@ -1009,7 +1655,8 @@ int ptz_goto_preset()
     }
 
     sprintf(sys_command, service_ctx.ptz_node.move_preset, preset_number);
-    run_command_silent(sys_command);
+    ptz_schedule_stop(0, 0);
+    ptz_run(sys_command);
     long size = cat(NULL, "ptz_service_files/GotoPreset.xml", 0);
 
     output_http_headers(size);
@@ -1046,7 +1693,8 @@ int ptz_goto_home_position()
         send_action_failed_fault("ptz_service", -3);
         return -3;
     }
-    run_command_silent(service_ctx.ptz_node.goto_home_position);
+    ptz_schedule_stop(0, 0);
+    ptz_run(service_ctx.ptz_node.goto_home_position);
 
     long size = cat(NULL, "ptz_service_files/GotoHomePosition.xml", 0);
 
@@ -1063,8 +1711,11 @@ int ptz_continuous_move()
     double dx = 0.0, dy = 0.0, dz = 0.0;
     int pantilt_present = 0;
     int zoom_present = 0;
-    char sys_command[MAX_LEN];
+    char pantilt_command[MAX_LEN] = "";
+    char zoom_command[MAX_LEN] = "";
     int ret = -1;
+    int timeout_ms = PTZ_DEFAULT_TIMEOUT_MS;
+    int stop_pantilt = -1, stop_zoom = -1;
     mxml_node_t *node;
 
     log_debug("PTZ: ContinuousMove called");
@@ -1136,22 +1787,14 @@ int ptz_continuous_move()
             if (pan_has || tilt_has) {
                 ptz_apply_reverse(pan_has ? &pan_onvif : NULL, tilt_has ? &tilt_onvif : NULL);
             }
-            if (pan_has)
-                dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                service_ctx.ptz_node.min_step_x,
-                                                service_ctx.ptz_node.max_step_x,
-                                                service_ctx.ptz_node.pan_min,
-                                                service_ctx.ptz_node.pan_max,
-                                                service_ctx.ptz_node.pan_inverted,
-                                                true);
-            if (tilt_has)
-                dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                service_ctx.ptz_node.min_step_y,
-                                                service_ctx.ptz_node.max_step_y,
-                                                service_ctx.ptz_node.tilt_min,
-                                                service_ctx.ptz_node.tilt_max,
-                                                service_ctx.ptz_node.tilt_inverted,
-                                                true);
+            if (pan_has || tilt_has) {
+                double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                ptz_transform(&service_ctx.ptz_node.to_machine_translation, v, (pan_has ? PTZ_AXIS_X : 0) | (tilt_has ? PTZ_AXIS_Y : 0));
+                if (pan_has)
+                    dx = v[0];
+                if (tilt_has)
+                    dy = v[1];
+            }
         }
 
         // Look for Zoom as sibling of PanTilt under Velocity, not inside PanTilt
@@ -1172,11 +1815,23 @@ int ptz_continuous_move()
             log_debug("PTZ: Raw Z attribute: %s", z ? z : "NULL");
             if (z != NULL) {
                 double zoom_onvif = atof(z);
-                dz = ptz_onvif_to_machine_units(zoom_onvif, service_ctx.ptz_node.min_step_z, service_ctx.ptz_node.max_step_z, 0.0, 1.0, false, true);
+                dz = ptz_transform_axis(&service_ctx.ptz_node.to_machine_translation, 2, zoom_onvif);
             }
         }
     }
 
+    // The motors are stopped when Timeout elapses, even if the Stop is lost
+    const char *timeout = get_element("Timeout", "Body");
+    if (timeout != NULL) {
+        timeout_ms = duration2ms(timeout);
+        if (timeout_ms <= 0) {
+            log_warn("PTZ: Invalid ContinuousMove Timeout %s, using the default", timeout);
+            timeout_ms = PTZ_DEFAULT_TIMEOUT_MS;
+        } else if (timeout_ms > PTZ_MAX_TIMEOUT_MS) {
+            timeout_ms = PTZ_MAX_TIMEOUT_MS;
+        }
+    }
+
     // Parse velocities first
     if (x != NULL)
         log_debug("PTZ: ContinuousMove X velocity (normalized): %f", dx);
@@ -1213,9 +1868,9 @@ int ptz_continuous_move()
     // Execute movement commands based on what's needed
     if (use_both) {
         // Use single command for true diagonal movement
-        sprintf(sys_command, service_ctx.ptz_node.move_both, x_target, y_target);
-        log_debug("PTZ: Executing move_both command: %s", sys_command);
-        run_command_silent(sys_command);
+        sprintf(pantilt_command, service_ctx.ptz_node.move_both, x_target, y_target);
+        log_debug("PTZ: Executing move_both command: %s", pantilt_command);
+        stop_pantilt = timeout_ms;
         ret = 0;
     } else if (has_x_only) {
         // X movement only
@@ -1223,9 +1878,9 @@ int ptz_continuous_move()
             send_action_failed_fault("ptz_service", -3);
             return -3;
         }
-        sprintf(sys_command, service_ctx.ptz_node.move_x, x_target);
-        log_debug("PTZ: Executing move_x command: %s", sys_command);
-        run_command_silent(sys_command);
+        sprintf(pantilt_command, service_ctx.ptz_node.move_x, x_target);
+        log_debug("PTZ: Executing move_x command: %s", pantilt_command);
+        stop_pantilt = timeout_ms;
         ret = 0;
     } else if (has_y_only) {
         // Y movement only
@@ -1233,9 +1888,9 @@ int ptz_continuous_move()
             send_action_failed_fault("ptz_service", -4);
             return -4;
         }
-        sprintf(sys_command, service_ctx.ptz_node.move_y, y_target);
-        log_debug("PTZ: Executing move_y command: %s", sys_command);
-        run_command_silent(sys_command);
+        sprintf(pantilt_command, service_ctx.ptz_node.move_y, y_target);
+        log_debug("PTZ: Executing move_y command: %s", pantilt_command);
+        stop_pantilt = timeout_ms;
         ret = 0;
     }
 
@@ -1245,33 +1900,35 @@ int ptz_continuous_move()
                 send_action_failed_fault("ptz_service", -7);
                 return -7;
             }
-            sprintf(sys_command, service_ctx.ptz_node.move_in, dz);
-            run_command_silent(sys_command);
+            sprintf(zoom_command, service_ctx.ptz_node.move_in, dz);
+            stop_zoom = timeout_ms;
             ret = 0;
         } else if (dz < 0.0) {
             if (service_ctx.ptz_node.move_out == NULL) {
                 send_action_failed_fault("ptz_service", -8);
                 return -8;
             }
-            sprintf(sys_command, service_ctx.ptz_node.move_out, -dz);
-            run_command_silent(sys_command);
+            sprintf(zoom_command, service_ctx.ptz_node.move_out, -dz);
+            stop_zoom = timeout_ms;
             ret = 0;
         }
     }
 
     // Per spec: zero velocity in an axis shall stop that axis
     if (pantilt_present && x != NULL && y != NULL && dx == 0.0 && dy == 0.0 && service_ctx.ptz_node.move_stop != NULL) {
-        sprintf(sys_command, service_ctx.ptz_node.move_stop, "pantilt");
+        sprintf(pantilt_command, service_ctx.ptz_node.move_stop, "pantilt");
         log_debug("PTZ: Stopping pan/tilt due to zero velocity");
-        run_command_silent(sys_command);
+        stop_pantilt = 0;
         ret = 0;
     }
     if (zoom_present && z != NULL && dz == 0.0 && service_ctx.ptz_node.move_stop != NULL) {
-        sprintf(sys_command, service_ctx.ptz_node.move_stop, "zoom");
+        sprintf(zoom_command, service_ctx.ptz_node.move_stop, "zoom");
         log_debug("PTZ: Stopping zoom due to zero velocity");
-        run_command_silent(sys_command);
+        stop_zoom = 0;
         ret = 0;
     }
+    ptz_post(pantilt_command[0] ? pantilt_command : NULL, zoom_command[0] ? zoom_command : NULL);
+    ptz_schedule_stop(stop_pantilt, stop_zoom);
 
     long size = cat(NULL, "ptz_service_files/ContinuousMove.xml", 0);
 
@@ -1392,20 +2049,10 @@ int ptz_relative_move()
                 // Apply reverse if needed (in ONVIF space before conversion)
                 ptz_apply_reverse(&pan_onvif, &tilt_onvif);
                 // Convert from ONVIF delta to machine delta
-                dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                service_ctx.ptz_node.min_step_x,
-                                                service_ctx.ptz_node.max_step_x,
-                                                service_ctx.ptz_node.pan_min,
-                                                service_ctx.ptz_node.pan_max,
-                                                service_ctx.ptz_node.pan_inverted,
-                                                true);
-                dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                service_ctx.ptz_node.min_step_y,
-                                                service_ctx.ptz_node.max_step_y,
-                                                service_ctx.ptz_node.tilt_min,
-                                                service_ctx.ptz_node.tilt_max,
-                                                service_ctx.ptz_node.tilt_inverted,
-                                                true);
+                double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                ptz_transform(&service_ctx.ptz_node.to_machine_translation, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                dx = v[0];
+                dy = v[1];
                 pantilt_present = 1;
             }
         } else if (strcmp(PTZ_URI_PANTILT_REL_FOV, space_p) == 0) {
@@ -1421,20 +2068,10 @@ int ptz_relative_move()
                     ret = -10;
                 }
                 if (ret == 0) {
-                    dx = ptz_fov_to_machine_units(dx,
-                                                  service_ctx.ptz_node.min_step_x,
-                                                  service_ctx.ptz_node.max_step_x,
-                                                  service_ctx.ptz_node.pan_min,
-                                                  service_ctx.ptz_node.pan_max,
-                                                  service_ctx.ptz_node.fov_pan,
-                                                  service_ctx.ptz_node.pan_inverted);
-                    dy = ptz_fov_to_machine_units(dy,
-                                                  service_ctx.ptz_node.min_step_y,
-                                                  service_ctx.ptz_node.max_step_y,
-                                                  service_ctx.ptz_node.tilt_min,
-                                                  service_ctx.ptz_node.tilt_max,
-                                                  service_ctx.ptz_node.fov_tilt,
-                                                  service_ctx.ptz_node.tilt_inverted);
+                    double v[3] = {dx, dy, 0.0};
+                    ptz_transform(&service_ctx.ptz_node.to_machine_fov, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                    dx = v[0];
+                    dy = v[1];
                     ptz_apply_reverse(&dx, &dy);
                     pantilt_present = 1;
                 }
@@ -1457,7 +2094,7 @@ int ptz_relative_move()
             } else {
                 double zoom_onvif = atof(z);
                 // Convert from ONVIF delta to machine delta
-                dz = ptz_onvif_to_machine_units(zoom_onvif, service_ctx.ptz_node.min_step_z, service_ctx.ptz_node.max_step_z, 0.0, 1.0, false, true);
+                dz = ptz_transform_axis(&service_ctx.ptz_node.to_machine_translation, 2, zoom_onvif);
                 zoom_present = 1;
             }
         } else {
@@ -1492,7 +2129,10 @@ int ptz_relative_move()
     }
 
     if (ret == 0) {
-        run_command_silent(sys_command);
+        double delta[3] = {dx, dy, dz};
+        ptz_schedule_stop(0, 0);
+        if (ptz_plan_move(delta, pantilt_present, zoom_present, 1, pt_speed, zoom_speed) != 0)
+            ptz_run(sys_command);
 
         long size = cat(NULL, "ptz_service_files/RelativeMove.xml", 0);
 
@@ -1568,20 +2208,10 @@ int ptz_absolute_move()
                     // Apply reverse if needed (in ONVIF space before conversion)
                     ptz_apply_reverse(&pan_onvif, &tilt_onvif);
                     // Convert from ONVIF units to machine units (generic space: -1 to 1)
-                    dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                    service_ctx.ptz_node.min_step_x,
-                                                    service_ctx.ptz_node.max_step_x,
-                                                    -1.0,
-                                                    1.0,
-                                                    service_ctx.ptz_node.pan_inverted,
-                                                    false);
-                    dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                    service_ctx.ptz_node.min_step_y,
-                                                    service_ctx.ptz_node.max_step_y,
-                                                    -1.0,
-                                                    1.0,
-                                                    service_ctx.ptz_node.tilt_inverted,
-                                                    false);
+                    double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                    ptz_transform(&service_ctx.ptz_node.to_machine_generic, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                    dx = v[0];
+                    dy = v[1];
                     pantilt_present = 1;
                 }
             } else if (strcmp(space_attr, PTZ_URI_PANTILT_ABS_SPHERICAL) == 0) {
@@ -1593,20 +2223,10 @@ int ptz_absolute_move()
                     // Apply reverse if needed (in ONVIF space before conversion)
                     ptz_apply_reverse(&pan_onvif, &tilt_onvif);
                     // Convert from ONVIF units to machine units (spherical space: pan_min/max, tilt_min/max)
-                    dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                    service_ctx.ptz_node.min_step_x,
-                                                    service_ctx.ptz_node.max_step_x,
-                                                    service_ctx.ptz_node.pan_min,
-                                                    service_ctx.ptz_node.pan_max,
-                                                    service_ctx.ptz_node.pan_inverted,
-                                                    false);
-                    dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                    service_ctx.ptz_node.min_step_y,
-                                                    service_ctx.ptz_node.max_step_y,
-                                                    service_ctx.ptz_node.tilt_min,
-                                                    service_ctx.ptz_node.tilt_max,
-                                                    service_ctx.ptz_node.tilt_inverted,
-                                                    false);
+                    double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                    ptz_transform(&service_ctx.ptz_node.to_machine_spherical, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                    dx = v[0];
+                    dy = v[1];
                     pantilt_present = 1;
                 }
             } else {
@@ -1635,7 +2255,7 @@ int ptz_absolute_move()
             if (z != NULL) {
                 double zoom_onvif = atof(z);
                 // Convert from ONVIF units (0.0 to 1.0) to machine units
-                dz = ptz_onvif_to_machine_units(zoom_onvif, service_ctx.ptz_node.min_step_z, service_ctx.ptz_node.max_step_z, 0.0, 1.0, false, false);
+                dz = ptz_transform_axis(&service_ctx.ptz_node.to_machine_generic, 2, zoom_onvif);
                 zoom_present = 1;
             }
         }
@@ -1704,7 +2324,10 @@ int ptz_absolute_move()
     }
 
     if (ret == 0) {
-        run_command_silent(sys_command);
+        double target[3] = {dx, dy, dz};
+        ptz_schedule_stop(0, 0);
+        if (ptz_plan_move(target, pantilt_present, zoom_present, 0, pt_speed, zoom_speed) != 0)
+            ptz_run(sys_command);
 
         long size = cat(NULL, "ptz_service_files/AbsoluteMove.xml", 0);
 
@@ -1760,16 +2383,17 @@ int ptz_stop()
         zoom = 0;
     }
 
+    ptz_schedule_stop(pantilt ? 0 : -1, zoom ? 0 : -1);
     if (pantilt && zoom) {
         sprintf(sys_command, service_ctx.ptz_node.move_stop, "all");
         log_debug("PTZ: Executing stop command: %s", sys_command);
-        run_command_silent(sys_command);
+        ptz_post(sys_command, "");
     } else if (pantilt) {
         sprintf(sys_command, service_ctx.ptz_node.move_stop, "pantilt");
-        run_command_silent(sys_command);
+        ptz_post(sys_command, NULL);
     } else if (zoom) {
         sprintf(sys_command, service_ctx.ptz_node.move_stop, "zoom");
-        run_command_silent(sys_command);
+        ptz_post(NULL, sys_command);
     }
 
     long size = cat(NULL, "ptz_service_files/Stop.xml", 0);
@@ -1785,10 +2409,9 @@ int ptz_get_status()
     time_t timestamp = time(NULL);
     struct tm *tm = gmtime(&timestamp);
     int ret = 0;
-    FILE *fp;
     double x, y, z = 1.0;
     int i = 0;
-    char out[256], sx[128], sy[128], sz[128], si[128];
+    char sx[128], sy[128], sz[128], si[128];
     mxml_node_t *node;
 
     node = get_element_ptr(NULL, "ProfileToken", "Body");
@@ -1814,65 +2437,25 @@ int ptz_get_status()
 
     sprintf(utctime, "%04d-%02d-%02dT%02d:%02d:%02dZ", tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
 
-    // Run command that returns to stdout x and y position in the form x,y
-    if (service_ctx.ptz_node.get_position != NULL) {
-        fp = popen(service_ctx.ptz_node.get_position, "r");
-        if (fp == NULL) {
-            ret = -3;
-        } else {
-            if (fgets(out, sizeof(out), fp) == NULL) {
-                ret = -4;
-            } else {
-                if (sscanf(out, "%lf,%lf,%lf", &x, &y, &z) < 2) {
-                    ret = -5;
-                }
-            }
-            pclose(fp);
-        }
-    } else {
-        // If the cam doesn't know the status, return a fault
-        ret = -6;
-    }
-
-    // Run command that returns to stdout if PTZ is moving (1) or not (0)
-    if (service_ctx.ptz_node.is_moving != NULL) {
-        fp = popen(service_ctx.ptz_node.is_moving, "r");
-        if (fp == NULL) {
-            ret = -7;
-        } else {
-            if (fgets(out, sizeof(out), fp) == NULL) {
-                ret = -8;
-            } else {
-                if (sscanf(out, "%d", &i) < 1) {
-                    ret = -9;
-                }
-            }
-            pclose(fp);
-        }
-    } else {
-        // If the cam doesn't know the status, return IDLE
-        i = 0;
+    // Position and moving flag: the planned position during a planned move,
+    // else the state sampled by onvif_notify_server when it is recent enough,
+    // else get_position/is_moving
+    if (ptz_plan_read(&x, &y, &z, &i) == 0) {
+        ret = 0;
+    } else if (ptz_state_read(&x, &y, &z, &i, &ret) != 0) {
+        ret = ptz_backend_get_status(&x, &y, &z, &i);
+        ptz_state_store(x, y, z, i, ret);
     }
 
     if (ret == 0) {
         // Convert from machine units to ONVIF units
-        double pan_onvif = ptz_machine_to_onvif_units(x,
-                                                      service_ctx.ptz_node.min_step_x,
-                                                      service_ctx.ptz_node.max_step_x,
-                                                      service_ctx.ptz_node.pan_min,
-                                                      service_ctx.ptz_node.pan_max,
-                                                      service_ctx.ptz_node.pan_inverted,
-                                                      false);
-        double tilt_onvif = ptz_machine_to_onvif_units(y,
-                                                       service_ctx.ptz_node.min_step_y,
-                                                       service_ctx.ptz_node.max_step_y,
-                                                       service_ctx.ptz_node.tilt_min,
-                                                       service_ctx.ptz_node.tilt_max,
-                                                       service_ctx.ptz_node.tilt_inverted,
-                                                       false);
+        double v[3] = {x, y, z};
+        ptz_transform(&service_ctx.ptz_node.to_onvif, v, PTZ_AXIS_X | PTZ_AXIS_Y | PTZ_AXIS_Z);
+        double pan_onvif = v[0];
+        double tilt_onvif = v[1];
+        double zoom_onvif = v[2];
         // Apply reverse after conversion to ONVIF space
         ptz_apply_reverse(&pan_onvif, &tilt_onvif);
-        double zoom_onvif = ptz_machine_to_onvif_units(z, service_ctx.ptz_node.min_step_z, service_ctx.ptz_node.max_step_z, 0.0, 1.0, false, false);
         snprintf(sx, sizeof(sx), "%.4f", pan_onvif);
         snprintf(sy, sizeof(sy), "%.4f", tilt_onvif);
         snprintf(sz, sizeof(sz), "%.4f", zoom_onvif);
@@ -1920,6 +2503,8 @@ int ptz_set_preset()
     char sys_command[MAX_LEN];
     const char *preset_name;
     char preset_name_out[UUID_LEN + 8];
+    char previous_name[UUID_LEN + 8];
+    preset_t previous;
     const char *preset_token;
     mxml_node_t *node;
     char preset_token_out[16];
@@ -1944,18 +2529,13 @@ int ptz_set_preset()
 
     // Spec 5.4.1: fail if PTZ device is moving
     if (service_ctx.ptz_node.is_moving != NULL) {
-        FILE *fp_mv = popen(service_ctx.ptz_node.is_moving, "r");
-        if (fp_mv != NULL) {
-            char buf_mv[32];
-            if (fgets(buf_mv, sizeof(buf_mv), fp_mv) != NULL) {
-                int moving = 0;
-                if (sscanf(buf_mv, "%d", &moving) == 1 && moving == 1) {
-                    send_fault("ptz_service", "Receiver", "ter:Action", "ter:MovingPTZ", "Moving PTZ", "Preset cannot be set while PTZ unit is moving");
-                    pclose(fp_mv);
-                    return -3;
-                }
+        char buf_mv[32];
+        if (ptz_backend_query(service_ctx.ptz_node.is_moving, buf_mv, sizeof(buf_mv)) == 0) {
+            int moving = 0;
+            if (sscanf(buf_mv, "%d", &moving) == 1 && moving == 1) {
+                send_fault("ptz_service", "Receiver", "ter:Action", "ter:MovingPTZ", "Moving PTZ", "Preset cannot be set while PTZ unit is moving");
+                return -3;
             }
-            pclose(fp_mv);
         }
     }
 
@@ -2027,13 +2607,13 @@ int ptz_set_preset()
             return -5;
         }
 
-        preset_found = 0;
-        for (i = 0; i < presets.count; i++) {
-            if (presets.items[i].number == preset_number) {
-                strcpy(preset_name_out, presets.items[i].name);
-                preset_found = 1;
-                break;
-            }
+        preset_t *preset = preset_by_number(preset_number);
+        preset_found = (preset != NULL);
+        if (preset_found) {
+            strcpy(preset_name_out, preset->name);
+            strcpy(previous_name, preset->name);
+            previous = *preset;
+            previous.name = previous_name;
         }
         if (preset_found == 0) {
             destroy_presets();
@@ -2080,10 +2660,11 @@ int ptz_set_preset()
 
     destroy_presets();
 
-    // Unhandled race condition
     sprintf(sys_command, service_ctx.ptz_node.set_preset, preset_number, (char *) preset_name_out);
-    run_command_silent(sys_command);
-    sleep(1);
+    // A set_preset that reported success has stored the preset already
+    if (ptz_run(sys_command) != 0)
+        presets_wait_stored(preset_number, preset_name_out, (preset_token != NULL) ? &previous : NULL);
+    presets_invalidate();
 
     init_presets();
     if ((preset_token == NULL) && (presets_total_number == presets.count)) {
@@ -2139,7 +2720,7 @@ int ptz_set_home_position()
     }
 
     strcpy(sys_command, service_ctx.ptz_node.set_home_position);
-    run_command_silent(sys_command);
+    ptz_run(sys_command);
 
     long size = cat(NULL, "ptz_service_files/SetHomePosition.xml", 0);
 
@@ -2227,7 +2808,7 @@ int ptz_get_preset_tours()
                        "%NAME%",
                        g_tours[i].name[0] ? g_tours[i].name : "",
                        "%STATUS%",
-                       g_tours[i].status[0] ? g_tours[i].status : "Idle");
+                       tour_status(&g_tours[i]));
             if (pass == 0)
                 total += size;
             else
@@ -2285,7 +2866,7 @@ int ptz_get_preset_tour()
                     "%NAME%",
                     g_tours[idx].name[0] ? g_tours[idx].name : "",
                     "%STATUS%",
-                    g_tours[idx].status[0] ? g_tours[idx].status : "Idle");
+                    tour_status(&g_tours[idx]));
     output_http_headers(size);
     return cat("stdout",
                "ptz_service_files/GetPresetTour.xml",
@@ -2295,7 +2876,7 @@ int ptz_get_preset_tour()
                "%NAME%",
                g_tours[idx].name[0] ? g_tours[idx].name : "",
                "%STATUS%",
-               g_tours[idx].status[0] ? g_tours[idx].status : "Idle");
+               tour_status(&g_tours[idx]));
 }
 
 int ptz_get_preset_tour_options()
@@ -2376,6 +2957,7 @@ int ptz_create_preset_tour()
         strncpy(g_tours[g_tours_count].name, name, sizeof(g_tours[g_tours_count].name) - 1);
     strncpy(g_tours[g_tours_count].status, "Idle", sizeof(g_tours[g_tours_count].status) - 1);
     g_tours_count++;
+    tours_reindex();
     tours_save();
     long size = cat(NULL, "ptz_service_files/CreatePresetTour.xml", 2, "%TOKEN%", token);
     output_http_headers(size);
@@ -2403,7 +2985,10 @@ int ptz_modify_preset_tour()
                    "The requested profile token does not reference a PTZ configuration");
         return -2;
     }
+    mxml_node_t *tour_node = get_element_ptr(NULL, "PresetTour", "Body");
     const char *tour_token = get_element("PresetTourToken", "Body");
+    if (!tour_token && tour_node)
+        tour_token = get_attribute(tour_node, "token");
     if (!tour_token) {
         send_fault("ptz_service", "Sender", "ter:InvalidArgVal", "ter:NoToken", "No token", "The requested preset tour token does not exist");
         return -3;
@@ -2419,6 +3004,19 @@ int ptz_modify_preset_tour()
         memset(g_tours[idx].name, 0, sizeof(g_tours[idx].name));
         strncpy(g_tours[idx].name, name, sizeof(g_tours[idx].name) - 1);
     }
+    if (tour_node != NULL) {
+        preset_tour_t modified = g_tours[idx];
+        if (tour_parse_request(&modified, tour_node) != 0) {
+            send_fault("ptz_service",
+                       "Sender",
+                       "ter:InvalidArgVal",
+                       "ter:InvalidPresetTour",
+                       "Invalid preset tour",
+                       "The preset tour contains a tour spot or starting condition that is not supported");
+            return -5;
+        }
+        g_tours[idx] = modified;
+    }
     tours_save();
     long size = cat(NULL, "ptz_service_files/ModifyPresetTour.xml", 0);
     output_http_headers(size);
@@ -2458,6 +3056,28 @@ int ptz_operate_preset_tour()
         send_fault("ptz_service", "Sender", "ter:InvalidArgVal", "ter:NoToken", "No token", "The requested preset tour token does not exist");
         return -4;
     }
+    if ((strcasecmp(operation, "Start") != 0) && (strcasecmp(operation, "Stop") != 0) && (strcasecmp(operation, "Pause") != 0)) {
+        send_fault("ptz_service", "Sender", "ter:InvalidArgVal", "ter:ActionNotSupported", "Not supported", "Operation not supported");
+        return -8;
+    }
+    if (g_tours[idx].spots_num > 0) {
+        int ret = tour_operate(&g_tours[idx], operation);
+        if (ret == -2) {
+            send_fault("ptz_service",
+                       "Sender",
+                       "ter:InvalidArgVal",
+                       "ter:InvalidPresetTour",
+                       "Invalid preset tour",
+                       "A tour spot refers to a preset that does not exist");
+            return -9;
+        }
+        if (ret == 0) {
+            long size = cat(NULL, "ptz_service_files/OperatePresetTour.xml", 0);
+            output_http_headers(size);
+            return cat("stdout", "ptz_service_files/OperatePresetTour.xml", 0);
+        }
+        // onvif_notify_server is not running: fall back to the tour commands
+    }
     char cmd[MAX_LEN];
     int ok = 0;
     if (strcasecmp(operation, "Start") == 0) {
@@ -2489,7 +3109,7 @@ int ptz_operate_preset_tour()
         return -8;
     }
     if (ok) {
-        run_command_silent(cmd);
+        ptz_run(cmd);
         tours_save();
     }
     long size = cat(NULL, "ptz_service_files/OperatePresetTour.xml", 0);
@@ -2529,9 +3149,13 @@ int ptz_remove_preset_tour()
         send_fault("ptz_service", "Sender", "ter:InvalidArgVal", "ter:NoToken", "No token", "The requested preset tour token does not exist");
         return -4;
     }
+    // A removed tour must not keep running
+    if (g_tours[idx].spots_num > 0)
+        tour_operate(&g_tours[idx], "Stop");
     for (int i = idx; i < g_tours_count - 1; i++)
         g_tours[i] = g_tours[i + 1];
     g_tours_count--;
+    tours_reindex();
     tours_save();
     long size = cat(NULL, "ptz_service_files/RemovePresetTour.xml", 0);
     output_http_headers(size);
@@ -2576,7 +3200,7 @@ int ptz_move_and_start_tracking()
         int preset_number = 0;
         if (sscanf(preset_token, "PresetToken_%d", &preset_number) == 1) {
             snprintf(sys_command, sizeof(sys_command), service_ctx.ptz_node.move_preset, preset_number);
-            run_command_silent(sys_command);
+            ptz_run(sys_command);
         }
     } else {
         // Optional move to PTZVector position
@@ -2599,20 +3223,10 @@ int ptz_move_and_start_tracking()
                         // Apply reverse if needed (in ONVIF space before conversion)
                         ptz_apply_reverse(&pan_onvif, &tilt_onvif);
                         // Convert from ONVIF units to machine units (generic space: -1 to 1)
-                        dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                        service_ctx.ptz_node.min_step_x,
-                                                        service_ctx.ptz_node.max_step_x,
-                                                        -1.0,
-                                                        1.0,
-                                                        service_ctx.ptz_node.pan_inverted,
-                                                        false);
-                        dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                        service_ctx.ptz_node.min_step_y,
-                                                        service_ctx.ptz_node.max_step_y,
-                                                        -1.0,
-                                                        1.0,
-                                                        service_ctx.ptz_node.tilt_inverted,
-                                                        false);
+                        double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                        ptz_transform(&service_ctx.ptz_node.to_machine_generic, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                        dx = v[0];
+                        dy = v[1];
                         pantilt_present = 1;
                     }
                 } else if (strcmp(space_attr, PTZ_URI_PANTILT_ABS_SPHERICAL) == 0) {
@@ -2622,20 +3236,10 @@ int ptz_move_and_start_tracking()
                         // Apply reverse if needed (in ONVIF space before conversion)
                         ptz_apply_reverse(&pan_onvif, &tilt_onvif);
                         // Convert from ONVIF units to machine units (spherical space: pan_min/max, tilt_min/max)
-                        dx = ptz_onvif_to_machine_units(pan_onvif,
-                                                        service_ctx.ptz_node.min_step_x,
-                                                        service_ctx.ptz_node.max_step_x,
-                                                        service_ctx.ptz_node.pan_min,
-                                                        service_ctx.ptz_node.pan_max,
-                                                        service_ctx.ptz_node.pan_inverted,
-                                                        false);
-                        dy = ptz_onvif_to_machine_units(tilt_onvif,
-                                                        service_ctx.ptz_node.min_step_y,
-                                                        service_ctx.ptz_node.max_step_y,
-                                                        service_ctx.ptz_node.tilt_min,
-                                                        service_ctx.ptz_node.tilt_max,
-                                                        service_ctx.ptz_node.tilt_inverted,
-                                                        false);
+                        double v[3] = {pan_onvif, tilt_onvif, 0.0};
+                        ptz_transform(&service_ctx.ptz_node.to_machine_spherical, v, PTZ_AXIS_X | PTZ_AXIS_Y);
+                        dx = v[0];
+                        dy = v[1];
                         pantilt_present = 1;
                     }
                 } else {
@@ -2663,19 +3267,13 @@ int ptz_move_and_start_tracking()
                 if (z) {
                     double zoom_onvif = atof(z);
                     // Convert from ONVIF units to machine units
-                    dz = ptz_onvif_to_machine_units(zoom_onvif,
-                                                    service_ctx.ptz_node.min_step_z,
-                                                    service_ctx.ptz_node.max_step_z,
-                                                    0.0,
-                                                    1.0,
-                                                    false,
-                                                    false);
+                    dz = ptz_transform_axis(&service_ctx.ptz_node.to_machine_generic, 2, zoom_onvif);
                     zoom_present = 1;
                 }
             }
             if (pantilt_present || zoom_present) {
                 snprintf(sys_command, sizeof(sys_command), service_ctx.ptz_node.jump_to_abs, dx, dy, dz);
-                run_command_silent(sys_command);
+                ptz_run(sys_command);
             }
         }
     }
@@ -2683,7 +3281,7 @@ int ptz_move_and_start_tracking()
     // Start tracking
     strncpy(sys_command, service_ctx.ptz_node.start_tracking, sizeof(sys_command) - 1);
     sys_command[sizeof(sys_command) - 1] = '\0';
-    run_command_silent(sys_command);
+    ptz_run(sys_command);
 
     long size = cat(NULL, "ptz_service_files/MoveAndStartTracking.xml", 0);
 
@@ -2731,7 +3329,8 @@ int ptz_remove_preset()
     }
 
     sprintf(sys_command, service_ctx.ptz_node.remove_preset, preset_number);
-    run_command_silent(sys_command);
+    ptz_run(sys_command);
+    presets_invalidate();
 
     long size = cat(NULL, "ptz_service_files/RemovePreset.xml", 0);
 
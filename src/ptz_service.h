@@ -28,6 +28,8 @@ typedef struct {
 typedef struct {
     int count;
     preset_t *items;
+    int *index;    // Position in items by preset number, -1 = none
+    int index_len;
 } presets_t;
 
 int ptz_get_service_capabilities();
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2024 roleo.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ptz_tour.h"
+
+#include "log.h"
+#include "ptz_backend.h"
+
+#include <string.h>
+
+/*
+ * Preset tour runner.
+ * OperatePresetTour loads the tour into shm->ptz.tour with the motor command
+ * of each spot already expanded. The PTZ thread of onvif_notify_server calls
+ * ptz_tour_tick() on every tick: it sends the move to a spot, waits for the
+ * sampler to report that the motors stopped, stays there for the spot's
+ * StayTime and goes on with the next spot. There is one PTZ head, so only one
+ * tour runs and a single deadline (next_ms) is all the scheduling needed.
+ */
+#define PTZ_TOUR_MIN_TRAVEL_MS 300   // The motors may not report moving before this
+#define PTZ_TOUR_MAX_TRAVEL_MS 60000 // Stop waiting for the motors after this
+
+// Pick the next spot. @return 0 if there is one, -1 if the tour is over
+static int tour_advance(ptz_tour_shm_t *tour, long long now)
+{
+    if ((tour->end_ms != 0) && (now >= tour->end_ms))
+        return -1;
+
+    if (tour->spot < 0) {
+        tour->spot = tour->backward ? tour->spots_num - 1 : 0;
+        return 0;
+    }
+
+    tour->spot += tour->backward ? -1 : 1;
+    if ((tour->spot < 0) || (tour->spot >= tour->spots_num)) {
+        tour->lap++;
+        if ((tour->laps > 0) && (tour->lap >= tour->laps))
+            return -1;
+        tour->spot = tour->backward ? tour->spots_num - 1 : 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Run the current tour.
+ * sampling is 0 when the PTZ thread doesn't sample the motors: arrival is then
+ * assumed PTZ_TOUR_MIN_TRAVEL_MS after the move.
+ */
+void ptz_tour_tick(shm_t *shm, long long now, int sampling)
+{
+    ptz_tour_shm_t *tour = &shm->ptz.tour;
+    char command[PTZ_COMMAND_LEN];
+    int arrived;
+
+    command[0] = '\0';
+
+    sem_memory_wait();
+    if ((tour->state != PTZ_TOUR_TOURING) || (now < tour->next_ms)) {
+        sem_memory_post();
+        return;
+    }
+
+    if (tour->traveling) {
+        // Only a sample taken once the motors had time to start tells they stopped
+        arrived = !sampling || (now - tour->moved_ms >= PTZ_TOUR_MAX_TRAVEL_MS)
+                  || ((shm->ptz.sample_ms >= tour->moved_ms + PTZ_TOUR_MIN_TRAVEL_MS) && !shm->ptz.moving);
+        if (arrived) {
+            tour->traveling = 0;
+            tour->next_ms = now + tour->spots[tour->spot].stay_ms;
+            log_debug("Preset tour %s: at spot %d, staying %d ms", tour->token, tour->spot, tour->spots[tour->spot].stay_ms);
+        }
+    } else if (tour_advance(tour, now) != 0) {
+        tour->state = PTZ_TOUR_IDLE;
+        log_info("Preset tour %s completed", tour->token);
+    } else {
+        strcpy(command, tour->spots[tour->spot].command);
+        tour->traveling = 1;
+        tour->moved_ms = now;
+        tour->next_ms = now + PTZ_TOUR_MIN_TRAVEL_MS;
+    }
+    sem_memory_post();
+
+    if (command[0] == '\0')
+        return;
+
+    log_debug("Preset tour: executing %s", command);
+    ptz_backend_run(command);
+
+    sem_memory_wait();
+    shm->ptz.command_seq++;
+    shm->ptz.sample_ms = 0;
+    sem_memory_post();
+}
@@ -0,0 +1,350 @@
+/*
+ * Copyright (c) 2025 Thingino
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "relay_backend.h"
+
+#include "conf.h"
+#include "event_ingest.h"
+#include "gpio.h"
+#include "log.h"
+#include "onvif_simple_server.h"
+
+#include <fcntl.h>
+#include <json_config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Mode, DelayTime and IdleState set through SetRelayOutputSettings
+#define RELAY_SETTINGS_FILE DEFAULT_CONF_DIR "/relays.json"
+
+#define RELAY_DRIVE_ATTEMPTS 3 // Drives of one request when other requests switch the relay meanwhile
+
+extern service_context_t service_ctx;
+
+static unsigned long long settings_generation;
+
+// Custom token of the relay, or RelayOutputToken_<index>
+void relay_backend_token(int index, char *token, size_t token_len)
+{
+    const char *custom = service_ctx.relay_outputs[index].token;
+
+    if (custom != NULL && custom[0] != '\0')
+        snprintf(token, token_len, "%s", custom);
+    else
+        snprintf(token, token_len, "RelayOutputToken_%d", index);
+}
+
+// @return the index of the relay with this token, -1 if none
+int relay_backend_find(const char *token)
+{
+    char relay_token[64];
+    int i;
+
+    if (token == NULL)
+        return -1;
+    for (i = 0; i < service_ctx.relay_outputs_num; i++) {
+        relay_backend_token(i, relay_token, sizeof(relay_token));
+        if (strcmp(token, relay_token) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Apply RELAY_SETTINGS_FILE over the relays of the configuration. Entries
+ * are matched by token, so that they survive relays being added to the
+ * configuration.
+ */
+void relay_settings_load()
+{
+    JsonValue *doc, *list, *entry, *value;
+    int i, n, index;
+
+    settings_generation = file_generation(RELAY_SETTINGS_FILE);
+    doc = load_config(RELAY_SETTINGS_FILE);
+    if (doc == NULL)
+        return;
+
+    list = get_object_item(doc, "relays");
+    n = (list && list->type == JSON_ARRAY) ? get_array_size(list) : 0;
+    for (i = 0; i < n; i++) {
+        entry = get_array_item(list, i);
+        if (!entry || entry->type != JSON_OBJECT)
+            continue;
+        value = get_object_item(entry, "token");
+        if (!value || value->type != JSON_STRING)
+            continue;
+        index = relay_backend_find(value->value.string);
+        if (index < 0)
+            continue;
+
+        relay_output_t *relay = &service_ctx.relay_outputs[index];
+        value = get_object_item(entry, "mode");
+        if (value && value->type == JSON_STRING)
+            relay->mode = (strcasecmp(value->value.string, "Monostable") == 0) ? RELAY_MODE_MONOSTABLE : RELAY_MODE_BISTABLE;
+        value = get_object_item(entry, "delay_ms");
+        if (value && value->type == JSON_NUMBER)
+            relay->delay_ms = (int) value->value.number.integer;
+        value = get_object_item(entry, "idle_state");
+        if (value && value->type == JSON_STRING)
+            relay->idle_state = (strcasecmp(value->value.string, "open") == 0) ? IDLE_STATE_OPEN : IDLE_STATE_CLOSE;
+    }
+    free_json_value(doc);
+}
+
+/*
+ * Write the settings of all relays to a temporary file and rename it over
+ * RELAY_SETTINGS_FILE.
+ * @return 0 on success, -1 on error
+ */
+int relay_settings_save()
+{
+    char tmp_file[] = RELAY_SETTINGS_FILE ".XXXXXX";
+    char token[64];
+    FILE *f;
+    int fd, ok, i;
+
+    mkdir(DEFAULT_CONF_DIR, 0755);
+    fd = mkstemp(tmp_file);
+    if (fd == -1) {
+        log_error("Unable to create %s", tmp_file);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp_file);
+        return -1;
+    }
+    fprintf(f, "{\n  \"relays\": [\n");
+    for (i = 0; i < service_ctx.relay_outputs_num; i++) {
+        const relay_output_t *relay = &service_ctx.relay_outputs[i];
+        // Tokens are plain identifiers: no JSON escaping needed
+        relay_backend_token(i, token, sizeof(token));
+        fprintf(f,
+                "    { \"token\": \"%s\", \"mode\": \"%s\", \"delay_ms\": %d, \"idle_state\": \"%s\" }%s\n",
+                token,
+                (relay->mode == RELAY_MODE_MONOSTABLE) ? "Monostable" : "Bistable",
+                relay->delay_ms,
+                (relay->idle_state == IDLE_STATE_OPEN) ? "open" : "closed",
+                (i == service_ctx.relay_outputs_num - 1) ? "" : ",");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    ok = (fflush(f) == 0) && (fsync(fd) == 0);
+    if ((fclose(f) != 0) || !ok || (rename(tmp_file, RELAY_SETTINGS_FILE) != 0)) {
+        log_error("Unable to write %s", RELAY_SETTINGS_FILE);
+        unlink(tmp_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+// @return 0 if the relay was switched through its GPIO
+static int relay_gpio_set(const relay_output_t *relay, int closed)
+{
+    int level = closed ^ relay->gpio_active_low;
+
+    if (relay->gpio_line < 0)
+        return -1;
+    return gpio_set(relay->gpio_line, level);
+}
+
+static int relay_drive(const relay_output_t *relay, int active)
+{
+    // The active state is the opposite of the idle one
+    int closed = active ? (relay->idle_state == IDLE_STATE_OPEN) : (relay->idle_state != IDLE_STATE_OPEN);
+    const char *command = closed ? relay->close : relay->open;
+
+    if (relay_gpio_set(relay, closed) == 0)
+        return 0;
+    if (command == NULL || command[0] == '\0')
+        return (relay->gpio_line < 0) ? 0 : -1;
+
+    run_command_silent(command);
+    return 0;
+}
+
+/*
+ * Send the new LogicalState to onvif_notify_server. When its socket is not
+ * there, fall back to the input file of the event.
+ */
+static void relay_publish(const relay_output_t *relay, int active)
+{
+    struct sockaddr_un addr;
+    event_ingest_record_t rec;
+    const char *input_file;
+    int sock, sent = 0;
+
+    if (relay->event_id < 0 || relay->event_id >= service_ctx.events_num)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = EVENT_INGEST_MAGIC;
+    rec.version = EVENT_INGEST_VERSION;
+    rec.event_id = (uint8_t) relay->event_id;
+    rec.value = active ? 1 : 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, EVENT_INGEST_SOCKET);
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock != -1) {
+        sent = (sendto(sock, &rec, EVENT_INGEST_RECORD_SIZE(0), 0, (struct sockaddr *) &addr, sizeof(addr)) != -1);
+        close(sock);
+    }
+    if (sent)
+        return;
+
+    input_file = service_ctx.events[relay->event_id].input_file;
+    if (input_file == NULL)
+        return;
+    if (active) {
+        int fd = open(input_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd != -1)
+            close(fd);
+    } else {
+        unlink(input_file);
+    }
+}
+
+/*
+ * Switch the relay and publish the change, the cache already holds the new
+ * state. Another process may claim the other state while this one drives the
+ * relay, and finish first: after driving, the state cached by then is checked
+ * and the relay driven again if it differs, so the relay ends in the state
+ * claimed last.
+ */
+static int relay_apply(shm_t *shm, int index, int active)
+{
+    uint8_t state, cached;
+    int attempt, driven = active;
+
+    for (attempt = 0; attempt < RELAY_DRIVE_ATTEMPTS; attempt++) {
+        state = active ? RELAY_STATE_ACTIVE : RELAY_STATE_IDLE;
+        driven = active;
+        if (relay_drive(&service_ctx.relay_outputs[index], active) != 0) {
+            log_error("Unable to switch relay %d", index);
+            if (shm != NULL) {
+                sem_memory_wait();
+                if (shm->relays.state[index] == state)
+                    shm->relays.state[index] = RELAY_STATE_UNKNOWN;
+                sem_memory_post();
+            }
+            return -1;
+        }
+        if (shm == NULL)
+            break;
+
+        sem_memory_wait();
+        cached = shm->relays.state[index];
+        sem_memory_post();
+        if ((cached == state) || (cached == RELAY_STATE_UNKNOWN))
+            break;
+        log_debug("Relay %d set %s while switching it", index, (cached == RELAY_STATE_ACTIVE) ? "active" : "idle");
+        active = (cached == RELAY_STATE_ACTIVE);
+    }
+
+    relay_publish(&service_ctx.relay_outputs[index], driven);
+
+    return 0;
+}
+
+/*
+ * Switch relay index to its active or idle state and publish the change.
+ * The state is cached in shm (NULL when onvif_notify_server is not running):
+ * setting the state the relay is already in does nothing. Activating a
+ * monostable relay, even one that is already active, (re)starts its delay.
+ * @return 0 on success, -1 if the relay could not be switched
+ */
+int relay_backend_set(shm_t *shm, int index, int active)
+{
+    const relay_output_t *relay;
+    uint8_t state = active ? RELAY_STATE_ACTIVE : RELAY_STATE_IDLE;
+
+    if (index < 0 || index >= service_ctx.relay_outputs_num || index >= MAX_RELAY_OUTPUTS)
+        return -1;
+    relay = &service_ctx.relay_outputs[index];
+
+    if (shm != NULL) {
+        sem_memory_wait();
+        if (active && (relay->mode == RELAY_MODE_MONOSTABLE))
+            shm->relays.release_ms[index] = monotonic_ms() + relay->delay_ms;
+        else
+            shm->relays.release_ms[index] = 0;
+        if (shm->relays.state[index] == state) {
+            sem_memory_post();
+            log_debug("Relay %d already %s", index, active ? "active" : "idle");
+            return 0;
+        }
+        // Claimed before switching, so that concurrent identical requests switch once
+        shm->relays.state[index] = state;
+        sem_memory_post();
+    } else if (active && (relay->mode == RELAY_MODE_MONOSTABLE)) {
+        log_warn("Relay %d: onvif_notify_server not running, it won't go back to idle", index);
+    }
+
+    return relay_apply(shm, index, active);
+}
+
+/*
+ * Return the monostable relays whose delay elapsed to idle. Run by
+ * onvif_notify_server.
+ * @return the CLOCK_MONOTONIC time of the next release, 0 if none
+ */
+long long relay_backend_expire(shm_t *shm, long long now)
+{
+    int due[MAX_RELAY_OUTPUTS];
+    long long next = 0;
+    int i, n, due_num = 0;
+
+    n = (service_ctx.relay_outputs_num < MAX_RELAY_OUTPUTS) ? service_ctx.relay_outputs_num : MAX_RELAY_OUTPUTS;
+    sem_memory_wait();
+    for (i = 0; i < n; i++) {
+        long long release_ms = shm->relays.release_ms[i];
+        if (release_ms == 0)
+            continue;
+        if (release_ms <= now) {
+            // Claimed here: a new activation from now on switches the relay again
+            shm->relays.release_ms[i] = 0;
+            shm->relays.state[i] = RELAY_STATE_IDLE;
+            due[due_num++] = i;
+        } else if ((next == 0) || (release_ms < next)) {
+            next = release_ms;
+        }
+    }
+    sem_memory_post();
+
+    // The idle state may have changed since the configuration was loaded
+    if ((due_num > 0) && (file_generation(RELAY_SETTINGS_FILE) != settings_generation))
+        relay_settings_load();
+    for (i = 0; i < due_num; i++) {
+        log_debug("Relay %d back to idle", due[i]);
+        relay_apply(shm, due[i], 0);
+    }
+
+    return next;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2025 Thingino
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RELAY_BACKEND_H
+#define RELAY_BACKEND_H
+
+#include "utils.h"
+
+#include <stddef.h>
+
+#define RELAY_MAX_DELAY_MS 3600000 // Upper bound of the DelayTimes of GetRelayOutputOptions
+
+int relay_backend_find(const char *token);
+void relay_backend_token(int index, char *token, size_t token_len);
+int relay_backend_set(shm_t *shm, int index, int active);
+long long relay_backend_expire(shm_t *shm, long long now);
+void relay_settings_load();
+int relay_settings_save();
+
+#endif // RELAY_BACKEND_H
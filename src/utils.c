@@ -35,6 +35,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_WOLFSSL
 #include <wolfssl/options.h>
@@ -80,13 +81,16 @@ int sem_memory_open()
 
 /**
  * Close a semaphore
+ * @param destroy Set to 1 to also remove it (owner only: a process that
+ *                opens it afterwards would get a different semaphore)
  */
-void sem_memory_close()
+void sem_memory_close(int destroy)
 {
     if (sem_memory_lock != SEM_FAILED) {
         sem_close(sem_memory_lock);
         sem_memory_lock = SEM_FAILED;
-        sem_unlink(MEM_LOCK_FILE);
+        if (destroy)
+            sem_unlink(MEM_LOCK_FILE);
     }
     return;
 }
@@ -164,6 +168,23 @@ void *create_shared_memory(int create)
     return shared_area;
 }
 
+/**
+ * Attach to the shared memory of onvif_notify_server, once per process, for
+ * the services that read its state and hand it commands
+ * @return a pointer to the shared memory, NULL if the daemon is not running
+ */
+shm_t *shared_memory_attach()
+{
+    static int attached;
+    static shm_t *shm;
+
+    if (!attached) {
+        attached = 1;
+        shm = (shm_t *) create_shared_memory(0);
+    }
+    return shm;
+}
+
 /**
  * Destroy shared memory with enhanced safety checks
  * @param shared_area Pointer to the shared memory
@@ -186,7 +207,7 @@ void destroy_shared_memory(void *shared_area, int destroy_all)
         return;
     }
 
-    sem_memory_close();
+    sem_memory_close(destroy_all);
 
     if (munmap(shared_area, shared_seg_size) != 0) {
         log_error("munmap() failed: %s", strerror(errno));
@@ -396,15 +417,7 @@ long cat_soap_fault(char *out, const char *fault_subcode, const char *fault_reas
     return len;
 }
 
-/**
- * Read a file line by line and send to output after replacing arguments
- * @param out The output type: "stdout", char *ptr or NULL
- * @param filename The input file to process
- * @param num The number of variable arguments
- * @param ... The argument list to replace: src1, dst1, src2, dst2, etc...
- * @return the number of processed bytes (always >= 0), or 0 on error
- */
-long cat(char *out, char *filename, int num, ...)
+static long cat_va(char *out, char *filename, int num, va_list args)
 {
     va_list valist;
     char new_line[MAX_CAT_LEN];
@@ -437,7 +450,7 @@ long cat(char *out, char *filename, int num, ...)
     char line[MAX_CAT_LEN];
 
     while (fgets(line, sizeof(line), file)) {
-        va_start(valist, num);
+        va_copy(valist, args);
 
         memset(new_line, '\0', sizeof(new_line));
         for (i = 0; i < num / 2; i++) {
@@ -509,6 +522,74 @@ long cat(char *out, char *filename, int num, ...)
     return ret;
 }
 
+/**
+ * Read a file line by line and send to output after replacing arguments
+ * @param out The output type: "stdout", char *ptr or NULL
+ * @param filename The input file to process
+ * @param num The number of variable arguments
+ * @param ... The argument list to replace: src1, dst1, src2, dst2, etc...
+ * @return the number of processed bytes (always >= 0), or 0 on error
+ */
+long cat(char *out, char *filename, int num, ...)
+{
+    va_list valist;
+    long ret;
+
+    va_start(valist, num);
+    ret = cat_va(out, filename, num, valist);
+    va_end(valist);
+
+    return ret;
+}
+
+/**
+ * Same as cat(), into a buffer of the right size
+ * @return a malloc'ed string, NULL on error
+ */
+char *cat_alloc(char *filename, int num, ...)
+{
+    va_list valist;
+    char *buffer;
+    long size;
+
+    va_start(valist, num);
+    size = cat_va(NULL, filename, num, valist);
+    va_end(valist);
+
+    buffer = (char *) malloc(size + 1);
+    if (buffer == NULL)
+        return NULL;
+    buffer[0] = '\0';
+
+    va_start(valist, num);
+    cat_va(buffer, filename, num, valist);
+    va_end(valist);
+
+    return buffer;
+}
+
+/**
+ * Send a string that is already formatted (e.g. built with cat() into a buffer)
+ * @param out The output type: "stdout", char *ptr or NULL
+ * @param s The string to send
+ * @return the number of bytes
+ */
+long cat_string(char *out, const char *s)
+{
+    long len = strlen(s);
+
+    if (out == NULL) {
+        return len;
+    } else if (strcmp("stdout", out) == 0) {
+        fputs(s, stdout);
+        response_buffer_append(s, len);
+    } else {
+        strcpy(out, s);
+    }
+
+    return len;
+}
+
 /**
  * Get the IP address/netmask of an interface "name"
  * @param name The name of the interface
@@ -555,35 +636,96 @@ int get_ip_address(char *address, char *netmask, char *name)
     return 0;
 }
 
+// Milliseconds on CLOCK_MONOTONIC: comparable across processes, immune to
+// wall clock steps
+long long monotonic_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000L;
+}
+
+// Changes when path is replaced or rewritten, 0 if it doesn't exist
+unsigned long long file_generation(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return 0;
+    return ((unsigned long long) st.st_mtime << 32) ^ ((unsigned long long) st.st_mtim.tv_nsec << 2) ^ ((unsigned long long) st.st_ino << 16)
+           ^ (unsigned long long) st.st_size;
+}
+
+/*
+ * Runtime files (in /run) are replaced atomically: readers see the old
+ * content or the new one. run_file_create() creates dir if needed and
+ * returns a temporary file with the given mode that run_file_commit()
+ * renames to path.
+ */
+FILE *run_file_create(const char *dir, const char *path, mode_t mode, char *tmp_file, size_t tmp_file_len)
+{
+    FILE *fp;
+    int fd;
+
+    mkdir(dir, 0755);
+    snprintf(tmp_file, tmp_file_len, "%s.XXXXXX", path);
+    fd = mkstemp(tmp_file);
+    if (fd == -1)
+        return NULL;
+    fchmod(fd, mode);
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        close(fd);
+        unlink(tmp_file);
+    }
+
+    return fp;
+}
+
+void run_file_commit(FILE *fp, const char *tmp_file, const char *path)
+{
+    if (fclose(fp) != 0) {
+        unlink(tmp_file);
+        return;
+    }
+    if (rename(tmp_file, path) != 0)
+        unlink(tmp_file);
+}
+
 // Run a backend command with stdout silenced. The CGIs serve the HTTP response
 // on stdout; ircut/motors scripts print chatter that would corrupt the headers
 // (uhttpd then kills the CGI: "Bad Gateway").
-void run_command_silent(const char *command)
+// @return 0 if the command exited with status 0, -1 otherwise
+int run_command_silent(const char *command)
 {
-    int saved, nullfd;
+    int saved, nullfd, status;
 
     if (!command || !command[0])
-        return;
+        return -1;
 
     saved = dup(STDOUT_FILENO);
     if (saved < 0)
-        return;
+        return -1;
     nullfd = open("/dev/null", O_WRONLY);
     if (nullfd < 0) {
         close(saved);
-        return;
+        return -1;
     }
     dup2(nullfd, STDOUT_FILENO);
-    (void) system(command);
+    status = system(command);
     dup2(saved, STDOUT_FILENO);
     close(saved);
     close(nullfd);
+
+    return ((status != -1) && WIFEXITED(status) && (WEXITSTATUS(status) == 0)) ? 0 : -1;
 }
 
 // Build the <tt:SimpleItem .../> fragment for an event notification's Source
 // list (one element per configured source, all on a single line for the
-// template engine).
-void build_event_sources(char *out, size_t outlen, const event_t *ev)
+// template engine). A non-empty entry in values (may be NULL) replaces the
+// configured value of the source at the same position.
+void build_event_sources(char *out, size_t outlen, const event_t *ev, const char (*values)[EVENT_SOURCE_VALUE_LEN])
 {
     size_t used = 0;
 
@@ -593,11 +735,12 @@ void build_event_sources(char *out, size_t outlen, const event_t *ev)
 
     for (int i = 0; i < ev->sources_num; i++) {
         const event_source_t *src = &ev->sources[i];
-        if (!src->name || !src->name[0] || !src->value || !src->value[0])
+        const char *value = (values && values[i][0]) ? values[i] : src->value;
+        if (!src->name || !src->name[0] || !value || !value[0])
             continue;
         int n = snprintf(out + used, outlen - used,
                          "<tt:SimpleItem Name=\"%s\" Value=\"%s\"/>",
-                         src->name, src->value);
+                         src->name, value);
         if (n < 0 || (size_t) n >= outlen - used)
             break;
         used += (size_t) n;
@@ -1049,6 +1192,47 @@ void b64_encode(unsigned char *input, unsigned int input_size, unsigned char *ou
 #endif
 }
 
+/**
+ * Convert an xs:duration in ONVIF notation (PT[nH][nM][n[.n]S]) to ms
+ * @param duration String that represents the duration
+ * @return Duration in ms, -1 if malformed
+ */
+int duration2ms(const char *duration)
+{
+    const char *p = duration;
+    char *end;
+    double v, ms = 0.0;
+
+    if (strncmp(p, "PT", 2) != 0)
+        return -1;
+    p += 2;
+    if (*p == '\0')
+        return -1;
+    while (*p != '\0') {
+        v = strtod(p, &end);
+        if ((end == p) || (v < 0.0))
+            return -1;
+        switch (*end) {
+        case 'H':
+            ms += v * 3600000.0;
+            break;
+        case 'M':
+            ms += v * 60000.0;
+            break;
+        case 'S':
+            ms += v * 1000.0;
+            break;
+        default:
+            return -1;
+        }
+        p = end + 1;
+    }
+    if (ms > INT_MAX)
+        return INT_MAX;
+
+    return (int) ms;
+}
+
 /**
  * Convert an interval in ONVIF notation to a interval in seconds
  * @param interval String that represents the interval
@@ -1426,47 +1610,52 @@ void free_topic_expression(topic_expressions_t *p)
 }
 
 /**
- * Check if a TopicExpression contains a topic
- * @param topic The topic to find
- * @param topic_expression The TopicExpression string
- * @return 1 on success or if topic_expression is empty, 1 if not found
+ * Compile a TopicExpression against the configured events
+ * @param topic_expression The TopicExpression string (empty matches all)
+ * @param events The configured events
+ * @param events_num The number of configured events
+ * @return Bit mask with bit i set if events[i] matches the expression
  */
-int is_topic_in_expression(const char *topic_expression, char *topic)
+uint32_t topic_expression_mask(const char *topic_expression, const event_t *events, int events_num)
 {
-    int i;
+    int i, j;
+    uint32_t mask = 0;
     topic_expressions_t *te;
 
-    if ((topic_expression == NULL) || (topic_expression[0] == '\0')) {
-        return 1;
-    }
+    if (events_num > MAX_EVENTS)
+        events_num = MAX_EVENTS;
 
-    if (topic == NULL) {
-        return 0;
+    if ((topic_expression == NULL) || (topic_expression[0] == '\0')) {
+        for (i = 0; i < events_num; i++) {
+            if (events[i].topic != NULL)
+                mask |= (1U << i);
+        }
+        return mask;
     }
 
     te = parse_topic_expression(topic_expression);
-
     if (te == NULL)
         return 0;
 
-    for (i = 0; i < te->number; i++) {
-        if (te->topics[i].topic == NULL) {
+    for (i = 0; i < events_num; i++) {
+        if (events[i].topic == NULL)
             continue;
-        }
-        if (te->topics[i].match_sub_tree) {
-            if (strncmp(te->topics[i].topic, topic, strlen(te->topics[i].topic)) == 0) {
-                free_topic_expression(te);
-                return 1;
-            }
-        } else {
-            if (strcmp(te->topics[i].topic, topic) == 0) {
-                free_topic_expression(te);
-                return 1;
+        for (j = 0; j < te->number; j++) {
+            if (te->topics[j].topic == NULL)
+                continue;
+            if (te->topics[j].match_sub_tree) {
+                if (strncmp(te->topics[j].topic, events[i].topic, strlen(te->topics[j].topic)) == 0)
+                    break;
+            } else if (strcmp(te->topics[j].topic, events[i].topic) == 0) {
+                break;
             }
         }
+        if (j < te->number)
+            mask |= (1U << i);
     }
-    free_topic_expression(te); // Fix memory leak
-    return 0;
+    free_topic_expression(te);
+
+    return mask;
 }
 
 /**
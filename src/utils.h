@@ -22,6 +22,8 @@
 #include <semaphore.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include <time.h>
 
 #define MAX_LEN 1024
@@ -31,9 +33,23 @@
 
 #define MAX_RELAY_OUTPUTS 8
 #define MAX_IMAGING_ENTRIES 4
+#define IMAGING_SET_KEYS 9 // Imaging fields prudynt accepts in a SET line (PRUDYNT_SHM_FIELDS)
 #define MAX_SUBSCRIPTIONS 32 // MAX 32 - Increased from 8 to prevent subscription flooding
 #define MAX_EVENTS 8         // MAX 32
 #define CONSUMER_REFERENCE_MAX_SIZE 256
+#define EVENT_SOURCE_VALUE_LEN 32
+#define PTZ_COMMAND_LEN 256
+#define FOCUS_COMMAND_LEN 256
+#define PTZ_TOUR_MAX_SPOTS 32
+#define PTZ_TOUR_TOKEN_LEN 64
+
+#define PTZ_TOUR_IDLE 0
+#define PTZ_TOUR_TOURING 1
+#define PTZ_TOUR_PAUSED 2
+
+#define RELAY_STATE_UNKNOWN 0
+#define RELAY_STATE_IDLE 1
+#define RELAY_STATE_ACTIVE 2
 
 #define EVENTS_NONE 0
 #define EVENTS_PULLPOINT 1        // PullPoint
@@ -49,6 +65,7 @@ typedef struct {
     time_t expire;
     int push_need_sync;
     char topic_expression[MAX_LEN];
+    uint32_t topic_mask; // Bit mask: events matching topic_expression (compiled at subscribe time)
 } subscription_shm_t;
 
 typedef struct {
@@ -56,11 +73,102 @@ typedef struct {
     int is_on;
     uint32_t pull_send_initialized; // Bit mask: 1 if the value is not known to the client (new subscription) and must be sent
     uint32_t pull_notify;           // Bit mask: 1 if the client must be notified
+    char source_values[MAX_EVENT_SOURCES][EVENT_SOURCE_VALUE_LEN]; // Sent with the last event; "" = configured value
 } event_shm_t;
 
+typedef struct {
+    char command[PTZ_COMMAND_LEN]; // Motor command that moves to the spot
+    int stay_ms;
+} ptz_tour_spot_t;
+
+// Preset tour loaded by OperatePresetTour and run by onvif_notify_server
+typedef struct {
+    char token[PTZ_TOUR_TOKEN_LEN]; // "" = no tour loaded
+    int state;                      // PTZ_TOUR_IDLE, PTZ_TOUR_TOURING or PTZ_TOUR_PAUSED
+    int spots_num;
+    int laps;                       // RecurringTime, 0 = until stopped
+    int backward;                   // Direction Backward
+    long long end_ms;               // End of RecurringDuration, 0 = none
+    // Runner state
+    int spot;                       // Spot being visited, -1 = not started
+    int lap;
+    int traveling;                  // Moving to the spot, else staying there
+    long long moved_ms;             // When the move to the spot was sent
+    long long next_ms;              // Nothing to do for the tour before this time
+    long long paused_ms;            // When the tour was paused
+    ptz_tour_spot_t spots[PTZ_TOUR_MAX_SPOTS];
+} ptz_tour_shm_t;
+
+// AbsoluteMove/RelativeMove trajectory run by onvif_notify_server
+typedef struct {
+    int active;
+    double from[3];     // x, y, z in machine units
+    double to[3];
+    long long start_ms;
+    int duration_ms;    // Planned arrival time
+    int ramp_ms;        // Acceleration (and deceleration) time
+    long long next_step_ms;
+} ptz_plan_shm_t;
+
+// PTZ state sampled by onvif_notify_server and read by GetStatus
+typedef struct {
+    long long sample_ms;  // CLOCK_MONOTONIC time of the sample, 0 = stale
+    double x, y, z;       // Machine units, as printed by get_position
+    int moving;
+    int status;           // ptz_backend_get_status() result of the sample
+    uint32_t command_seq; // Bumped by every motor command
+    long long stop_pantilt_ms; // ContinuousMove Timeout: stop pan/tilt at this time, 0 = none
+    long long stop_zoom_ms;    // Same for zoom
+    long long worker_ms;       // Last tick of the PTZ thread, the mailboxes are only used while it runs
+    char pending_pantilt[PTZ_COMMAND_LEN]; // Latest ContinuousMove/Stop command not applied yet, "" = none
+    char pending_zoom[PTZ_COMMAND_LEN];
+    uint32_t presets_generation; // Bumped when presets change, retires the preset catalog
+    ptz_tour_shm_t tour;
+    ptz_plan_shm_t plan;
+} ptz_shm_t;
+
+// Focus of one imaging source, driven by onvif_notify_server
+typedef struct {
+    int state;                       // IMAGING_FOCUS_STATE_*
+    int has_position;
+    float position;                  // Last commanded position: absolute moves plus relative distances
+    int continuous;                  // A continuous move runs until Stop or stop_ms
+    long long stop_ms;               // Continuous move timeout: stop at this time, 0 = none
+    char pending[FOCUS_COMMAND_LEN]; // Absolute/continuous/stop command not applied yet, "" = none
+    int relative_num;                // Relative moves not applied yet, summed in relative_distance
+    float relative_distance;
+    float relative_speed;            // Speed of the latest one
+} focus_source_shm_t;
+
+typedef struct {
+    long long worker_ms; // Last tick of the focus thread, the mailboxes are only used while it runs
+    focus_source_shm_t sources[MAX_IMAGING_ENTRIES];
+} focus_shm_t;
+
+// SET values for prudynt, written to its FIFO by onvif_notify_server
+typedef struct {
+    long long worker_ms;               // Last tick of the imaging writer, the mailbox is only used while it runs
+    uint8_t pending[IMAGING_SET_KEYS]; // Field posted and not written yet
+    float value[IMAGING_SET_KEYS];     // Normalized value of each pending field
+    uint32_t failed_first;             // imaging_set_seq range of the posted SETs the writer could not send
+    uint32_t failed_last;
+} imaging_set_shm_t;
+
+// Relay output states as last switched through relay_backend_set()
+typedef struct {
+    uint8_t state[MAX_RELAY_OUTPUTS];       // RELAY_STATE_*
+    long long release_ms[MAX_RELAY_OUTPUTS]; // Monostable: onvif_notify_server returns it to idle at this time, 0 = none
+} relay_shm_t;
+
 typedef struct {
     subscription_shm_t subscriptions[MAX_SUBSCRIPTIONS];
     event_shm_t events[MAX_EVENTS];
+    ptz_shm_t ptz;
+    uint32_t imaging_set_seq; // Bumped by every SET sent to prudynt or posted to the imaging writer
+    uint32_t imaging_key_seq[IMAGING_SET_KEYS]; // imaging_set_seq of the last SET of each field
+    imaging_set_shm_t imaging_set;
+    focus_shm_t focus;
+    relay_shm_t relays;
 } shm_t;
 
 typedef struct {
@@ -75,9 +183,12 @@ typedef struct {
 
 void *create_shared_memory(int create);
 void destroy_shared_memory(void *shared_area, int destroy_all);
+shm_t *shared_memory_attach();
 int sem_memory_wait();
 int sem_memory_post();
 long cat(char *out, char *filename, int num, ...);
+long cat_string(char *out, const char *s);
+char *cat_alloc(char *filename, int num, ...);
 long cat_soap_fault(char *out, const char *fault_subcode, const char *fault_reason, const char *fault_detail);
 void output_http_headers(long content_length);
 
@@ -92,8 +203,12 @@ const char *response_buffer_get(size_t *size);
 void response_buffer_clear(void);
 int get_ip_address(char *address, char *netmask, char *name);
 int get_mac_address(char *address, char *name);
-void run_command_silent(const char *command);
-void build_event_sources(char *out, size_t outlen, const event_t *ev);
+long long monotonic_ms();
+unsigned long long file_generation(const char *path);
+int run_command_silent(const char *command);
+FILE *run_file_create(const char *dir, const char *path, mode_t mode, char *tmp_file, size_t tmp_file_len);
+void run_file_commit(FILE *fp, const char *tmp_file, const char *path);
+void build_event_sources(char *out, size_t outlen, const event_t *ev, const char (*values)[EVENT_SOURCE_VALUE_LEN]);
 void build_event_source_descriptions(char *out, size_t outlen, const event_t *ev);
 int netmask2prefixlen(char *netmask);
 int get_mtu(char *if_name);
@@ -104,6 +219,7 @@ int hashSHA1(char *input, unsigned long inputSize, char *output, int output_size
 void b64_decode(unsigned char *input, unsigned int input_size, unsigned char *output, unsigned long *output_size);
 void b64_encode(unsigned char *input, unsigned int input_size, unsigned char *output, unsigned long *output_size);
 int interval2sec(const char *interval);
+int duration2ms(const char *duration);
 int to_iso_date(char *iso_date, int size, time_t timestamp);
 time_t from_iso_date(const char *date);
 int gen_uuid(char *g_uuid);
@@ -117,6 +233,6 @@ int construct_uri_with_credentials(
 
 topic_expressions_t *parseTopicExpression(const char *input);
 void free_topic_expression(topic_expressions_t *p);
-int is_topic_in_expression(const char *topic_expression, char *topic);
+uint32_t topic_expression_mask(const char *topic_expression, const event_t *events, int events_num);
 
 #endif //UTILS_H
@@ -321,6 +321,10 @@ main() {
     run_soap_test "DeviceIO GetServiceCapabilities" "deviceio_service" "$SCRIPT_DIR/test_deviceio_getcapabilities.xml" "RelayOutputs"
     run_soap_test "DeviceIO GetRelayOutputs" "deviceio_service" "$SCRIPT_DIR/test_deviceio_getrelayoutputs.xml" "RelayOutputs"
     run_soap_test "DeviceIO GetRelayOutputOptions" "deviceio_service" "$REQUESTS_DIR/deviceio_getrelayoutputoptions.xml" "RelayOutputOptions"
+    # RelayOutputToken_0 is the relay of config/onvif.json
+    run_soap_test "DeviceIO SetRelayOutputSettings" "deviceio_service" "$REQUESTS_DIR/deviceio_setrelayoutputsettings.xml" "SetRelayOutputSettingsResponse"
+    run_soap_test "DeviceIO GetRelayOutputs (settings)" "deviceio_service" "$REQUESTS_DIR/deviceio_getrelayoutputs.xml" \
+        "<tt:Mode>Monostable</tt:Mode>[[:space:]]*<tt:DelayTime>PT2S</tt:DelayTime>[[:space:]]*<tt:IdleState>closed</tt:IdleState>"
     run_soap_test "DeviceIO GetVideoSources" "deviceio_service" "$REQUESTS_DIR/deviceio_getvideosources.xml" "VideoSources"
     run_soap_test "DeviceIO GetAudioSources" "deviceio_service" "$REQUESTS_DIR/deviceio_getaudiosources.xml" "AudioSources" "true"
     run_soap_test "DeviceIO GetAudioOutputs" "deviceio_service" "$REQUESTS_DIR/deviceio_getaudiooutputs.xml" "AudioOutputs" "true"
@@ -333,6 +337,9 @@ main() {
 
     run_soap_test "Media GetServiceCapabilities" "media_service" "$REQUESTS_DIR/media_getservicecapabilities.xml" "Capabilities"
     run_soap_test "Media GetProfiles" "media_service" "$REQUESTS_DIR/media_getprofiles.xml" "Profiles"
+    # Profile_2 only exists with a third stream, e.g. config/onvif_3profiles.json
+    run_soap_test "Media GetProfile" "media_service" "$REQUESTS_DIR/media_getprofile.xml" "Profile_2" "true"
+    run_soap_test "Media2 GetProfiles" "media2_service" "$REQUESTS_DIR/media2_getprofiles.xml" "Profiles" "true"
     run_soap_test "Media GetStreamUri" "media_service" "$REQUESTS_DIR/media_getstreamuri.xml" "MediaUri"
     run_soap_test "Media GetSnapshotUri" "media_service" "$REQUESTS_DIR/media_getsnapshoturi.xml" "MediaUri"
     run_soap_test "Media GetVideoSources" "media_service" "$REQUESTS_DIR/media_getvideosources.xml" "VideoSources"